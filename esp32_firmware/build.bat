@@ -37,7 +37,6 @@ if "%1"=="uploadfs" (
 
 if "%1"=="all" (
     echo Building and uploading everything...
-    pio run --target uploadfs
     pio run --target upload
     goto :done
 )
@@ -59,8 +58,8 @@ echo.
 echo Commands:
 echo   build     - Compile the firmware
 echo   upload    - Upload firmware to ESP32-C3
-echo   uploadfs  - Upload LittleFS filesystem (web files)
-echo   all       - Build and upload both firmware and filesystem
+echo   uploadfs  - Upload LittleFS filesystem (fallback web files)
+echo   all       - Build and upload the firmware, web files included
 echo   monitor   - Open serial monitor
 echo   clean     - Clean build files
 echo.
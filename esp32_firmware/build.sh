@@ -39,7 +39,6 @@ case "$1" in
         ;;
     all)
         echo -e "${YELLOW}Building and uploading everything...${NC}"
-        pio run --target uploadfs
         pio run --target upload
         ;;
     monitor)
@@ -56,8 +55,8 @@ case "$1" in
         echo "Commands:"
         echo "  build     - Compile the firmware"
         echo "  upload    - Upload firmware to ESP32-C3"
-        echo "  uploadfs  - Upload LittleFS filesystem (web files)"
-        echo "  all       - Build and upload both firmware and filesystem"
+        echo "  uploadfs  - Upload LittleFS filesystem (fallback web files)"
+        echo "  all       - Build and upload the firmware, web files included"
         echo "  monitor   - Open serial monitor"
         echo "  clean     - Clean build files"
         echo ""
@@ -1,6 +1,7 @@
 // Mate Tracker ESP32 App
 let state={users:[],items:[],consumption:[],payments:[]};
-document.addEventListener('DOMContentLoaded',()=>{applyConfig();fetchState();initEventListeners();checkDeviceStatus()});
+let sync={boot:null,version:null};
+document.addEventListener('DOMContentLoaded',()=>{applyConfig();fetchState();initEventListeners();checkDeviceStatus();setInterval(checkDeviceStatus,30000);connectEvents()});
 
 function applyConfig(){
 document.getElementById('appTitle').textContent=`${CONFIG.appEmoji} ${CONFIG.appName}`;
@@ -29,7 +30,6 @@ const d=await r.json();
 document.getElementById('statusText').textContent=`Connected • ${d.wifi.ip}`;
 }else{document.getElementById('statusText').textContent='Connected';}
 }catch(e){document.getElementById('statusText').textContent='Offline';}
-setInterval(checkDeviceStatus,30000);
 }
 
 async function apiCall(endpoint,method='GET',body=null){
@@ -43,9 +43,46 @@ return d;
 }catch(e){alert(e.message);console.error('API:',e);return null;}
 }
 
+// Query string asking for only the changes since our copy of the state
+function since(){
+return sync.boot===null?'':`?since=${sync.version}&boot=${sync.boot}`;
+}
+
+// Apply a /api/changes response: a full state or a list of changes
+function applyChanges(d){
+if(d.state){state=d.state;}
+else{
+for(const c of d.changes){
+const list=state[c.in];
+if(c.op==='put'){
+const i=list.findIndex(r=>r.id===c.record.id);
+if(i>=0)list[i]=c.record;else list.push(c.record);
+}else{
+const k=c.id!==undefined?'id':c.userId!==undefined?'userId':'itemId';
+state[c.in]=list.filter(r=>r[k]!==c[k]);
+}
+}
+}
+sync={boot:d.boot,version:d.version};
+}
+
 async function fetchState(){
-const s=await apiCall('/api/state');
-if(s){state=s;render();}
+const s=await apiCall(`/api/changes${since()}`);
+if(s){applyChanges(s);render();}
+}
+
+// Changes made from other browsers, pushed by the device
+function connectEvents(){
+const ws=new WebSocket(`ws://${location.host}/api/events`);
+ws.onmessage=e=>{
+const d=JSON.parse(e.data);
+if(d.boot===sync.boot&&d.version<=sync.version)return;
+if(d.state||(d.boot===sync.boot&&d.since<=sync.version)){applyChanges(d);render();}
+else fetchState();
+};
+// Catch up on changes missed while disconnected
+ws.onopen=()=>{if(sync.boot!==null)fetchState();};
+ws.onclose=()=>setTimeout(connectEvents,5000);
 }
 
 function initEventListeners(){
@@ -61,14 +98,14 @@ async function addUser(){
 const i=document.getElementById('userName');
 const n=i.value.trim();
 if(!n){alert('Enter name');return;}
-const s=await apiCall('/api/users','POST',{name:n});
-if(s){state=s;i.value='';render();}
+const s=await apiCall(`/api/users${since()}`,'POST',{name:n});
+if(s){applyChanges(s);i.value='';render();}
 }
 
 async function removeUser(id){
 if(!confirm('Remove user and all their data?'))return;
-const s=await apiCall(`/api/users/${id}`,'DELETE');
-if(s){state=s;render();}
+const s=await apiCall(`/api/users/${id}${since()}`,'DELETE');
+if(s){applyChanges(s);render();}
 }
 
 async function addItem(){
@@ -80,14 +117,14 @@ const p=parseFloat(pi.value);
 const st=parseInt(si.value)||CONFIG.defaults.initialStock;
 if(!n){alert('Enter item name');return;}
 if(!p||p<=0){alert('Enter valid price');return;}
-const s=await apiCall('/api/items','POST',{name:n,price:p,stock:st});
-if(s){state=s;ni.value='';pi.value='';si.value=CONFIG.defaults.initialStock;render();}
+const s=await apiCall(`/api/items${since()}`,'POST',{name:n,price:p,stock:st});
+if(s){applyChanges(s);ni.value='';pi.value='';si.value=CONFIG.defaults.initialStock;render();}
 }
 
 async function removeItem(id){
 if(!confirm('Remove item and all data?'))return;
-const s=await apiCall(`/api/items/${id}`,'DELETE');
-if(s){state=s;render();}
+const s=await apiCall(`/api/items/${id}${since()}`,'DELETE');
+if(s){applyChanges(s);render();}
 }
 
 async function updateItemStock(id){
@@ -95,8 +132,8 @@ const ns=prompt('New stock amount:');
 if(ns===null)return;
 const st=parseInt(ns);
 if(isNaN(st)||st<0){alert('Invalid stock');return;}
-const s=await apiCall(`/api/items/${id}/stock`,'PUT',{stock:st});
-if(s){state=s;render();}
+const s=await apiCall(`/api/items/${id}/stock${since()}`,'PUT',{stock:st});
+if(s){applyChanges(s);render();}
 }
 
 async function recordConsumption(){
@@ -106,8 +143,8 @@ const ai=document.getElementById('consumptionAmount');
 const uid=us.value,iid=is.value,qty=parseInt(ai.value);
 if(!uid||!iid){alert('Select user and item');return;}
 if(!qty||qty<=0){alert('Enter valid quantity');return;}
-const s=await apiCall('/api/consumption','POST',{userId:uid,itemId:iid,quantity:qty});
-if(s){state=s;ai.value='1';render();}
+const s=await apiCall(`/api/consumption${since()}`,'POST',{userId:uid,itemId:iid,quantity:qty});
+if(s){applyChanges(s);ai.value='1';render();}
 }
 
 async function processPayment(){
@@ -117,8 +154,8 @@ const ai=document.getElementById('paymentAmount');
 const uid=us.value,iid=is.value,amt=parseFloat(ai.value);
 if(!uid||!iid){alert('Select user and item');return;}
 if(!amt||amt<=0){alert('Enter valid amount');return;}
-const s=await apiCall('/api/payments','POST',{userId:uid,itemId:iid,amount:amt});
-if(s){state=s;ai.value='';render();}
+const s=await apiCall(`/api/payments${since()}`,'POST',{userId:uid,itemId:iid,amount:amt});
+if(s){applyChanges(s);ai.value='';render();}
 }
 
 function getTotalConsumed(itemId=null){
@@ -0,0 +1,286 @@
+/**
+ * Arduino core stand-in for [env:native]
+ * Just enough of String, Print, Serial and the timing functions for
+ * DataStorage and its tests to build and run on the build machine
+ */
+
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctype.h>
+#include <string>
+#include <thread>
+
+#define DEC 10
+#define HEX 16
+
+// ============================================
+// Timing
+// ============================================
+
+// Milliseconds and microseconds since the program started
+inline std::chrono::steady_clock::time_point nativeStartTime() {
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return start;
+}
+
+inline unsigned long millis() {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - nativeStartTime()).count();
+}
+
+inline unsigned long micros() {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - nativeStartTime()).count();
+}
+
+inline void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void yield() {
+    std::this_thread::yield();
+}
+
+// ============================================
+// String
+// ============================================
+
+class String {
+public:
+    String() {}
+    String(const char* value) : _value(value ? value : "") {}
+    explicit String(char c) : _value(1, c) {}
+    explicit String(int value, unsigned char base = DEC) { formatInteger(value, base); }
+    explicit String(unsigned int value, unsigned char base = DEC) { formatInteger(value, base); }
+    explicit String(long value, unsigned char base = DEC) { formatInteger(value, base); }
+    explicit String(unsigned long value, unsigned char base = DEC) { formatInteger(value, base); }
+    explicit String(float value, unsigned int decimals = 2) { formatFloat(value, decimals); }
+    explicit String(double value, unsigned int decimals = 2) { formatFloat(value, decimals); }
+    
+    String& operator=(const char* value) {
+        _value = value ? value : "";
+        return *this;
+    }
+    
+    const char* c_str() const { return _value.c_str(); }
+    unsigned int length() const { return _value.length(); }
+    bool isEmpty() const { return _value.empty(); }
+    bool reserve(unsigned int size) {
+        _value.reserve(size);
+        return true;
+    }
+    
+    bool concat(const String& value) { _value += value._value; return true; }
+    bool concat(const char* value) { if (value) _value += value; return true; }
+    bool concat(const char* value, unsigned int length) { _value.append(value, length); return true; }
+    bool concat(char c) { _value += c; return true; }
+    bool concat(int value) { return concat(String(value)); }
+    bool concat(unsigned int value) { return concat(String(value)); }
+    bool concat(long value) { return concat(String(value)); }
+    bool concat(unsigned long value) { return concat(String(value)); }
+    bool concat(float value) { return concat(String(value)); }
+    bool concat(double value) { return concat(String(value)); }
+    
+    template <typename T>
+    String& operator+=(const T& value) {
+        concat(value);
+        return *this;
+    }
+    
+    char operator[](unsigned int index) const { return index < _value.length() ? _value[index] : '\0'; }
+    char charAt(unsigned int index) const { return (*this)[index]; }
+    
+    bool equals(const String& other) const { return _value == other._value; }
+    bool equals(const char* other) const { return _value == (other ? other : ""); }
+    bool equalsIgnoreCase(const String& other) const {
+        if (_value.length() != other._value.length()) {
+            return false;
+        }
+        for (size_t i = 0; i < _value.length(); i++) {
+            if (tolower((unsigned char)_value[i]) != tolower((unsigned char)other._value[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool operator==(const String& other) const { return equals(other); }
+    bool operator==(const char* other) const { return equals(other); }
+    bool operator!=(const String& other) const { return !equals(other); }
+    bool operator!=(const char* other) const { return !equals(other); }
+    bool operator<(const String& other) const { return _value < other._value; }
+    
+    bool startsWith(const String& prefix) const { return _value.compare(0, prefix.length(), prefix._value) == 0; }
+    bool endsWith(const String& suffix) const {
+        return _value.length() >= suffix.length() &&
+               _value.compare(_value.length() - suffix.length(), suffix.length(), suffix._value) == 0;
+    }
+    
+    int indexOf(char c, unsigned int from = 0) const { return position(_value.find(c, from)); }
+    int indexOf(const char* value, unsigned int from = 0) const { return position(_value.find(value, from)); }
+    int indexOf(const String& value, unsigned int from = 0) const { return indexOf(value.c_str(), from); }
+    int lastIndexOf(char c) const { return position(_value.rfind(c)); }
+    int lastIndexOf(char c, unsigned int from) const { return position(_value.rfind(c, from)); }
+    
+    String substring(unsigned int from) const { return substring(from, length()); }
+    String substring(unsigned int from, unsigned int to) const {
+        if (from > to) {
+            std::swap(from, to);
+        }
+        if (from >= _value.length()) {
+            return String();
+        }
+        return String(_value.substr(from, to - from).c_str());
+    }
+    
+    void remove(unsigned int index) { remove(index, (unsigned int)-1); }
+    void remove(unsigned int index, unsigned int count) {
+        if (index < _value.length()) {
+            _value.erase(index, count);
+        }
+    }
+    
+    void trim() {
+        size_t start = _value.find_first_not_of(" \t\r\n");
+        size_t end = _value.find_last_not_of(" \t\r\n");
+        _value = start == std::string::npos ? "" : _value.substr(start, end - start + 1);
+    }
+    void toLowerCase() { for (char& c : _value) c = tolower((unsigned char)c); }
+    void toUpperCase() { for (char& c : _value) c = toupper((unsigned char)c); }
+    
+    long toInt() const { return strtol(_value.c_str(), nullptr, 10); }
+    float toFloat() const { return strtof(_value.c_str(), nullptr); }
+
+private:
+    std::string _value;
+    
+    static int position(size_t index) { return index == std::string::npos ? -1 : (int)index; }
+    
+    void formatInteger(long long value, unsigned char base) {
+        char buffer[24];
+        snprintf(buffer, sizeof(buffer), base == HEX ? "%llx" : "%lld", value);
+        _value = buffer;
+    }
+    
+    void formatInteger(unsigned long long value, unsigned char base) {
+        char buffer[24];
+        snprintf(buffer, sizeof(buffer), base == HEX ? "%llx" : "%llu", value);
+        _value = buffer;
+    }
+    
+    void formatInteger(int value, unsigned char base) { formatInteger((long long)value, base); }
+    void formatInteger(long value, unsigned char base) { formatInteger((long long)value, base); }
+    void formatInteger(unsigned int value, unsigned char base) { formatInteger((unsigned long long)value, base); }
+    void formatInteger(unsigned long value, unsigned char base) { formatInteger((unsigned long long)value, base); }
+    
+    void formatFloat(double value, unsigned int decimals) {
+        char buffer[48];
+        snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, value);
+        _value = buffer;
+    }
+};
+
+// Result type of String concatenation in the Arduino core; ArduinoJson
+// accepts it wherever it accepts String
+class StringSumHelper : public String {
+public:
+    StringSumHelper(const String& value) : String(value) {}
+};
+
+inline StringSumHelper operator+(const String& left, const String& right) {
+    StringSumHelper sum(left);
+    sum.concat(right);
+    return sum;
+}
+
+inline StringSumHelper operator+(const String& left, const char* right) {
+    StringSumHelper sum(left);
+    sum.concat(right);
+    return sum;
+}
+
+inline StringSumHelper operator+(const char* left, const String& right) {
+    StringSumHelper sum = String(left);
+    sum.concat(right);
+    return sum;
+}
+
+// ============================================
+// Print / Serial
+// ============================================
+
+class Print {
+public:
+    virtual ~Print() {}
+    
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+        size_t written = 0;
+        while (size--) {
+            written += write(*buffer++);
+        }
+        return written;
+    }
+    size_t write(const char* text) { return text ? write((const uint8_t*)text, strlen(text)) : 0; }
+    size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+    
+    size_t print(const char* text) { return write(text); }
+    size_t print(const String& text) { return write(text.c_str(), text.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int value, int base = DEC) { return print(String(value, (unsigned char)base)); }
+    size_t print(unsigned int value, int base = DEC) { return print(String(value, (unsigned char)base)); }
+    size_t print(long value, int base = DEC) { return print(String(value, (unsigned char)base)); }
+    size_t print(unsigned long value, int base = DEC) { return print(String(value, (unsigned char)base)); }
+    size_t print(double value, int decimals = 2) { return print(String(value, (unsigned int)decimals)); }
+    
+    template <typename T>
+    size_t println(const T& value) { return print(value) + println(); }
+    size_t println() { return write("\r\n"); }
+    
+    size_t printf(const char* format, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (length < 0) {
+            return 0;
+        }
+        if ((size_t)length < sizeof(buffer)) {
+            return write(buffer, length);
+        }
+        
+        std::string large(length + 1, '\0');
+        va_start(args, format);
+        vsnprintf(&large[0], large.size(), format, args);
+        va_end(args);
+        return write(large.c_str(), length);
+    }
+};
+
+// Serial output goes to stdout
+class HardwareSerial : public Print {
+public:
+    void begin(unsigned long baud) {}
+    void flush() { fflush(stdout); }
+    
+    size_t write(uint8_t c) override {
+        return fputc(c, stdout) == EOF ? 0 : 1;
+    }
+    
+    size_t write(const uint8_t* buffer, size_t size) override {
+        return fwrite(buffer, 1, size, stdout);
+    }
+    
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif // NATIVE_ARDUINO_H
@@ -0,0 +1,219 @@
+/**
+ * Preferences stand-in for [env:native]
+ * Keeps each NVS key as a file, NATIVE_NVS_DIR/<partition>/<namespace>/<key>,
+ * so values survive across Preferences instances and test runs the way
+ * they survive restarts on the board. Names longer than NVS allows,
+ * and strings longer than it stores, are refused, as on the board.
+ * Every write and removal is also laid out in the partition's
+ * NvsEmulator, to count what it would cost the flash; a write that
+ * does not fit in the partition is refused, as on the board.
+ */
+
+#ifndef NATIVE_PREFERENCES_H
+#define NATIVE_PREFERENCES_H
+
+#include <Arduino.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include "nvs_emulator.h"
+
+#ifndef NATIVE_NVS_DIR
+#define NATIVE_NVS_DIR ".pio/nvs"
+#endif
+
+// Longest namespace or key name NVS accepts
+#define NATIVE_NVS_NAME_MAX 15
+
+// Largest string NVS stores, terminating zero included
+#define NATIVE_NVS_STRING_MAX 4000
+
+class Preferences {
+public:
+    Preferences() : _nvs(nullptr), _open(false), _readOnly(false) {}
+    
+    // In partition, "nvs" if none; opening a namespace read-only fails
+    // until something was written to it
+    bool begin(const char* name, bool readOnly = false, const char* partition = nullptr) {
+        if (!validName(name)) {
+            return false;
+        }
+        if (!partition) {
+            partition = "nvs";
+        }
+        _name = name;
+        _nvs = &NvsEmulator::instance(partition);
+        _directory = std::filesystem::path(NATIVE_NVS_DIR) / partition / name;
+        std::error_code error;
+        if (readOnly) {
+            _open = std::filesystem::is_directory(_directory, error);
+        } else {
+            std::filesystem::create_directories(_directory, error);
+            _open = !error;
+        }
+        _readOnly = readOnly;
+        return _open;
+    }
+    
+    void end() {
+        _open = false;
+    }
+    
+    bool clear() {
+        if (!writable()) {
+            return false;
+        }
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(_directory, error)) {
+            std::filesystem::remove(entry.path(), error);
+        }
+        _nvs->eraseAll(_name + "/");
+        return !error;
+    }
+    
+    bool remove(const char* key) {
+        std::error_code error;
+        if (!writable() || !validName(key) || !std::filesystem::remove(_directory / key, error)) {
+            return false;
+        }
+        _nvs->erase(item(key));
+        return true;
+    }
+    
+    // Set by tests to have every write refused, as by a full partition
+    static bool& refuseWrites() {
+        static bool refuse = false;
+        return refuse;
+    }
+    
+    // Set by tests to refuse writes once this many more are stored, as
+    // by a partition filling up partway through; -1 for never
+    static int& writesBeforeRefusing() {
+        static int writes = -1;
+        return writes;
+    }
+    
+    bool isKey(const char* key) {
+        std::error_code error;
+        return _open && validName(key) && std::filesystem::exists(_directory / key, error);
+    }
+    
+    // ========================================
+    // Strings
+    // ========================================
+    
+    // Refused, as on the board, if longer than NVS stores
+    size_t putString(const char* key, const char* value) {
+        size_t length = strlen(value);
+        if (length + 1 > NATIVE_NVS_STRING_MAX) {
+            return 0;
+        }
+        return store(key, value, length, NvsEmulator::stringEntries(length));
+    }
+    
+    size_t putString(const char* key, const String& value) {
+        return putString(key, value.c_str());
+    }
+    
+    String getString(const char* key, const String& defaultValue = String()) {
+        std::string value;
+        if (!read(key, value)) {
+            return defaultValue;
+        }
+        String result;
+        result.concat(value.data(), value.length());
+        return result;
+    }
+    
+    size_t getString(const char* key, char* value, size_t maxLength) {
+        std::string stored;
+        if (!read(key, stored) || stored.length() + 1 > maxLength) {
+            return 0;
+        }
+        memcpy(value, stored.c_str(), stored.length() + 1);
+        return stored.length() + 1;
+    }
+    
+    // ========================================
+    // Bytes and numbers
+    // ========================================
+    
+    size_t putBytes(const char* key, const void* value, size_t length) {
+        return store(key, value, length, NvsEmulator::blobEntries(length));
+    }
+    
+    size_t getBytes(const char* key, void* buffer, size_t maxLength) {
+        std::string stored;
+        if (!read(key, stored) || stored.length() > maxLength) {
+            return 0;
+        }
+        memcpy(buffer, stored.data(), stored.length());
+        return stored.length();
+    }
+    
+    size_t getBytesLength(const char* key) {
+        std::string stored;
+        return read(key, stored) ? stored.length() : 0;
+    }
+    
+    // Numbers fit in their entry's header
+    size_t putUInt(const char* key, uint32_t value) { return store(key, &value, sizeof(value), 1); }
+    uint32_t getUInt(const char* key, uint32_t defaultValue = 0) { return getNumber(key, defaultValue); }
+    
+    size_t putULong64(const char* key, uint64_t value) { return store(key, &value, sizeof(value), 1); }
+    uint64_t getULong64(const char* key, uint64_t defaultValue = 0) { return getNumber(key, defaultValue); }
+
+private:
+    std::string _name;
+    NvsEmulator* _nvs;
+    std::filesystem::path _directory;
+    bool _open;
+    bool _readOnly;
+    
+    bool writable() const { return _open && !_readOnly; }
+    
+    static bool validName(const char* name) {
+        return name && name[0] != '\0' && strlen(name) <= NATIVE_NVS_NAME_MAX;
+    }
+    
+    std::string item(const char* key) const { return _name + "/" + key; }
+    
+    // Lay out the value's entries in the partition, and write the file;
+    // refused, leaving the old value, if the partition is full
+    size_t store(const char* key, const void* value, size_t length, size_t entries) {
+        if (!writable() || !validName(key) || refuseWrites() || writesBeforeRefusing() == 0) {
+            return 0;
+        }
+        if (writesBeforeRefusing() > 0) {
+            writesBeforeRefusing()--;
+        }
+        if (!_nvs->write(item(key), entries)) {
+            return 0;
+        }
+        std::ofstream file(_directory / key, std::ios::binary | std::ios::trunc);
+        file.write(static_cast<const char*>(value), length);
+        return file ? length : 0;
+    }
+    
+    bool read(const char* key, std::string& value) {
+        if (!_open || !validName(key)) {
+            return false;
+        }
+        std::ifstream file(_directory / key, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        value.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+    
+    template <typename T>
+    T getNumber(const char* key, T defaultValue) {
+        T value;
+        return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+    }
+};
+
+#endif // NATIVE_PREFERENCES_H
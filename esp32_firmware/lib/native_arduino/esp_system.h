@@ -0,0 +1,16 @@
+/**
+ * ESP-IDF esp_system.h stand-in for [env:native]
+ */
+
+#ifndef NATIVE_ESP_SYSTEM_H
+#define NATIVE_ESP_SYSTEM_H
+
+#include <cstdint>
+#include <random>
+
+inline uint32_t esp_random() {
+    static std::mt19937 generator{std::random_device{}()};
+    return generator();
+}
+
+#endif // NATIVE_ESP_SYSTEM_H
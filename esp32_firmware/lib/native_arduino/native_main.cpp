@@ -0,0 +1,18 @@
+/**
+ * Entry point for [env:native]: tests are written as Arduino sketches,
+ * so run their setup() once. loop() only idles on a board.
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+
+HardwareSerial Serial;
+
+void setup();
+
+// setup() ends with UNITY_END(), whose failure count Unity keeps; it is
+// the exit status, so a failing run fails the build
+int main() {
+    setup();
+    return Unity.TestFailures < 255 ? (int)Unity.TestFailures : 255;
+}
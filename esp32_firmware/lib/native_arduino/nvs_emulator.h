@@ -0,0 +1,239 @@
+/**
+ * NVS page emulator for [env:native]
+ * Follows where the ESP-IDF NVS library would put each value in the
+ * partition, to count what the board's flash would go through: 4 KB
+ * pages of 126 entries of 32 bytes, values appended to the active
+ * page, and once only the reserved free page is left, the oldest full
+ * page's live values moved into it so the page can be erased.
+ * Preferences reports every write and removal here, to the emulator
+ * of the partition it opened; values are kept in files as before,
+ * this only keeps the layout.
+ */
+
+#ifndef NATIVE_NVS_EMULATOR_H
+#define NATIVE_NVS_EMULATOR_H
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Size of the default "nvs" partition, and of any other, as the
+// firmware's storage partition in partitions.csv
+#define NATIVE_NVS_DEFAULT_PARTITION_SIZE 0x5000
+#ifndef NATIVE_NVS_PARTITION_SIZE
+#define NATIVE_NVS_PARTITION_SIZE 0x80000
+#endif
+
+#define NATIVE_NVS_PAGE_SIZE 4096
+#define NATIVE_NVS_ENTRY_SIZE 32
+#define NATIVE_NVS_PAGE_ENTRIES 126
+
+class NvsEmulator {
+public:
+    explicit NvsEmulator(size_t partitionSize = NATIVE_NVS_PARTITION_SIZE)
+        : _pages(partitionSize / NATIVE_NVS_PAGE_SIZE), _serial(0) {
+        reset();
+    }
+    
+    // The partition labelled partition, which Preferences writes to
+    static NvsEmulator& instance(const std::string& partition = "nvs") {
+        static std::map<std::string, NvsEmulator> emulators;
+        auto found = emulators.find(partition);
+        if (found == emulators.end()) {
+            size_t size = partition == "nvs" ? NATIVE_NVS_DEFAULT_PARTITION_SIZE : NATIVE_NVS_PARTITION_SIZE;
+            found = emulators.emplace(partition, NvsEmulator(size)).first;
+        }
+        return found->second;
+    }
+    
+    /**
+     * Erase the whole partition and zero the counters
+     */
+    void reset() {
+        for (Page& page : _pages) {
+            page = Page();
+        }
+        _free.clear();
+        _full.clear();
+        for (size_t i = 1; i < _pages.size(); i++) {
+            _free.push_back(i);
+        }
+        _active = 0;
+        _entriesWritten = 0;
+        _entriesMoved = 0;
+        _pageErases = 0;
+        _overflows = 0;
+    }
+    
+    /**
+     * Entries a string of length bytes takes: a header and the data,
+     * with its terminating zero. Preferences refuses strings over 4000
+     * bytes before they get here, as the board does.
+     */
+    static size_t stringEntries(size_t length) {
+        return blobEntries(length + 1);
+    }
+    
+    // A blob takes chunks of a header and up to a page of data, plus an index
+    static size_t blobEntries(size_t length) {
+        size_t data = (length + NATIVE_NVS_ENTRY_SIZE - 1) / NATIVE_NVS_ENTRY_SIZE;
+        if (data < NATIVE_NVS_PAGE_ENTRIES) {
+            return 1 + data;
+        }
+        size_t chunks = (data + NATIVE_NVS_PAGE_ENTRIES - 2) / (NATIVE_NVS_PAGE_ENTRIES - 1);
+        return data + chunks + 1;
+    }
+    
+    /**
+     * Write item (namespace and key) taking entries, replacing what it
+     * held. The new value is written before the old one is erased, so
+     * both need room. False, and counted as an overflow, if the
+     * partition is full of live values; the board's write would fail,
+     * and the old value is kept.
+     */
+    bool write(const std::string& item, size_t entries) {
+        uint64_t serial = ++_serial;
+        while (entries > 0) {
+            size_t chunk = entries < NATIVE_NVS_PAGE_ENTRIES ? entries : NATIVE_NVS_PAGE_ENTRIES;
+            if (!append(item, chunk, serial)) {
+                erase(item, serial, true);
+                _overflows++;
+                return false;
+            }
+            _entriesWritten += chunk;
+            entries -= chunk;
+        }
+        erase(item, serial, false);
+        return true;
+    }
+    
+    void erase(const std::string& item) {
+        erase(item, 0, false);
+    }
+    
+    // Erase every item of a namespace, given as "<namespace>/"
+    void eraseAll(const std::string& prefix) {
+        for (Page& page : _pages) {
+            for (Value& value : page.values) {
+                if (value.live && value.item.compare(0, prefix.length(), prefix) == 0) {
+                    value.live = false;
+                    page.erased += value.entries;
+                }
+            }
+        }
+    }
+    
+    /**
+     * Entries written for values, and moved by garbage collection
+     */
+    uint64_t getEntriesWritten() const { return _entriesWritten; }
+    uint64_t getEntriesMoved() const { return _entriesMoved; }
+    
+    // Bytes programmed into entries, values and moves together
+    uint64_t getBytesWritten() const { return (_entriesWritten + _entriesMoved) * NATIVE_NVS_ENTRY_SIZE; }
+    
+    uint32_t getPageErases() const { return _pageErases; }
+    uint32_t getOverflows() const { return _overflows; }
+    uint32_t getPageErases(size_t page) const { return _pages[page].erases; }
+    size_t getPageCount() const { return _pages.size(); }
+    
+    size_t getLiveEntries() const {
+        size_t live = 0;
+        for (const Page& page : _pages) {
+            for (const Value& value : page.values) {
+                live += value.live ? value.entries : 0;
+            }
+        }
+        return live;
+    }
+
+private:
+    struct Value {
+        std::string item;
+        size_t entries;
+        bool live;
+        uint64_t serial;        // Of the write that put it
+    };
+    
+    struct Page {
+        std::vector<Value> values;
+        size_t used = 0;        // Entries written since the page was erased
+        size_t erased = 0;      // Of those, entries since replaced
+        uint32_t erases = 0;
+    };
+    
+    std::vector<Page> _pages;
+    std::deque<size_t> _free;   // Erased pages; the last one is the reserve
+    std::deque<size_t> _full;   // Oldest first
+    size_t _active;
+    uint64_t _entriesWritten;
+    uint64_t _entriesMoved;
+    uint32_t _pageErases;
+    uint32_t _overflows;
+    uint64_t _serial;           // Of the last write
+    
+    // Erase item's values put by the write serial (matching), or by any other
+    void erase(const std::string& item, uint64_t serial, bool matching) {
+        for (Page& page : _pages) {
+            for (Value& value : page.values) {
+                if (value.live && value.item == item && (value.serial == serial) == matching) {
+                    value.live = false;
+                    page.erased += value.entries;
+                }
+            }
+        }
+    }
+    
+    bool append(const std::string& item, size_t entries, uint64_t serial) {
+        while (_pages[_active].used + entries > NATIVE_NVS_PAGE_ENTRIES) {
+            if (!nextPage()) {
+                return false;
+            }
+        }
+        Page& page = _pages[_active];
+        page.values.push_back(Value{item, entries, true, serial});
+        page.used += entries;
+        return true;
+    }
+    
+    // Move on to a fresh page, collecting the oldest full one if needed
+    bool nextPage() {
+        _full.push_back(_active);
+        if (_free.size() > 1) {
+            _active = _free.front();
+            _free.pop_front();
+            return true;
+        }
+        
+        size_t victim = _full.front();
+        if (_pages[victim].erased == 0) {
+            _full.pop_back();   // Nothing to reclaim: out of space
+            return false;
+        }
+        _full.pop_front();
+        _active = _free.front();
+        _free.pop_front();
+        
+        Page& target = _pages[_active];
+        for (const Value& value : _pages[victim].values) {
+            if (value.live) {
+                target.values.push_back(value);
+                target.used += value.entries;
+                _entriesMoved += value.entries;
+            }
+        }
+        
+        Page& erased = _pages[victim];
+        erased.values.clear();
+        erased.used = 0;
+        erased.erased = 0;
+        erased.erases++;
+        _pageErases++;
+        _free.push_back(victim);
+        return true;
+    }
+};
+
+#endif // NATIVE_NVS_EMULATOR_H
@@ -0,0 +1,229 @@
+"""
+Web asset pipeline for Mate Tracker ESP32-C3
+
+Stages data/ minified, each file plus a gzip copy (name.gz) that the
+firmware sends to browsers accepting gzip. index.html refers to the
+other files as name?v=<content hash>, so the browser may cache them for
+good and only revalidates index.html.
+
+Run by PlatformIO before every build (extra_scripts in platformio.ini):
+the gzip copies are compiled into the firmware as web_assets.h, and
+buildfs/uploadfs make the LittleFS image, the fallback, from the same
+staged files. Run it directly to print the bytes a page load costs:
+    
+    python3 scripts/compress_assets.py
+"""
+
+import gzip
+import hashlib
+import os
+import re
+import shutil
+import sys
+import tempfile
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".js": "application/javascript",
+    ".css": "text/css",
+}
+
+# Must match STATIC_CACHE_CONTROL in src/config.h
+CACHE_FOREVER = "public, max-age=31536000, immutable"
+
+REFERENCE = re.compile(r'(src|href)="([^":?#]+)"')
+HTML_COMMENT = re.compile(r"<!--.*?-->", re.S)
+# Strings, comments, and the punctuation whose surrounding space can go
+CSS_TOKEN = re.compile(r'"(?:[^"\\\n]|\\.)*"|\'(?:[^\'\\\n]|\\.)*\'|/\*.*?\*/|\s*[{};,>]\s*|:\s*', re.S)
+
+
+def minify_css(text):
+    """Drop comments, and the space around {};,> and after a colon,
+    outside strings. Space before a colon stays: in a selector,
+    ".a :hover" is not ".a:hover"."""
+    def replace(match):
+        token = match.group(0)
+        if token.startswith("/*"):
+            return ""
+        if token[0] in "\"'":
+            return token
+        return token.strip()
+    
+    return CSS_TOKEN.sub(replace, text)
+
+
+def minify(name, text):
+    """Conservative minification: comments, indentation and blank lines.
+    Line breaks stay, so JavaScript semicolon insertion is unaffected."""
+    extension = os.path.splitext(name)[1]
+    if extension == ".css":
+        text = minify_css(text)
+    elif extension == ".html":
+        text = HTML_COMMENT.sub("", text)
+    
+    lines = [line.strip() for line in text.splitlines()]
+    if extension == ".js":
+        lines = [line for line in lines if not line.startswith("//")]
+    return "\n".join(line for line in lines if line) + "\n"
+
+
+def content_hash(data):
+    return hashlib.sha1(data).hexdigest()[:8]
+
+
+def version_references(html, data_dir):
+    """Point src/href at local files to name?v=<hash>"""
+    def replace(match):
+        path = os.path.join(data_dir, match.group(2))
+        if not os.path.isfile(path):
+            return match.group(0)
+        with open(path, "rb") as f:
+            version = content_hash(f.read())
+        return '%s="%s?v=%s"' % (match.group(1), match.group(2), version)
+    
+    return REFERENCE.sub(replace, html)
+
+
+def stage(data_dir, out_dir):
+    """Copy data_dir to out_dir with .gz variants; returns (name, source, gzipped) sizes"""
+    if os.path.isdir(out_dir):
+        shutil.rmtree(out_dir)
+    os.makedirs(out_dir)
+    
+    sizes = []
+    for name in sorted(os.listdir(data_dir)):
+        source = os.path.join(data_dir, name)
+        if not os.path.isfile(source) or name.endswith(".gz"):
+            continue
+        
+        with open(source, "rb") as f:
+            data = f.read()
+        source_size = len(data)
+        if os.path.splitext(name)[1] in CONTENT_TYPES:
+            text = data.decode("utf-8")
+            if name.endswith(".html"):
+                text = version_references(text, data_dir)
+            data = minify(name, text).encode("utf-8")
+        
+        with open(os.path.join(out_dir, name), "wb") as f:
+            f.write(data)
+        
+        # mtime=0 keeps the image, and so the ETags, reproducible
+        compressed = gzip.compress(data, 9, mtime=0)
+        if len(compressed) < len(data):
+            with open(os.path.join(out_dir, name + ".gz"), "wb") as f:
+                f.write(compressed)
+        sizes.append((name, source_size, min(len(compressed), len(data))))
+    return sizes
+
+
+def response_head(name, length, encoding=None, cache_control=None, status="200 OK"):
+    """Response head as ESPAsyncWebServer sends it for a file"""
+    lines = ["HTTP/1.1 " + status, "Connection: close", "Accept-Ranges: none"]
+    if status.startswith("200"):
+        lines.append('Content-Disposition: inline; filename="%s"' % name)
+    if encoding:
+        lines.append("Content-Encoding: " + encoding)
+    if cache_control:
+        lines += ['ETag: "00000000"', "Cache-Control: " + cache_control, "Vary: Accept-Encoding"]
+    lines.append("Content-Length: %d" % length)
+    if status.startswith("200"):
+        lines.append("Content-Type: " + CONTENT_TYPES.get(os.path.splitext(name)[1], "text/plain"))
+    return len("\r\n".join(lines) + "\r\n\r\n")
+
+
+def report(sizes):
+    """Response bytes for a cold and a warm load of the page, before and after"""
+    print("%-12s %8s %8s" % ("File", "Raw", "Gzip"))
+    for name, raw, compressed in sizes:
+        print("%-12s %8d %8d" % (name, raw, compressed))
+    
+    plain = sum(raw + response_head(name, raw) for name, raw, _ in sizes)
+    cold = sum(compressed + response_head(name, compressed, "gzip", CACHE_FOREVER)
+               for name, _, compressed in sizes)
+    warm = response_head("index.html", 0, cache_control="no-cache", status="304 Not Modified")
+    
+    print()
+    print("Bytes on the wire per page load (response heads and bodies):")
+    print("  uncompressed, no caching: %6d cold, %6d warm" % (plain, plain))
+    print("  gzip, ETag, ?v= caching:  %6d cold, %6d warm (index.html 304)" % (cold, warm))
+
+
+def write_if_changed(path, text):
+    """Leave an unchanged file alone, so it does not trigger a rebuild"""
+    if os.path.isfile(path):
+        with open(path) as f:
+            if f.read() == text:
+                return
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def embed(staged_dir, header):
+    """Write the gzip copies as a C++ header of PROGMEM byte arrays"""
+    lines = [
+        "// Generated by scripts/compress_assets.py from data/ - do not edit",
+        "",
+        "#ifndef WEB_ASSETS_H",
+        "#define WEB_ASSETS_H",
+        "",
+    ]
+    table = []
+    for name in sorted(os.listdir(staged_dir)):
+        if name.endswith(".gz"):
+            continue
+        path = os.path.join(staged_dir, name)
+        compressed = path + ".gz"
+        if not os.path.isfile(compressed):
+            continue
+        with open(compressed, "rb") as f:
+            data = f.read()
+        
+        symbol = "WEB_ASSET_%d" % len(table)
+        lines.append("static const uint8_t %s[] PROGMEM = {" % symbol)
+        for i in range(0, len(data), 16):
+            lines.append("    " + ", ".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+        lines.append("};")
+        lines.append("")
+        
+        content_type = CONTENT_TYPES.get(os.path.splitext(name)[1], "text/plain")
+        table.append('    {"/%s", "%s", %s, %d, "\\"%s\\""},' % (
+            name, content_type, symbol, len(data), content_hash(data)))
+    
+    lines.append("static const EmbeddedAsset EMBEDDED_ASSETS[] = {")
+    lines += table
+    lines.append("};")
+    lines.append("")
+    lines.append("#endif // WEB_ASSETS_H")
+    write_if_changed(header, "\n".join(lines) + "\n")
+    return len(table)
+
+
+def before_build(env, filesystem):
+    """Compile the staged files into the firmware, and build the LittleFS
+    image from them instead of data/"""
+    staged_dir = os.path.join(env.subst("$BUILD_DIR"), "data")
+    sizes = stage(env.subst("$PROJECT_DATA_DIR"), staged_dir)
+    print("Web assets: %d bytes, %d minified and gzipped" % (
+        sum(s[1] for s in sizes), sum(s[2] for s in sizes)))
+    
+    include_dir = os.path.join(env.subst("$BUILD_DIR"), "web_assets")
+    os.makedirs(include_dir, exist_ok=True)
+    if embed(staged_dir, os.path.join(include_dir, "web_assets.h")):
+        env.Append(CPPPATH=[include_dir], CPPDEFINES=["EMBEDDED_WEB_ASSETS"])
+    
+    if filesystem:
+        env.Replace(PROJECT_DATA_DIR=staged_dir)
+
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+except NameError:
+    env = None
+
+if env is not None:
+    before_build(env, bool({"buildfs", "uploadfs", "uploadfsota"} & set(COMMAND_LINE_TARGETS)))  # noqa: F821
+elif __name__ == "__main__":
+    data_dir = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "..", "data")
+    with tempfile.TemporaryDirectory() as out_dir:
+        report(stage(data_dir, os.path.join(out_dir, "data")))
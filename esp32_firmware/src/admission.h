@@ -0,0 +1,74 @@
+/**
+ * Admission Control for Mate Tracker ESP32-C3
+ * Turns requests away while the heap runs low, before they allocate
+ * their responses, and caps full-state responses in flight. Mutations
+ * are let in down to a lower watermark than reads.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include "config.h"
+
+class AdmissionControl {
+public:
+    enum Kind {
+        MUTATION,       // Changes data; admitted first
+        HEAVY_READ      // May send the full state
+    };
+    
+    enum Verdict {
+        ADMIT,
+        LOW_HEAP,       // 503
+        BUSY            // 429, too many heavy responses in flight
+    };
+    
+    AdmissionControl() : _heavyInFlight(0), _rejectedLowHeap(0), _rejectedBusy(0) {}
+    
+    /**
+     * Decide on a request of kind given the free heap and its largest
+     * free block; counts rejections
+     */
+    Verdict check(Kind kind, uint32_t freeHeap, uint32_t largestBlock) {
+        bool mutation = kind == MUTATION;
+        if (freeHeap < (mutation ? ADMISSION_WRITE_MIN_FREE_HEAP : ADMISSION_READ_MIN_FREE_HEAP) ||
+            largestBlock < (mutation ? ADMISSION_WRITE_MIN_BLOCK : ADMISSION_READ_MIN_BLOCK)) {
+            _rejectedLowHeap++;
+            return LOW_HEAP;
+        }
+        if (kind == HEAVY_READ && _heavyInFlight >= ADMISSION_MAX_HEAVY_RESPONSES) {
+            _rejectedBusy++;
+            return BUSY;
+        }
+        return ADMIT;
+    }
+    
+    /**
+     * Check request against the current heap. An admitted heavy read
+     * counts as in flight until its connection closes.
+     */
+    Verdict admit(AsyncWebServerRequest* request, Kind kind) {
+        Verdict verdict = check(kind, ESP.getFreeHeap(), ESP.getMaxAllocHeap());
+        if (verdict == ADMIT && kind == HEAVY_READ) {
+            beginHeavy();
+            request->onDisconnect([this]() { endHeavy(); });
+        }
+        return verdict;
+    }
+    
+    void beginHeavy() { _heavyInFlight++; }
+    void endHeavy() { _heavyInFlight--; }
+    
+    uint32_t getHeavyInFlight() const { return _heavyInFlight; }
+    uint32_t getRejectedLowHeap() const { return _rejectedLowHeap; }
+    uint32_t getRejectedBusy() const { return _rejectedBusy; }
+
+private:
+    uint32_t _heavyInFlight;
+    uint32_t _rejectedLowHeap;
+    uint32_t _rejectedBusy;
+};
+
+#endif // ADMISSION_H
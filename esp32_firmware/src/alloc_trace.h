@@ -0,0 +1,113 @@
+/**
+ * Allocation Tracing for Mate Tracker ESP32-C3
+ * Counts allocations and their bytes per subsystem. Code tags itself
+ * with an AllocScope; every malloc, calloc and realloc made on that
+ * task meanwhile is counted against the scope's subsystem, the rest as
+ * ALLOC_OTHER. The allocator reaches count() through the linker wraps
+ * in main.cpp, built with ALLOC_TRACING (see env:esp32c3_trace).
+ */
+
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <Arduino.h>
+#include "config.h"
+
+enum AllocSubsystem {
+    ALLOC_OTHER,        // Untagged, e.g. WiFi and TCP
+    ALLOC_STORAGE,      // DataStorage
+    ALLOC_JSON,         // Request parsing and JSON responses
+    ALLOC_HTTP,         // Request handling and responses
+    ALLOC_SUBSYSTEMS
+};
+
+class AllocTrace {
+public:
+    struct Counters {
+        uint32_t count;
+        uint64_t bytes;
+    };
+    
+    /**
+     * Start counting. Not before setup(): tags are thread-local, and
+     * tasks have their thread-local storage only once they run.
+     */
+    static void begin() { started() = true; }
+    
+    static bool isTracing() { return ALLOC_TRACING && started(); }
+    
+    /**
+     * Count an allocation of size bytes. Called from inside the
+     * allocator, so it must not allocate; counts may be off by one
+     * when two tasks allocate at the same moment.
+     */
+    static void count(size_t size) {
+        if (!started()) {
+            return;
+        }
+        Counters& counters = all()[current()];
+        counters.count++;
+        counters.bytes += size;
+    }
+    
+    static const Counters& get(AllocSubsystem subsystem) { return all()[subsystem]; }
+    
+    static void clear() {
+        for (size_t i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+            all()[i].count = 0;
+            all()[i].bytes = 0;
+        }
+    }
+    
+    static const char* name(AllocSubsystem subsystem) {
+        switch (subsystem) {
+            case ALLOC_STORAGE: return "storage";
+            case ALLOC_JSON: return "json";
+            case ALLOC_HTTP: return "http";
+            default: return "other";
+        }
+    }
+    
+    // Subsystem allocations on this task are counted against
+    static AllocSubsystem& current() {
+        static thread_local AllocSubsystem subsystem = ALLOC_OTHER;
+        return subsystem;
+    }
+
+private:
+    static bool& started() {
+        static bool value = false;
+        return value;
+    }
+    
+    static Counters* all() {
+        static Counters counters[ALLOC_SUBSYSTEMS];
+        return counters;
+    }
+};
+
+/**
+ * Tags allocations on this task with subsystem until it goes out of
+ * scope; does nothing unless tracing
+ */
+class AllocScope {
+public:
+    explicit AllocScope(AllocSubsystem subsystem) : _active(AllocTrace::isTracing()), _previous(ALLOC_OTHER) {
+        if (_active) {
+            _previous = AllocTrace::current();
+            AllocTrace::current() = subsystem;
+        }
+    }
+    
+    ~AllocScope() {
+        if (_active) {
+            AllocTrace::current() = _previous;
+        }
+    }
+
+private:
+    bool _active;
+    AllocSubsystem _previous;
+};
+
+#endif // ALLOC_TRACE_H
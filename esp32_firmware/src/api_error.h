@@ -0,0 +1,20 @@
+/**
+ * API Errors for Mate Tracker ESP32-C3
+ * An error message with its response body, both string literals put
+ * together by the compiler, so answering with an error builds nothing
+ */
+
+#ifndef API_ERROR_H
+#define API_ERROR_H
+
+struct ApiError {
+    const char* message;    // nullptr for no error
+    const char* body;       // {"error":"<message>"}
+};
+
+// The message must be a string literal without quotes or backslashes
+#define API_ERROR(message) ApiError{message, "{\"error\":\"" message "\"}"}
+
+#define NO_API_ERROR ApiError{nullptr, nullptr}
+
+#endif // API_ERROR_H
@@ -0,0 +1,294 @@
+/**
+ * API Operations for Mate Tracker ESP32-C3
+ * Validation and execution of single changes, shared by the REST
+ * endpoints and POST /api/batch
+ */
+
+#ifndef API_OPERATIONS_H
+#define API_OPERATIONS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <vector>
+#include "api_error.h"
+#include "config.h"
+#include "data_storage.h"
+
+// Outcome of one operation
+struct OperationResult {
+    int code;               // HTTP status
+    ApiError error;         // Message nullptr on success
+    String id;              // Id of the record created, if any
+};
+
+OperationResult operationOk(const String& id = String()) {
+    return OperationResult{200, NO_API_ERROR, id};
+}
+
+OperationResult operationError(const ApiError& error, int code = 400) {
+    return OperationResult{code, error, String()};
+}
+
+// Id for a new record: the millisecond clock, bumped so that records
+// created within the same millisecond (as in a batch) do not collide
+String newRecordId() {
+    static uint32_t lastId = 0;
+    uint32_t id = millis();
+    if (id <= lastId) {
+        id = lastId + 1;
+    }
+    lastId = id;
+    return String(id);
+}
+
+// ========================================
+// Users
+// ========================================
+
+OperationResult addUserOperation(DataStorage& storage, JsonObject body) {
+    std::lock_guard<DataStorage> lock(storage);   // Name still free when added
+    
+    const char* name = body["name"];
+    if (!name || strlen(name) == 0) {
+        return operationError(API_ERROR("Name is required"));
+    }
+    
+    if (strlen(name) > MAX_NAME_LENGTH) {
+        return operationError(API_ERROR("Name is too long"));
+    }
+    
+    if (storage.userExists(name)) {
+        return operationError(API_ERROR("User already exists"));
+    }
+    
+    String id = newRecordId();
+    if (!storage.addUser(id.c_str(), name)) {
+        return operationError(API_ERROR("Failed to add user"), 500);
+    }
+    return operationOk(id);
+}
+
+OperationResult removeUserOperation(DataStorage& storage, const char* userId) {
+    if (!userId || !storage.removeUser(userId)) {
+        return operationError(API_ERROR("User not found"), 404);
+    }
+    return operationOk();
+}
+
+// ========================================
+// Items
+// ========================================
+
+OperationResult addItemOperation(DataStorage& storage, JsonObject body) {
+    std::lock_guard<DataStorage> lock(storage);
+    
+    const char* name = body["name"];
+    JsonVariant priceVar = body["price"];
+    float price = priceVar.isNull() ? 0.0f : priceVar.as<float>();
+    JsonVariant stockVar = body["stock"];
+    int stock = stockVar.isNull() ? 24 : stockVar.as<int>();
+    
+    if (!name || strlen(name) == 0) {
+        return operationError(API_ERROR("Name is required"));
+    }
+    
+    if (strlen(name) > MAX_NAME_LENGTH) {
+        return operationError(API_ERROR("Name is too long"));
+    }
+    
+    if (price <= 0) {
+        return operationError(API_ERROR("Invalid price"));
+    }
+    
+    if (storage.itemExists(name)) {
+        return operationError(API_ERROR("Item already exists"));
+    }
+    
+    String id = newRecordId();
+    if (!storage.addItem(id.c_str(), name, price, stock)) {
+        return operationError(API_ERROR("Failed to add item"), 500);
+    }
+    return operationOk(id);
+}
+
+OperationResult removeItemOperation(DataStorage& storage, const char* itemId) {
+    if (!itemId || !storage.removeItem(itemId)) {
+        return operationError(API_ERROR("Item not found"), 404);
+    }
+    return operationOk();
+}
+
+OperationResult updateItemStockOperation(DataStorage& storage, const char* itemId, JsonObject body) {
+    int stock = body["stock"] | -1;
+    if (stock < 0) {
+        return operationError(API_ERROR("Invalid stock value"));
+    }
+    
+    if (!itemId || !storage.updateItemStock(itemId, stock)) {
+        return operationError(API_ERROR("Item not found"), 404);
+    }
+    return operationOk();
+}
+
+// ========================================
+// Consumption
+// ========================================
+
+OperationResult addConsumptionOperation(DataStorage& storage, JsonObject body) {
+    std::lock_guard<DataStorage> lock(storage);   // Stock still there when booked
+    
+    const char* userId = body["userId"];
+    const char* itemId = body["itemId"];
+    int quantity = body["quantity"] | 0;
+    
+    if (!userId || !itemId || quantity <= 0 || quantity > UINT16_MAX ||
+        strlen(userId) > MAX_ID_LENGTH || strlen(itemId) > MAX_ID_LENGTH) {
+        return operationError(API_ERROR("Invalid input"));
+    }
+    
+    // Check available stock
+    int available = storage.getAvailableStock(itemId);
+    if (quantity > available) {
+        return operationError(API_ERROR("Not enough stock"));
+    }
+    
+    String id = newRecordId();
+    if (!storage.addConsumption(id.c_str(), userId, itemId, quantity)) {
+        return operationError(API_ERROR("Failed to record consumption"), 500);
+    }
+    return operationOk(id);
+}
+
+OperationResult removeConsumptionOperation(DataStorage& storage, const char* consumptionId) {
+    if (!consumptionId || !storage.removeConsumption(consumptionId)) {
+        return operationError(API_ERROR("Consumption record not found"), 404);
+    }
+    return operationOk();
+}
+
+// ========================================
+// Payments
+// ========================================
+
+OperationResult addPaymentOperation(DataStorage& storage, JsonObject body) {
+    const char* userId = body["userId"];
+    const char* itemId = body["itemId"];
+    float amount = body["amount"] | 0.0f;
+    
+    if (!userId || !itemId || amount <= 0 ||
+        strlen(userId) > MAX_ID_LENGTH || strlen(itemId) > MAX_ID_LENGTH) {
+        return operationError(API_ERROR("Invalid input"));
+    }
+    
+    String id = newRecordId();
+    if (!storage.addPayment(id.c_str(), userId, itemId, amount)) {
+        return operationError(API_ERROR("Failed to process payment"), 500);
+    }
+    return operationOk(id);
+}
+
+// ========================================
+// Batches
+// ========================================
+
+/**
+ * Run one batch operation, {"op":"<name>", ...fields of the single
+ * endpoint, plus "id" for removals and stock updates}
+ */
+OperationResult runOperation(DataStorage& storage, JsonObject operation) {
+    const char* op = operation["op"] | "";
+    const char* id = operation["id"];
+    
+    if (strcmp(op, "addUser") == 0) {
+        return addUserOperation(storage, operation);
+    } else if (strcmp(op, "removeUser") == 0) {
+        return removeUserOperation(storage, id);
+    } else if (strcmp(op, "addItem") == 0) {
+        return addItemOperation(storage, operation);
+    } else if (strcmp(op, "removeItem") == 0) {
+        return removeItemOperation(storage, id);
+    } else if (strcmp(op, "updateStock") == 0) {
+        return updateItemStockOperation(storage, id, operation);
+    } else if (strcmp(op, "addConsumption") == 0) {
+        return addConsumptionOperation(storage, operation);
+    } else if (strcmp(op, "removeConsumption") == 0) {
+        return removeConsumptionOperation(storage, id);
+    } else if (strcmp(op, "addPayment") == 0) {
+        return addPaymentOperation(storage, operation);
+    }
+    return operationError(API_ERROR("Unknown operation"));
+}
+
+/**
+ * Replace "$<n>" in the id fields with the id created by operation n
+ * of the same batch, e.g. to record consumption for a user added in it
+ */
+bool resolveReferences(JsonObject operation, const std::vector<String>& ids) {
+    static const char* const fields[] = {"id", "userId", "itemId"};
+    for (const char* field : fields) {
+        const char* value = operation[field];
+        if (!value || value[0] != '$') {
+            continue;
+        }
+        
+        size_t index = strtoul(value + 1, nullptr, 10);
+        if (index >= ids.size() || ids[index].length() == 0) {
+            return false;
+        }
+        operation[field] = ids[index].c_str();
+    }
+    return true;
+}
+
+/**
+ * Apply every operation of a batch, or none of them. Adds one
+ * {"ok":..., "id"|"error":...} per operation to results and returns
+ * 200 if the batch was applied, else the status of the failed operation.
+ */
+int runBatch(DataStorage& storage, JsonArray operations, JsonArray results) {
+    std::vector<String> ids;
+    ids.reserve(operations.size());
+    int code = 200;
+    
+    StorageBatch batch(storage);
+    for (JsonObject operation : operations) {
+        JsonObject result = results.createNestedObject();
+        if (code != 200) {
+            result["ok"] = false;
+            result["error"] = "Not applied";
+            continue;
+        }
+        
+        OperationResult outcome = resolveReferences(operation, ids) ?
+            runOperation(storage, operation) : operationError(API_ERROR("Invalid reference"));
+        ids.push_back(outcome.id);
+        
+        if (outcome.error.message) {
+            code = outcome.code;
+            result["ok"] = false;
+            result["error"] = outcome.error.message;
+        } else {
+            result["ok"] = true;
+            if (outcome.id.length() > 0) {
+                result["id"] = outcome.id;
+            }
+        }
+    }
+    
+    if (code == 200) {
+        batch.commit();
+        return code;
+    }
+    
+    // Operations before the failure were undone with it
+    for (JsonObject result : results) {
+        if (result["ok"]) {
+            result["ok"] = false;
+            result["error"] = "Rolled back";
+            result.remove("id");
+        }
+    }
+    return code;
+}
+
+#endif // API_OPERATIONS_H
@@ -0,0 +1,331 @@
+/**
+ * API Router for Mate Tracker ESP32-C3
+ * Dispatches /api/... requests by path segment through a small trie,
+ * extracting {id} segments without regular expressions, collects
+ * request bodies that arrive in several TCP segments, and times every
+ * request it handles into Metrics
+ */
+
+#ifndef API_ROUTER_H
+#define API_ROUTER_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <ctype.h>
+#include <functional>
+#include <vector>
+#include "api_error.h"
+#include "alloc_trace.h"
+#include "metrics.h"
+
+// Most {param} segments in one route
+#define ROUTER_MAX_PARAMS 2
+
+// Values of a route's {param} segments, in order
+class RouteParams {
+public:
+    RouteParams() : _count(0) {}
+    
+    size_t size() const { return _count; }
+    const String& operator[](size_t index) const { return _values[index]; }
+    
+    void truncate(size_t count) { _count = count; }
+    void add(const char* value, size_t length) {
+        _values[_count].remove(0);
+        _values[_count].concat(value, length);
+        _count++;
+    }
+
+private:
+    String _values[ROUTER_MAX_PARAMS];
+    size_t _count;
+};
+
+/**
+ * A request body collected across TCP segments in one allocation, kept
+ * in the request's _tempObject, which the server frees with the request
+ */
+struct RequestBody {
+    enum Status { COLLECTING, COMPLETE, TOO_LARGE, NO_MEMORY };
+    
+    Status status;
+    size_t length;      // Bytes received so far
+    
+    // Null-terminated once complete
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+    
+    /**
+     * Add a part of a body of total bytes to slot. The first part
+     * allocates room for all of it if total is within limit; the
+     * returned status tells if it was not. nullptr if even the status
+     * could not be allocated.
+     */
+    static RequestBody* collect(void*& slot, const uint8_t* part, size_t len, size_t index, size_t total,
+                                size_t limit) {
+        RequestBody* body = static_cast<RequestBody*>(slot);
+        if (!body) {
+            Status status = total <= limit ? COLLECTING : TOO_LARGE;
+            body = static_cast<RequestBody*>(malloc(sizeof(RequestBody) + (status == COLLECTING ? total + 1 : 0)));
+            if (!body && status == COLLECTING) {
+                status = NO_MEMORY;
+                body = static_cast<RequestBody*>(malloc(sizeof(RequestBody)));
+            }
+            if (!body) {
+                return nullptr;
+            }
+            body->status = status;
+            body->length = 0;
+            slot = body;
+        }
+        
+        // Parts arrive in order; anything else is not ours to fix
+        if (body->status != COLLECTING || index != body->length || len > total - index) {
+            return body;
+        }
+        memcpy(body->data() + index, part, len);
+        body->length += len;
+        if (body->length == total) {
+            body->data()[total] = '\0';
+            body->status = COMPLETE;
+        }
+        return body;
+    }
+};
+
+typedef std::function<void(AsyncWebServerRequest*, const RouteParams&)> ApiRequestHandler;
+typedef std::function<void(AsyncWebServerRequest*, const RouteParams&, char* body, size_t length)> ApiBodyHandler;
+typedef void (*ApiErrorHandler)(AsyncWebServerRequest*, const ApiError& error, int code);
+
+class ApiRouter : public AsyncWebHandler {
+public:
+    struct Route {
+        WebRequestMethodComposite method;
+        ApiRequestHandler onRequest;
+        ApiBodyHandler onBody;
+        size_t maxBody;
+        int metric;         // Slot in _metrics, -1 if none
+    };
+    
+    /**
+     * @param onError sends error responses, e.g. for bodies over limit
+     * @param metrics counts and times the requests of every route
+     */
+    explicit ApiRouter(ApiErrorHandler onError = nullptr, Metrics* metrics = nullptr)
+        : _onError(onError), _metrics(metrics) {
+        _nodes.emplace_back();   // Root, matching ""
+    }
+    
+    /**
+     * Add a route, e.g. on("/api/items/{id}", HTTP_DELETE, ...).
+     * {name} matches one non-empty alphanumeric segment. pattern
+     * labels the route's metrics and must outlive the router.
+     */
+    void on(const char* pattern, WebRequestMethodComposite method, ApiRequestHandler onRequest) {
+        addRoute(pattern, Route{method, onRequest, nullptr, 0, -1});
+    }
+    
+    /**
+     * Add a route taking a body of up to maxBody bytes, handled once
+     * all of it has arrived; larger bodies get 413 as soon as their
+     * length is known
+     */
+    void on(const char* pattern, WebRequestMethodComposite method, ApiBodyHandler onBody, size_t maxBody) {
+        addRoute(pattern, Route{method, nullptr, onBody, maxBody, -1});
+    }
+    
+    /**
+     * Find the route for method and path; fills params on success
+     */
+    const Route* match(WebRequestMethodComposite method, const char* path, RouteParams& params) const {
+        params.truncate(0);
+        return matchFrom(0, method, path, params);
+    }
+    
+    bool canHandle(AsyncWebServerRequest* request) override {
+        RouteParams params;
+        if (!match(request->method(), request->url().c_str(), params)) {
+            return false;
+        }
+        request->addInterestingHeader("ANY");
+        return true;
+    }
+    
+    void handleRequest(AsyncWebServerRequest* request) override {
+        RouteParams params;
+        const Route* route = match(request->method(), request->url().c_str(), params);
+        if (!route) {
+            return;
+        }
+        RequestTimer timer(_metrics, route->metric);
+        AllocScope scope(ALLOC_HTTP);
+        if (route->onRequest) {
+            route->onRequest(request, params);
+            return;
+        }
+        
+        RequestBody* body = static_cast<RequestBody*>(request->_tempObject);
+        if (!body) {
+            char empty[1] = "";     // Request without a body
+            route->onBody(request, params, empty, 0);
+        } else if (body->status == RequestBody::COMPLETE) {
+            route->onBody(request, params, body->data(), body->length);
+        } else {
+            // Answered in handleBody already
+            Metrics::noteStatus(body->status == RequestBody::TOO_LARGE ? 413 : 503);
+        }
+    }
+    
+    void handleBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) override {
+        RouteParams params;
+        const Route* route = match(request->method(), request->url().c_str(), params);
+        if (!route || !route->onBody) {
+            return;
+        }
+        
+        AllocScope scope(ALLOC_HTTP);
+        RequestBody* body = RequestBody::collect(request->_tempObject, data, len, index, total, route->maxBody);
+        if (!body) {
+            request->client()->close();
+        } else if (index == 0 && body->status == RequestBody::TOO_LARGE) {
+            sendError(request, API_ERROR("Request body too large"), 413);
+        } else if (index == 0 && body->status == RequestBody::NO_MEMORY) {
+            sendError(request, API_ERROR("Out of memory"), 503);
+        }
+    }
+    
+    bool isRequestHandlerTrivial() override { return false; }
+
+private:
+    struct Node {
+        String segment;                 // Literal segment; unused for a parameter
+        bool param = false;
+        std::vector<size_t> children;   // Indexes into _nodes, literals first
+        std::vector<Route> routes;
+    };
+    
+    std::vector<Node> _nodes;
+    ApiErrorHandler _onError;
+    Metrics* _metrics;
+    
+    void addRoute(const char* pattern, Route route) {
+        if (_metrics) {
+            route.metric = _metrics->addRoute(methodName(route.method), pattern);
+        }
+        
+        size_t node = 0;
+        const char* segment = pattern;
+        size_t length;
+        while (nextSegment(segment, length)) {
+            bool param = segment[0] == '{';
+            node = child(node, param ? "" : segment, param ? 0 : length, param);
+            segment += length;
+        }
+        _nodes[node].routes.push_back(route);
+    }
+    
+    void sendError(AsyncWebServerRequest* request, const ApiError& error, int code) {
+        if (_onError) {
+            _onError(request, error, code);
+        } else {
+            Metrics::noteStatus(code);
+            request->send(code);
+        }
+    }
+    
+    static const char* methodName(WebRequestMethodComposite method) {
+        switch (method) {
+            case HTTP_GET: return "GET";
+            case HTTP_POST: return "POST";
+            case HTTP_DELETE: return "DELETE";
+            case HTTP_PUT: return "PUT";
+            case HTTP_PATCH: return "PATCH";
+            default: return "ANY";
+        }
+    }
+    
+    // Advance segment past '/' to the next segment; false at the end
+    static bool nextSegment(const char*& segment, size_t& length) {
+        while (*segment == '/') {
+            segment++;
+        }
+        length = strcspn(segment, "/");
+        return length > 0;
+    }
+    
+    size_t child(size_t parent, const char* segment, size_t length, bool param) {
+        for (size_t index : _nodes[parent].children) {
+            const Node& node = _nodes[index];
+            if (node.param == param && (param || (node.segment.length() == length &&
+                                                  strncmp(node.segment.c_str(), segment, length) == 0))) {
+                return index;
+            }
+        }
+        
+        Node node;
+        node.segment.concat(segment, length);
+        node.param = param;
+        _nodes.push_back(node);
+        size_t index = _nodes.size() - 1;
+        
+        // Parameters after literals, so /api/items/stock would win over /api/items/{id}
+        std::vector<size_t>& children = _nodes[parent].children;
+        children.insert(param ? children.end() : children.begin(), index);
+        return index;
+    }
+    
+    static bool isParamValue(const char* segment, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            if (!isalnum((unsigned char)segment[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Depth-first, so a literal that leads nowhere falls back to a parameter
+    const Route* matchFrom(size_t node, WebRequestMethodComposite method, const char* path,
+                           RouteParams& params) const {
+        if (*path == '\0') {
+            for (const Route& route : _nodes[node].routes) {
+                if (route.method & method) {
+                    return &route;
+                }
+            }
+            return nullptr;
+        }
+        if (*path != '/') {
+            return nullptr;
+        }
+        
+        const char* segment = path + 1;
+        size_t length = strcspn(segment, "/");
+        if (length == 0) {
+            return nullptr;     // Empty segment or trailing slash
+        }
+        
+        for (size_t index : _nodes[node].children) {
+            const Node& child = _nodes[index];
+            const Route* route = nullptr;
+            if (child.param) {
+                if (params.size() >= ROUTER_MAX_PARAMS || !isParamValue(segment, length)) {
+                    continue;
+                }
+                size_t mark = params.size();
+                params.add(segment, length);
+                route = matchFrom(index, method, segment + length, params);
+                if (!route) {
+                    params.truncate(mark);
+                }
+            } else if (child.segment.length() == length &&
+                       strncmp(child.segment.c_str(), segment, length) == 0) {
+                route = matchFrom(index, method, segment + length, params);
+            }
+            if (route) {
+                return route;
+            }
+        }
+        return nullptr;
+    }
+};
+
+#endif // API_ROUTER_H
@@ -0,0 +1,125 @@
+/**
+ * Change Events for Mate Tracker ESP32-C3
+ * Pushes state changes to open browsers over a WebSocket, so they do
+ * not have to poll for what other clients did
+ */
+
+#ifndef CHANGE_EVENTS_H
+#define CHANGE_EVENTS_H
+
+#include <ESPAsyncWebServer.h>
+#include <algorithm>
+#include <vector>
+#include "config.h"
+#include "data_storage.h"
+
+class ChangeEvents {
+public:
+    explicit ChangeEvents(DataStorage& storage)
+        : _socket("/api/events"), _storage(storage), _version(0), _pushes(0), _dropped(0) {}
+    
+    /**
+     * Register the /api/events WebSocket with the server
+     */
+    void begin(AsyncWebServer& server) {
+        _version = _storage.getVersion();
+        _socket.onEvent([this](AsyncWebSocket* socket, AsyncWebSocketClient* client, AwsEventType type,
+                               void* arg, uint8_t* data, size_t len) {
+            handleEvent(client, type);
+        });
+        server.addHandler(&_socket);
+    }
+    
+    /**
+     * Push every change since the last push to all clients, in the
+     * /api/changes format. Clients that fell behind are closed rather
+     * than queued for; they resync with /api/changes on reconnect.
+     */
+    void broadcast() {
+        uint32_t version = _storage.getVersion();
+        if (version == _version) {
+            return;
+        }
+        
+        if (_clients.empty()) {
+            _version = version;
+            return;
+        }
+        
+        // Changes made meanwhile may be sent twice; puts and deletes
+        // are idempotent, so that is harmless. Every client's queue
+        // shares one buffer of the message, rather than a copy each.
+        AsyncWebSocketMessageBuffer* buffer;
+        {
+            String message;
+            StringPrint sink(message);
+            _storage.writeChangesJson(sink, _version, _storage.getBootId());
+            buffer = _socket.makeBuffer(reinterpret_cast<uint8_t*>(const_cast<char*>(message.c_str())),
+                                        message.length());
+        }
+        if (!buffer) {
+            return;     // Out of memory; the next broadcast sends these too
+        }
+        _version = version;
+        
+        // Locked so it outlives queues that drop it meanwhile, as textAll() does
+        buffer->lock();
+        bool lowHeap = ESP.getFreeHeap() < EVENTS_MIN_FREE_HEAP;
+        for (size_t i = 0; i < _clients.size(); ) {
+            AsyncWebSocketClient* client = _socket.client(_clients[i]);
+            if (!client) {
+                _clients.erase(_clients.begin() + i);
+                continue;
+            }
+            
+            // Queue full, or low on heap and this push would be queued too
+            if (client->queueIsFull() || (lowHeap && client->client()->space() < buffer->length())) {
+                DEBUG_PRINTF("[EVENTS] Dropping slow client %u\n", (unsigned)client->id());
+                client->close();
+                _clients.erase(_clients.begin() + i);
+                _dropped++;
+                continue;
+            }
+            
+            client->text(buffer);
+            i++;
+        }
+        buffer->unlock();
+        
+        // Free the buffers no queue holds any more, this one once every
+        // client has sent or dropped it, as textAll(buffer) ends. Public,
+        // if underscored, in the ESPAsyncWebServer 1.2.3 pinned in
+        // platformio.ini; recheck it when that pin moves
+        _socket._cleanBuffers();
+        _pushes++;
+    }
+    
+    size_t getClientCount() const { return _clients.size(); }
+    uint32_t getPushCount() const { return _pushes; }
+    uint32_t getDroppedCount() const { return _dropped; }
+
+private:
+    AsyncWebSocket _socket;
+    DataStorage& _storage;
+    std::vector<uint32_t> _clients;     // Ids of connected clients
+    uint32_t _version;                  // State version of the last push
+    uint32_t _pushes;
+    uint32_t _dropped;
+    
+    void handleEvent(AsyncWebSocketClient* client, AwsEventType type) {
+        if (type == WS_EVT_CONNECT) {
+            if (_clients.size() >= EVENTS_MAX_CLIENTS) {
+                DEBUG_PRINTLN("[EVENTS] Too many clients");
+                client->close();
+                return;
+            }
+            _clients.push_back(client->id());
+            DEBUG_PRINTF("[EVENTS] Client %u connected\n", (unsigned)client->id());
+        } else if (type == WS_EVT_DISCONNECT) {
+            _clients.erase(std::remove(_clients.begin(), _clients.end(), client->id()), _clients.end());
+            DEBUG_PRINTF("[EVENTS] Client %u disconnected\n", (unsigned)client->id());
+        }
+    }
+};
+
+#endif // CHANGE_EVENTS_H
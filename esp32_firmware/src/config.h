@@ -28,11 +28,58 @@
 // ============================================
 #define HTTP_PORT 80
 
+// Browsers that can follow changes live on /api/events at once
+#define EVENTS_MAX_CLIENTS 4
+
+// Below this much free heap, clients that cannot take a push
+// straight away are dropped instead of queued for (bytes)
+#define EVENTS_MIN_FREE_HEAP 32768
+
+// Largest body of a single-operation request (bytes)
+#define MAX_REQUEST_BODY_SIZE 1024
+
+// Largest POST /api/batch: operations and body size (bytes)
+#define MAX_BATCH_OPERATIONS 50
+#define MAX_BATCH_BODY_SIZE 8192
+
+// Preallocated JSON documents for request bodies (see json_pool.h);
+// env:esp32c3_trace needs larger ones for the allocation counts
+#define JSON_POOL_DOCUMENTS 2
+#ifndef JSON_POOL_DOCUMENT_SIZE
+#define JSON_POOL_DOCUMENT_SIZE 1024
+#endif
+
+// Preallocated buffers for JSON responses, held until sent (bytes)
+#define JSON_POOL_BUFFERS 4
+#define JSON_POOL_BUFFER_SIZE 1024
+
+// Admission control (see admission.h): free heap and largest free
+// block below which reads, then mutations, get 503 (bytes)
+#define ADMISSION_READ_MIN_FREE_HEAP 32768
+#define ADMISSION_READ_MIN_BLOCK 16384
+#define ADMISSION_WRITE_MIN_FREE_HEAP 16384
+#define ADMISSION_WRITE_MIN_BLOCK 8192
+
+// Full-state responses in flight at once; more get 429
+#define ADMISSION_MAX_HEAVY_RESPONSES 2
+
+// Retry-After sent with 503 and 429 (seconds)
+#define ADMISSION_RETRY_AFTER_S 2
+
+// Cache-Control for web files requested with a ?v=<hash> version
+#define STATIC_CACHE_CONTROL "public, max-age=31536000, immutable"
+
+// Routes with their own counters on /api/metrics (see metrics.h)
+#define METRICS_MAX_ROUTES 24
+
 // ============================================
 // Data Storage Configuration  
 // ============================================
-// Namespace for NVS storage
+// Namespace for NVS storage, and the nvs partition of partitions.csv
+// it lives in; with a partition table that lacks it (an OTA update
+// keeps the table), the default nvs partition is used
 #define NVS_NAMESPACE "mate_data"
+#define STORAGE_PARTITION "storage"
 
 // Maximum number of records
 #define MAX_USERS 20
@@ -40,6 +87,51 @@
 #define MAX_CONSUMPTION_RECORDS 500
 #define MAX_PAYMENT_RECORDS 200
 
+// Maximum length of record ids and of user/item names
+#define MAX_ID_LENGTH 11
+#define MAX_NAME_LENGTH 31
+
+// Persistence mode
+// 1 = append one small log record per change, snapshot on compaction
+// 0 = rewrite the full state on every change
+#define STORAGE_LOG_ENABLED 1
+
+// Number of log records kept before they are compacted into a snapshot
+#define STORAGE_LOG_MAX_ENTRIES 32
+
+// Group commit: changes are buffered in RAM and written together
+// 1 = write after a quiet period, a maximum delay or a byte budget
+// 0 = write every change before the request returns
+#define STORAGE_GROUP_COMMIT 1
+
+// Write once no change has arrived for this long (milliseconds)
+#define STORAGE_COMMIT_QUIET_MS 2000
+
+// Upper bound on how long a change can stay unwritten (milliseconds)
+#define STORAGE_COMMIT_MAX_DELAY_MS 10000
+
+// Write as soon as this many bytes of log records are pending
+#define STORAGE_COMMIT_BYTE_BUDGET 1024
+
+// Recent changes kept in RAM for /api/changes; clients further behind
+// get a full snapshot instead
+#define CHANGE_JOURNAL_SIZE 64
+
+// Persistence task, which does the NVS writes off the web server's task:
+// write requests queued, stack (bytes) and priority of the task, and how
+// often it checks the group commit timers (milliseconds)
+#define PERSIST_QUEUE_LENGTH 8
+#define PERSIST_TASK_STACK 4096
+#define PERSIST_TASK_PRIORITY 1
+#define PERSIST_TICK_MS 100
+
+// Flash wear estimate (see flash_wear.h): size of STORAGE_PARTITION in
+// the partition table, erase cycles each flash sector is rated for, and
+// how often the counters are saved while writes go on (milliseconds)
+#define NVS_PARTITION_SIZE 0x80000
+#define FLASH_ENDURANCE_CYCLES 100000
+#define FLASH_WEAR_SAVE_INTERVAL_MS 3600000UL
+
 // ============================================
 // Hardware Configuration
 // ============================================
@@ -49,7 +141,21 @@
 // ============================================
 // Debug Configuration
 // ============================================
+#ifndef DEBUG_SERIAL
 #define DEBUG_SERIAL 1
+#endif
+
+// Heap monitor (see heap_monitor.h): how often the free heap and the
+// largest free block are sampled for their lows, and how often they
+// are printed to serial, 0 for never (milliseconds)
+#define HEAP_SAMPLE_INTERVAL_MS 1000
+#define HEAP_DUMP_INTERVAL_MS 0
+
+// Count allocations per subsystem (see alloc_trace.h); needs the
+// linker flags of env:esp32c3_trace
+#ifndef ALLOC_TRACING
+#define ALLOC_TRACING 0
+#endif
 
 #if DEBUG_SERIAL
     #define DEBUG_PRINT(x) Serial.print(x)
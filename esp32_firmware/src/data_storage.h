@@ -3,6 +3,53 @@
  * 
  * Handles persistent data storage using Preferences (NVS)
  * and provides CRUD operations for all data types.
+ * 
+ * Persistence layout (NVS namespace NVS_NAMESPACE, in the nvs partition
+ * STORAGE_PARTITION):
+ *   "snap"       - the generation of the snapshot, its slot s and chunk count
+ *   "snap<s>_<i>" - the snapshot: all data as records in the log's
+ *                  format, one per line, in chunks NVS can store
+ *   "log<n>"     - one small record per change made since that snapshot
+ *   "state"      - a snapshot as one JSON string, as written before
+ * 
+ * On boot the snapshot is loaded and the log records carrying the
+ * same generation are replayed on top of it. Once the log holds
+ * STORAGE_LOG_MAX_ENTRIES entries it is compacted into a new snapshot.
+ * A snapshot is written into the slot s (0 or 1) that "snap" does not
+ * point to, so the stored one stays whole until "snap" points to the
+ * new one; a snapshot that fails partway is retried in the same slot.
+ * A write NVS refuses leaves no log entry behind that does not follow
+ * from what is stored: until a snapshot is stored again, later log
+ * entries are dropped and the snapshot retried. A snapshot that cannot
+ * be loaded is never overwritten: begin() fails and nothing is written
+ * until reset().
+ * 
+ * The data has an NVS partition of its own rather than files in
+ * LittleFS: NVS already spreads writes over its pages, which is what
+ * FlashWear estimates, and refuses what does not fit without touching
+ * what is stored. At the MAX_* limits a snapshot takes about 17 of the
+ * partition's 128 pages, twice while the next one is written. Without
+ * the partition (a table from before it, kept by OTA updates) the data
+ * stays in the default nvs partition, 4 usable pages, too few for that;
+ * data found there is moved over once the partition exists.
+ * 
+ * With STORAGE_GROUP_COMMIT, changes are collected in RAM and one log
+ * entry (one record per line) is written for the whole group, see tick().
+ * 
+ * Concurrency: the web server calls in from the AsyncTCP task while
+ * loop() runs tick() on the Arduino task. Every change, and every read
+ * of the collections, holds _lock; compound operations hold it across
+ * their steps through lock()/unlock(). The full state is published as
+ * an immutable, reference-counted StateSnapshot that readers pick up
+ * without waiting for a writer, see getSnapshot().
+ * 
+ * With setWriteRequestHandler(), writes are handed to a persistence
+ * task (see persistence_task.h) that calls persist(); _lock is then
+ * held only while pending changes are taken, not during the NVS write.
+ * 
+ * What the writes cost the flash is estimated in FlashWear, whose
+ * counters are kept as "wear" and saved with the writes at most once
+ * every FLASH_WEAR_SAVE_INTERVAL_MS, and on flush().
  */
 
 #ifndef DATA_STORAGE_H
@@ -10,243 +57,718 @@
 
 #include <Preferences.h>
 #include <ArduinoJson.h>
+#include <esp_system.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include "config.h"
+#include "id_index.h"
+#include "undo_log.h"
+#include "alloc_trace.h"
+#include "latency_histogram.h"
+#include "flash_wear.h"
+
+// Maximum serialized size of a single log record
+#define LOG_RECORD_SIZE 256
+
+// Document capacity for building (strings by reference) and
+// parsing (strings copied) a log record
+#define LOG_RECORD_CAPACITY (JSON_OBJECT_SIZE(8) + 64)
+#define LOG_PARSE_CAPACITY (JSON_OBJECT_SIZE(8) + LOG_RECORD_SIZE)
+
+// A group of records is written as one NVS string (max 4000 bytes)
+#if STORAGE_COMMIT_BYTE_BUDGET + LOG_RECORD_SIZE >= 4000
+#error "STORAGE_COMMIT_BYTE_BUDGET is too large for one NVS entry"
+#endif
+
+// Largest chunk of a snapshot, in whole records (bytes)
+#define SNAPSHOT_CHUNK_SIZE 3968
+
+// Document capacity for parsing "snap": its members, and their keys,
+// which are copied since the string it is parsed from is not writable
+#define SNAPSHOT_HEADER_CAPACITY (JSON_OBJECT_SIZE(3) + JSON_STRING_SIZE(3) + JSON_STRING_SIZE(4) + JSON_STRING_SIZE(6))
+
+// Document capacity for parsing a snapshot written as one JSON string
+// of length bytes: its nodes, and the strings copied from it
+#define LEGACY_SNAPSHOT_CAPACITY(length) ((length) * 3 + 1024)
 
 // Data structures
+// Fixed-size records: no per-field heap allocations. Each collection
+// is reserved to its MAX_* limit once, so it never reallocates.
 struct User {
-    String id;
-    String name;
+    char id[MAX_ID_LENGTH + 1];
+    char name[MAX_NAME_LENGTH + 1];
 };
 
 struct Item {
-    String id;
-    String name;
+    char id[MAX_ID_LENGTH + 1];
+    char name[MAX_NAME_LENGTH + 1];
     float price;
-    int initialStock;
+    int32_t initialStock;
+    int32_t consumed;       // Sum of consumption quantities, kept in sync
 };
 
 struct ConsumptionRecord {
-    String id;
-    String userId;
-    String itemId;
-    int quantity;
-    String timestamp;
+    char id[MAX_ID_LENGTH + 1];
+    char userId[MAX_ID_LENGTH + 1];
+    char itemId[MAX_ID_LENGTH + 1];
+    uint32_t timestamp;     // millis() when recorded
+    uint16_t quantity;
 };
 
 struct PaymentRecord {
-    String id;
-    String userId;
-    String itemId;
+    char id[MAX_ID_LENGTH + 1];
+    char userId[MAX_ID_LENGTH + 1];
+    char itemId[MAX_ID_LENGTH + 1];
+    uint32_t timestamp;     // millis() when recorded
     float amount;
-    String timestamp;
+};
+
+// Print sink that appends to a String
+class StringPrint : public Print {
+public:
+    explicit StringPrint(String& output) : _output(output) {}
+    
+    size_t write(uint8_t c) override {
+        return _output.concat((char)c) ? 1 : 0;
+    }
+    
+    size_t write(const uint8_t* buffer, size_t size) override {
+        return _output.concat((const char*)buffer, size) ? size : 0;
+    }
+
+private:
+    String& _output;
+};
+
+// Print sink that only counts bytes
+class ByteCounter : public Print {
+public:
+    ByteCounter() : _count(0) {}
+    
+    size_t write(uint8_t c) override {
+        _count++;
+        return 1;
+    }
+    
+    size_t write(const uint8_t* buffer, size_t size) override {
+        _count += size;
+        return size;
+    }
+    
+    size_t count() const { return _count; }
+
+private:
+    size_t _count;
+};
+
+// Running totals for one user x item pair, kept in sync with the
+// consumption and payment records
+struct LedgerEntry {
+    char userId[MAX_ID_LENGTH + 1];
+    char itemId[MAX_ID_LENGTH + 1];
+    int32_t quantity;       // Units consumed
+    float paid;             // Sum of payments
+};
+
+// Every entry has a consumption or payment record behind it
+#define MAX_LEDGER_ENTRIES (MAX_CONSUMPTION_RECORDS + MAX_PAYMENT_RECORDS)
+
+// Ledger entries are looked up by user and item together
+struct LedgerPair {
+    const char* userId;
+    const char* itemId;
+};
+
+struct LedgerKey {
+    static LedgerPair of(const LedgerEntry& entry) { return {entry.userId, entry.itemId}; }
+    
+    static uint32_t hash(const LedgerPair& key) {
+        return (IdKey::hash(key.userId) * 16777619UL) ^ IdKey::hash(key.itemId);
+    }
+    
+    static bool equal(const LedgerPair& a, const LedgerPair& b) {
+        return strcmp(a.userId, b.userId) == 0 && strcmp(a.itemId, b.itemId) == 0;
+    }
+};
+
+// Kinds of change journal entries
+enum ChangeKind : uint8_t {
+    CHANGE_PUT,             // Record added or updated
+    CHANGE_DELETE,          // Record removed
+    CHANGE_DELETE_BY_USER,  // Every record of a user removed
+    CHANGE_DELETE_BY_ITEM   // Every record of an item removed
+};
+
+// Collections of the state JSON, in order
+enum ChangeCollection : uint8_t {
+    COLLECTION_USERS,
+    COLLECTION_ITEMS,
+    COLLECTION_CONSUMPTION,
+    COLLECTION_PAYMENTS
+};
+
+// One change journal entry. A put only names the record; its current
+// contents are read when the journal is sent.
+struct ChangeEntry {
+    uint32_t version;               // State version the change produced
+    uint8_t kind;                   // ChangeKind
+    uint8_t collection;             // ChangeCollection
+    char id[MAX_ID_LENGTH + 1];     // Record id, or user/item id for cascades
+};
+
+// The full state as of one version; never changed once built
+struct StateSnapshot {
+    uint32_t version;
+    char etag[24];          // Quoted, as getETag() was for version
+    String json;            // As getStateJson()
 };
 
 class DataStorage {
 public:
-    DataStorage() {}
+    /**
+     * @param useLog true to append a log record per change,
+     *               false to rewrite the full state every time
+     * @param groupCommit true to buffer changes until tick() or flush(),
+     *                    false to write each change immediately
+     */
+    DataStorage(bool useLog = STORAGE_LOG_ENABLED, bool groupCommit = STORAGE_GROUP_COMMIT)
+        : _userIndex(_users), _itemIndex(_items), _consumptionIndex(_consumption),
+          _paymentIndex(_payments), _ledgerIndex(_ledger), _useLog(useLog), _generation(0), _snapshotSlot(-1), _logCount(0),
+          _bytesWritten(0), _groupCommit(groupCommit), _snapshotDue(false),
+          _pendingChanges(0), _firstChangeAt(0), _lastChangeAt(0), _flushCount(0),
+          _flushesAvoided(0), _writeFailed(false), _failedAt(0), _loadFailed(false), _maxWriteTimeUs(0), _bootId(0),
+          _version(0), _committedVersion(0), _journalNext(0), _journalFloor(0), _inBatch(false) {}
+    
+    ~DataStorage() {
+        flush();
+    }
     
     /**
-     * Initialize data storage
+     * Initialize data storage. False if saved data was found but could
+     * not be loaded; nothing is written to NVS then, so it is kept.
      */
     bool begin() {
+        AllocScope scope(ALLOC_STORAGE);
         DEBUG_PRINTLN("[DATA] Initializing preferences...");
         
-        // Open preferences
-        _prefs.begin(NVS_NAMESPACE, false);
+        // Allocate every collection once, up front
+        _users.reserve(MAX_USERS);
+        _items.reserve(MAX_ITEMS);
+        _consumption.reserve(MAX_CONSUMPTION_RECORDS);
+        _payments.reserve(MAX_PAYMENT_RECORDS);
+        _ledger.reserve(MAX_LEDGER_ENTRIES);
+        _pending.reserve(STORAGE_COMMIT_BYTE_BUDGET + LOG_RECORD_SIZE);
+        _journal.reserve(CHANGE_JOURNAL_SIZE);
+        
+        // Versions restart at every boot; the boot id keeps ETags apart
+        _bootId = esp_random();
+        
+        // Open preferences in the storage partition, with what was saved
+        // in the default one moved over; without the partition, or if the
+        // move failed, stay in the default one
+        if (!_prefs.begin(NVS_NAMESPACE, false, STORAGE_PARTITION) || !moveFromDefaultPartition()) {
+            _prefs.end();
+            DEBUG_PRINTLN("[DATA] Using the default nvs partition");
+            _prefs.begin(NVS_NAMESPACE, false);
+        }
         
         // Load data from NVS
+        loadWear();
         loadData();
         
-        return true;
+        return !_loadFailed;
     }
     
     /**
      * Get full state as JSON string
      */
     String getStateJson() {
-        DynamicJsonDocument doc(16384);
+        return getSnapshot()->json;
+    }
+    
+    /**
+     * The full state, serialized at most once per version. Never waits
+     * for a writer: while one holds the lock, the last published
+     * snapshot is returned, which may be a few versions old but is
+     * consistent. The snapshot stays valid after later changes, so a
+     * response can keep sending from it while the state moves on.
+     */
+    std::shared_ptr<const StateSnapshot> getSnapshot() {
+        std::shared_ptr<const StateSnapshot> snapshot = std::atomic_load(&_snapshot);
+        if (snapshot && snapshot->version == _version) {
+            return snapshot;
+        }
         
-        // Users array
-        JsonArray usersArray = doc.createNestedArray("users");
-        for (const auto& user : _users) {
-            JsonObject userObj = usersArray.createNestedObject();
-            userObj["id"] = user.id;
-            userObj["name"] = user.name;
+        std::unique_lock<std::recursive_mutex> lock(_lock, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            if (snapshot) {
+                return snapshot;
+            }
+            lock.lock();    // Nothing published yet
         }
         
-        // Items array
-        JsonArray itemsArray = doc.createNestedArray("items");
-        for (const auto& item : _items) {
-            JsonObject itemObj = itemsArray.createNestedObject();
-            itemObj["id"] = item.id;
-            itemObj["name"] = item.name;
-            itemObj["price"] = item.price;
-            itemObj["initialStock"] = item.initialStock;
+        snapshot = std::atomic_load(&_snapshot);
+        if (snapshot && snapshot->version == _version) {
+            return snapshot;
         }
         
-        // Consumption array
-        JsonArray consumptionArray = doc.createNestedArray("consumption");
-        for (const auto& record : _consumption) {
-            JsonObject recObj = consumptionArray.createNestedObject();
-            recObj["id"] = record.id;
-            recObj["userId"] = record.userId;
-            recObj["itemId"] = record.itemId;
-            recObj["quantity"] = record.quantity;
-            recObj["timestamp"] = record.timestamp;
+        AllocScope scope(ALLOC_STORAGE);
+        StateSnapshot* fresh = new StateSnapshot();
+        fresh->version = _version;
+        formatETag(fresh->etag, sizeof(fresh->etag), fresh->version);
+        {
+            ScopedLatency timer(_stateTimes);
+            fresh->json.reserve(measureStateJson());
+            StringPrint sink(fresh->json);
+            writeStateJson(sink);
         }
+        snapshot.reset(fresh);
         
-        // Payments array
-        JsonArray paymentsArray = doc.createNestedArray("payments");
-        for (const auto& payment : _payments) {
-            JsonObject payObj = paymentsArray.createNestedObject();
-            payObj["id"] = payment.id;
-            payObj["userId"] = payment.userId;
-            payObj["itemId"] = payment.itemId;
-            payObj["amount"] = payment.amount;
-            payObj["timestamp"] = payment.timestamp;
+        // A batch in progress may still be rolled back: others must not see it
+        if (!_inBatch) {
+            std::atomic_store(&_snapshot, snapshot);
+        }
+        return snapshot;
+    }
+    
+    /**
+     * Full state JSON of getSnapshot()
+     */
+    std::shared_ptr<const String> getSerializedState() {
+        std::shared_ptr<const StateSnapshot> snapshot = getSnapshot();
+        return std::shared_ptr<const String>(snapshot, &snapshot->json);
+    }
+    
+    /**
+     * State version, bumped by every change. A batch's changes count
+     * from its commit on; until then it may still be rolled back.
+     */
+    uint32_t getVersion() const { return _committedVersion; }
+    
+    /**
+     * Random id of this boot; versions are only comparable within one
+     */
+    uint32_t getBootId() const { return _bootId; }
+    
+    /**
+     * Quoted entity tag for getVersion()
+     */
+    String getETag() const {
+        char etag[24];
+        formatETag(etag, sizeof(etag), _committedVersion);
+        return String(etag);
+    }
+    
+    /**
+     * Hold the lock across a check and the change it guards, e.g.
+     * std::lock_guard<DataStorage> lock(storage)
+     */
+    void lock() { _lock.lock(); }
+    void unlock() { _lock.unlock(); }
+    
+    /**
+     * Serialize the full state into out, one record at a time, without
+     * building a document for the whole state
+     */
+    size_t writeStateJson(Print& out) {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        size_t written = out.print('{');
+        written += writeRecords(out);
+        written += out.print('}');
+        return written;
+    }
+    
+    /**
+     * Length of the getStateJson() output
+     */
+    size_t measureStateJson() {
+        ByteCounter counter;
+        return writeStateJson(counter);
+    }
+    
+    /**
+     * Changes after version since, as
+     *   {"boot":"<hex>","version":N,"since":M,"changes":[...]}
+     * or, when the journal no longer reaches back to since, since is
+     * ahead of the state, or boot is not this boot, the full state as
+     *   {"boot":"<hex>","version":N,"state":{...}}
+     * 
+     * Each change is {"v":N,"op":"put","in":<collection>,"record":{...}}
+     * or {"v":N,"op":"del","in":<collection>} plus one of "id", "userId"
+     * or "itemId" naming the records to remove.
+     */
+    size_t writeChangesJson(Print& out, uint32_t since, uint32_t boot) {
+        size_t written = 0;
+        std::shared_ptr<const StateSnapshot> state = writeChangesHead(out, since, boot, written);
+        if (state) {
+            written += out.print(state->json);
+            written += out.print('}');
         }
+        return written;
+    }
+    
+    /**
+     * As writeChangesJson(), except that when the full state is due,
+     * only the envelope up to it is written and the snapshot of it
+     * returned, for the caller to send its json and the closing '}'.
+     * The state is then never serialized again. Null when out got the
+     * whole answer. Adds the bytes written to written.
+     */
+    std::shared_ptr<const StateSnapshot> writeChangesHead(Print& out, uint32_t since, uint32_t boot,
+                                                          size_t& written) {
+        AllocScope scope(ALLOC_STORAGE);
+        std::lock_guard<std::recursive_mutex> lock(_lock);
         
-        String output;
-        serializeJson(doc, output);
-        return output;
+        char header[48];
+        snprintf(header, sizeof(header), "{\"boot\":\"%08lx\",\"version\":%lu,",
+            (unsigned long)_bootId, (unsigned long)_version);
+        written += out.print(header);
+        
+        if (boot != _bootId || since < _journalFloor || since > _version) {
+            // Under the lock, so the snapshot is of this very version
+            written += out.print("\"state\":");
+            return getSnapshot();
+        }
+        
+        StaticJsonDocument<JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(5)> doc;
+        char timestamp[12];
+        size_t count = 0;
+        snprintf(header, sizeof(header), "\"since\":%lu,\"changes\":[", (unsigned long)since);
+        written += out.print(header);
+        for (size_t i = 0; i < _journal.size(); i++) {
+            const ChangeEntry& entry = _journal[(_journalNext + i) % _journal.size()];
+            if (entry.version <= since) {
+                continue;
+            }
+            
+            doc.clear();
+            doc["v"] = entry.version;
+            doc["op"] = entry.kind == CHANGE_PUT ? "put" : "del";
+            doc["in"] = collectionName(entry.collection);
+            if (entry.kind == CHANGE_PUT) {
+                // Gone since: a later delete in this list covers it
+                if (!writeRecordJson(doc.createNestedObject("record"), entry.collection, entry.id, timestamp)) {
+                    continue;
+                }
+            } else {
+                const char* key = entry.kind == CHANGE_DELETE_BY_USER ? "userId" :
+                    entry.kind == CHANGE_DELETE_BY_ITEM ? "itemId" : "id";
+                doc[key] = (const char*)entry.id;
+            }
+            written += writeElement(out, doc, count++);
+        }
+        written += out.print("]}");
+        return nullptr;
+    }
+    
+    /**
+     * Total bytes handed to NVS since construction
+     */
+    size_t getBytesWritten() const { return _bytesWritten; }
+    
+    /**
+     * Number of log entries written since the last snapshot
+     */
+    int getLogLength() const { return _logCount; }
+    
+    /**
+     * Changes not yet written to NVS
+     */
+    int getPendingChanges() const { return _pendingChanges; }
+    
+    /**
+     * NVS writes (log entries and snapshots) since construction
+     */
+    uint32_t getFlushCount() const { return _flushCount; }
+    
+    /**
+     * Writes saved by grouping changes into one
+     */
+    uint32_t getFlushesAvoided() const { return _flushesAvoided; }
+    
+    /**
+     * Time spent in NVS writes since construction, and the longest
+     * single write, in microseconds. Updated without _lock, so only
+     * approximate while a write is in progress.
+     */
+    uint64_t getWriteTimeUs() const { return _writeTimes.getSumUs(); }
+    uint32_t getMaxWriteTimeUs() const { return _maxWriteTimeUs; }
+    
+    /**
+     * Latency of NVS writes, of loading from NVS in begin(), and of
+     * serializing the full state for a snapshot
+     */
+    const LatencyHistogram& getWriteTimes() const { return _writeTimes; }
+    const LatencyHistogram& getLoadTimes() const { return _loadTimes; }
+    const LatencyHistogram& getStateTimes() const { return _stateTimes; }
+    
+    /**
+     * Flash wear of the writes, since the counters were first saved.
+     * Updated without _lock, so only approximate while a write is in
+     * progress.
+     */
+    const FlashWear& getFlashWear() const { return _wear; }
+    
+    /**
+     * Write a snapshot now and start a new, empty log
+     */
+    void compact() {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        _snapshotDue = true;
+        writePending();
+    }
+    
+    /**
+     * Write pending changes once the quiet period or the maximum
+     * delay has passed. Call regularly from loop().
+     */
+    void tick() {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        if (writeDue()) {
+            writePending();
+        }
+        tickWear();
+    }
+    
+    /**
+     * Write pending changes, and the wear counters, now, e.g. before
+     * a restart
+     */
+    void flush() {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        writePending();
+        std::lock_guard<std::mutex> store(_storeLock);
+        if (_wear.isDirty()) {
+            saveWear();
+        }
+    }
+    
+    /**
+     * Have onWriteRequest called, with the lock held, whenever changes
+     * should be written instead of writing them right away; it must
+     * not block. The receiver then calls persist(). nullptr to write
+     * inline again.
+     */
+    void setWriteRequestHandler(std::function<void()> onWriteRequest) {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        _onWriteRequest = onWriteRequest;
+    }
+    
+    /**
+     * Write pending changes now, or once due as tick() would, holding
+     * the lock only to take them so mutations and reads go on during
+     * the NVS write. For the single persistence task; other callers
+     * use tick() or flush(). True if something was written.
+     */
+    bool persist(bool now) {
+        AllocScope scope(ALLOC_STORAGE);
+        PendingWrite write;
+        std::unique_lock<std::mutex> store(_storeLock, std::defer_lock);
+        {
+            std::lock_guard<std::recursive_mutex> lock(_lock);
+            if ((!now && !writeDue()) || !takePending(write)) {
+                tickWear();
+                return false;
+            }
+            // Before releasing _lock, so writes are stored in the order taken
+            store.lock();
+        }
+        storeWrite(write);
+        return true;
     }
     
     // ========================================
     // User Operations
     // ========================================
     
+    /**
+     * Case-insensitive name check, via the folded name index
+     */
     bool userExists(const char* name) {
-        for (const auto& user : _users) {
-            if (user.name.equalsIgnoreCase(name)) {
-                return true;
-            }
-        }
-        return false;
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        return _userIndex.findName(name) >= 0;
     }
     
     bool addUser(const char* id, const char* name) {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        
         if (_users.size() >= MAX_USERS) {
             DEBUG_PRINTLN("[DATA] Max users reached");
             return false;
         }
         
-        User user;
-        user.id = id;
-        user.name = name;
-        _users.push_back(user);
+        if (!fits(id, MAX_ID_LENGTH) || !fits(name, MAX_NAME_LENGTH)) {
+            return false;
+        }
         
-        saveData();
+        applyAddUser(id, name);
+        
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "au";
+        record["id"] = id;
+        record["n"] = name;
+        appendLog(record);
+        journal(CHANGE_PUT, COLLECTION_USERS, id);
         return true;
     }
     
     bool removeUser(const char* id) {
-        String idStr = id;
+        std::lock_guard<std::recursive_mutex> lock(_lock);
         
-        // Remove user
-        auto it = _users.begin();
-        while (it != _users.end()) {
-            if (it->id == idStr) {
-                it = _users.erase(it);
-                
-                // Also remove related consumption and payments
-                removeConsumptionByUser(id);
-                removePaymentsByUser(id);
-                
-                saveData();
-                return true;
-            } else {
-                ++it;
-            }
+        if (!applyRemoveUser(id)) {
+            return false;
         }
-        return false;
+        
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "ru";
+        record["id"] = id;
+        appendLog(record);
+        journal(CHANGE_DELETE, COLLECTION_USERS, id);
+        journal(CHANGE_DELETE_BY_USER, COLLECTION_CONSUMPTION, id);
+        journal(CHANGE_DELETE_BY_USER, COLLECTION_PAYMENTS, id);
+        return true;
     }
     
     // ========================================
     // Item Operations
     // ========================================
     
+    /**
+     * Case-insensitive name check, via the folded name index
+     */
     bool itemExists(const char* name) {
-        for (const auto& item : _items) {
-            if (item.name.equalsIgnoreCase(name)) {
-                return true;
-            }
-        }
-        return false;
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        return _itemIndex.findName(name) >= 0;
     }
     
     bool addItem(const char* id, const char* name, float price, int stock) {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        
         if (_items.size() >= MAX_ITEMS) {
             DEBUG_PRINTLN("[DATA] Max items reached");
             return false;
         }
         
-        Item item;
-        item.id = id;
-        item.name = name;
-        item.price = price;
-        item.initialStock = stock;
-        _items.push_back(item);
+        if (!fits(id, MAX_ID_LENGTH) || !fits(name, MAX_NAME_LENGTH)) {
+            return false;
+        }
+        
+        applyAddItem(id, name, price, stock);
         
-        saveData();
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "ai";
+        record["id"] = id;
+        record["n"] = name;
+        record["p"] = price;
+        record["s"] = stock;
+        appendLog(record);
+        journal(CHANGE_PUT, COLLECTION_ITEMS, id);
         return true;
     }
     
     bool removeItem(const char* id) {
-        String idStr = id;
+        std::lock_guard<std::recursive_mutex> lock(_lock);
         
-        auto it = _items.begin();
-        while (it != _items.end()) {
-            if (it->id == idStr) {
-                it = _items.erase(it);
-                
-                // Also remove related consumption and payments
-                removeConsumptionByItem(id);
-                removePaymentsByItem(id);
-                
-                saveData();
-                return true;
-            } else {
-                ++it;
-            }
+        if (!applyRemoveItem(id)) {
+            return false;
         }
-        return false;
+        
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "ri";
+        record["id"] = id;
+        appendLog(record);
+        journal(CHANGE_DELETE, COLLECTION_ITEMS, id);
+        journal(CHANGE_DELETE_BY_ITEM, COLLECTION_CONSUMPTION, id);
+        journal(CHANGE_DELETE_BY_ITEM, COLLECTION_PAYMENTS, id);
+        return true;
     }
     
     bool updateItemStock(const char* id, int stock) {
-        String idStr = id;
+        std::lock_guard<std::recursive_mutex> lock(_lock);
         
-        for (auto& item : _items) {
-            if (item.id == idStr) {
-                item.initialStock = stock;
-                saveData();
-                return true;
-            }
+        if (!applyUpdateItemStock(id, stock)) {
+            return false;
         }
-        return false;
+        
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "us";
+        record["id"] = id;
+        record["s"] = stock;
+        appendLog(record);
+        journal(CHANGE_PUT, COLLECTION_ITEMS, id);
+        return true;
     }
     
     int getAvailableStock(const char* itemId) {
-        String idStr = itemId;
-        
-        // Find item
-        int initialStock = 0;
-        for (const auto& item : _items) {
-            if (item.id == idStr) {
-                initialStock = item.initialStock;
-                break;
-            }
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        const Item* item = findItem(itemId);
+        if (!item) {
+            return 0;
         }
+        return item->initialStock - item->consumed;
+    }
+    
+    // ========================================
+    // Balances
+    // ========================================
+    
+    /**
+     * Get per-user balances as JSON string.
+     * owed = units consumed x item price, balance = owed - paid.
+     */
+    String getBalancesJson() {
+        AllocScope scope(ALLOC_STORAGE);
+        std::lock_guard<std::recursive_mutex> lock(_lock);
         
-        // Calculate consumed
-        int consumed = 0;
-        for (const auto& record : _consumption) {
-            if (record.itemId == idStr) {
-                consumed += record.quantity;
+        // Size the document from the ledger instead of a fixed 16 KB
+        size_t capacity = JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(_users.size()) +
+            _users.size() * (JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(0)) +
+            _ledger.size() * (JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(6));
+        DynamicJsonDocument doc(capacity);
+        
+        JsonArray usersArray = doc.createNestedArray("users");
+        for (const auto& user : _users) {
+            JsonObject userObj = usersArray.createNestedObject();
+            userObj["userId"] = (const char*)user.id;
+            userObj["name"] = (const char*)user.name;
+            
+            int32_t totalQuantity = 0;
+            float totalOwed = 0;
+            float totalPaid = 0;
+            JsonArray itemsArray = userObj.createNestedArray("items");
+            for (const auto& entry : _ledger) {
+                if (strcmp(entry.userId, user.id) != 0) {
+                    continue;
+                }
+                
+                const Item* item = findItem(entry.itemId);
+                float owed = item ? entry.quantity * item->price : 0;
+                
+                JsonObject entryObj = itemsArray.createNestedObject();
+                entryObj["itemId"] = (const char*)entry.itemId;
+                entryObj["name"] = item ? (const char*)item->name : "";
+                entryObj["quantity"] = entry.quantity;
+                entryObj["owed"] = owed;
+                entryObj["paid"] = entry.paid;
+                entryObj["balance"] = owed - entry.paid;
+                
+                totalQuantity += entry.quantity;
+                totalOwed += owed;
+                totalPaid += entry.paid;
             }
+            
+            userObj["quantity"] = totalQuantity;
+            userObj["owed"] = totalOwed;
+            userObj["paid"] = totalPaid;
+            userObj["balance"] = totalOwed - totalPaid;
         }
         
-        return initialStock - consumed;
+        String output;
+        serializeJson(doc, output);
+        return output;
     }
     
     // ========================================
@@ -254,63 +776,86 @@ public:
     // ========================================
     
     bool addConsumption(const char* id, const char* userId, const char* itemId, int quantity) {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        
         if (_consumption.size() >= MAX_CONSUMPTION_RECORDS) {
             DEBUG_PRINTLN("[DATA] Max consumption records reached");
             return false;
         }
         
-        ConsumptionRecord record;
-        record.id = id;
-        record.userId = userId;
-        record.itemId = itemId;
-        record.quantity = quantity;
-        record.timestamp = String(millis());
-        _consumption.push_back(record);
+        if (!fits(id, MAX_ID_LENGTH) || !fits(userId, MAX_ID_LENGTH) || !fits(itemId, MAX_ID_LENGTH) ||
+            quantity <= 0 || quantity > UINT16_MAX) {
+            return false;
+        }
         
-        saveData();
+        uint32_t timestamp = millis();
+        applyAddConsumption(id, userId, itemId, quantity, timestamp);
+        
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "ac";
+        record["id"] = id;
+        record["u"] = userId;
+        record["i"] = itemId;
+        record["q"] = quantity;
+        record["t"] = timestamp;
+        appendLog(record);
+        journal(CHANGE_PUT, COLLECTION_CONSUMPTION, id);
         return true;
     }
     
     bool removeConsumption(const char* id) {
-        String idStr = id;
+        std::lock_guard<std::recursive_mutex> lock(_lock);
         
-        auto it = _consumption.begin();
-        while (it != _consumption.end()) {
-            if (it->id == idStr) {
-                it = _consumption.erase(it);
-                saveData();
-                return true;
-            } else {
-                ++it;
-            }
+        if (!applyRemoveConsumption(id)) {
+            return false;
         }
-        return false;
+        
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "rc";
+        record["id"] = id;
+        appendLog(record);
+        journal(CHANGE_DELETE, COLLECTION_CONSUMPTION, id);
+        return true;
     }
     
     void removeConsumptionByUser(const char* userId) {
-        String idStr = userId;
-        
         auto it = _consumption.begin();
         while (it != _consumption.end()) {
-            if (it->userId == idStr) {
+            if (strcmp(it->userId, userId) == 0) {
+                adjustConsumed(it->itemId, -(int32_t)it->quantity);
+                if (_inBatch) {
+                    _savepoint.consumption.erased(it - _consumption.begin(), *it);
+                }
                 it = _consumption.erase(it);
             } else {
                 ++it;
             }
         }
+        _consumptionIndex.rebuild();
+        
+        clearLedgerEntries(userId, nullptr, true, false);
     }
     
     void removeConsumptionByItem(const char* itemId) {
-        String idStr = itemId;
-        
         auto it = _consumption.begin();
         while (it != _consumption.end()) {
-            if (it->itemId == idStr) {
+            if (strcmp(it->itemId, itemId) == 0) {
+                if (_inBatch) {
+                    _savepoint.consumption.erased(it - _consumption.begin(), *it);
+                }
                 it = _consumption.erase(it);
             } else {
                 ++it;
             }
         }
+        _consumptionIndex.rebuild();
+        
+        Item* item = findItem(itemId);
+        if (item) {
+            item->consumed = 0;
+        }
+        
+        clearLedgerEntries(nullptr, itemId, true, false);
     }
     
     // ========================================
@@ -318,60 +863,171 @@ public:
     // ========================================
     
     bool addPayment(const char* id, const char* userId, const char* itemId, float amount) {
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        
         if (_payments.size() >= MAX_PAYMENT_RECORDS) {
             DEBUG_PRINTLN("[DATA] Max payment records reached");
             return false;
         }
         
-        PaymentRecord payment;
-        payment.id = id;
-        payment.userId = userId;
-        payment.itemId = itemId;
-        payment.amount = amount;
-        payment.timestamp = String(millis());
-        _payments.push_back(payment);
-        
-        saveData();
+        if (!fits(id, MAX_ID_LENGTH) || !fits(userId, MAX_ID_LENGTH) || !fits(itemId, MAX_ID_LENGTH)) {
+            return false;
+        }
+        
+        uint32_t timestamp = millis();
+        applyAddPayment(id, userId, itemId, amount, timestamp);
+        
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        record["op"] = "ap";
+        record["id"] = id;
+        record["u"] = userId;
+        record["i"] = itemId;
+        record["a"] = amount;
+        record["t"] = timestamp;
+        appendLog(record);
+        journal(CHANGE_PUT, COLLECTION_PAYMENTS, id);
         return true;
     }
     
     void removePaymentsByUser(const char* userId) {
-        String idStr = userId;
-        
         auto it = _payments.begin();
         while (it != _payments.end()) {
-            if (it->userId == idStr) {
+            if (strcmp(it->userId, userId) == 0) {
+                if (_inBatch) {
+                    _savepoint.payments.erased(it - _payments.begin(), *it);
+                }
                 it = _payments.erase(it);
             } else {
                 ++it;
             }
         }
+        _paymentIndex.rebuild();
+        
+        clearLedgerEntries(userId, nullptr, false, true);
     }
     
     void removePaymentsByItem(const char* itemId) {
-        String idStr = itemId;
-        
         auto it = _payments.begin();
         while (it != _payments.end()) {
-            if (it->itemId == idStr) {
+            if (strcmp(it->itemId, itemId) == 0) {
+                if (_inBatch) {
+                    _savepoint.payments.erased(it - _payments.begin(), *it);
+                }
                 it = _payments.erase(it);
             } else {
                 ++it;
             }
         }
+        _paymentIndex.rebuild();
+        
+        clearLedgerEntries(nullptr, itemId, false, true);
+    }
+    
+    // ========================================
+    // Batches
+    // ========================================
+    
+    /**
+     * Start applying several changes as one: the lock is held and
+     * nothing is written until commitBatch(), and abortBatch() undoes
+     * every change since this call. Use StorageBatch rather than
+     * calling these directly.
+     */
+    void beginBatch() {
+        AllocScope scope(ALLOC_STORAGE);
+        _lock.lock();
+        
+        _savepoint.journalNext = _journalNext;
+        _savepoint.journalFloor = _journalFloor;
+        _savepoint.version = _version;
+        _savepoint.pendingLength = _pending.length();
+        _savepoint.pendingChanges = _pendingChanges;
+        _savepoint.snapshotDue = _snapshotDue;
+        _inBatch = true;
+    }
+    
+    /**
+     * Keep the batch and persist it like a single change
+     */
+    void commitBatch() {
+        _inBatch = false;
+        _committedVersion = _version.load();
+        releaseSavepoint();
+        
+        if (!_groupCommit || _pending.length() >= STORAGE_COMMIT_BYTE_BUDGET) {
+            requestWrite();
+        }
+        _lock.unlock();
+    }
+    
+    /**
+     * Restore the state as it was at beginBatch()
+     */
+    void abortBatch() {
+        AllocScope scope(ALLOC_STORAGE);
+        _inBatch = false;
+        
+        // Rolled back in place, so the vectors keep their capacity
+        _savepoint.users.rollback(_users);
+        _savepoint.items.rollback(_items);
+        _savepoint.consumption.rollback(_consumption);
+        _savepoint.payments.rollback(_payments);
+        _savepoint.journal.rollback(_journal);
+        _journalNext = _savepoint.journalNext;
+        _journalFloor = _savepoint.journalFloor;
+        _version = _savepoint.version;
+        _pending.remove(_savepoint.pendingLength);
+        _pendingChanges = _savepoint.pendingChanges;
+        _snapshotDue = _savepoint.snapshotDue;
+        releaseSavepoint();
+        
+        _userIndex.rebuild();
+        _itemIndex.rebuild();
+        _consumptionIndex.rebuild();
+        _paymentIndex.rebuild();
+        rebuildConsumedCounts();
+        rebuildLedger();
+        
+        DEBUG_PRINTLN("[DATA] Batch rolled back");
+        _lock.unlock();
     }
     
     // ========================================
     // Reset / Clear
     // ========================================
     
+    /**
+     * Delete all data, also saved data that could not be loaded
+     */
     void reset() {
+        AllocScope scope(ALLOC_STORAGE);
+        std::lock_guard<std::recursive_mutex> lock(_lock);
+        
+        _loadFailed = false;
         _users.clear();
         _items.clear();
         _consumption.clear();
         _payments.clear();
+        _ledger.clear();
+        
+        _ledgerIndex.rebuild();
+        _userIndex.rebuild();
+        _itemIndex.rebuild();
+        _consumptionIndex.rebuild();
+        _paymentIndex.rebuild();
+        _version++;
+        _committedVersion = _version.load();
         
-        saveData();
+        // Clients can no longer catch up from the journal
+        _journal.clear();
+        _journalNext = 0;
+        _journalFloor = _version;
+        
+        _snapshotDue = true;
+        markChanged();
+        if (!_inBatch) {
+            requestWrite();
+        }
         DEBUG_PRINTLN("[DATA] All data reset");
     }
 
@@ -381,88 +1037,1124 @@ private:
     std::vector<Item> _items;
     std::vector<ConsumptionRecord> _consumption;
     std::vector<PaymentRecord> _payments;
+    std::vector<LedgerEntry> _ledger;
+    
+    // Id lookups (and case-folded names for users and items); every
+    // collection keeps its order on erase, the UI lists history in it
+    IdIndex<User, MAX_USERS, FoldedNameKey> _userIndex;
+    IdIndex<Item, MAX_ITEMS, FoldedNameKey> _itemIndex;
+    IdIndex<ConsumptionRecord, MAX_CONSUMPTION_RECORDS> _consumptionIndex;
+    IdIndex<PaymentRecord, MAX_PAYMENT_RECORDS> _paymentIndex;
+    IdIndex<LedgerEntry, MAX_LEDGER_ENTRIES, NoKey, LedgerKey> _ledgerIndex;
+    
+    bool _useLog;
+    uint32_t _generation;   // Generation of the current snapshot
+    int _snapshotSlot;      // Slot of the stored snapshot's chunks, -1 if none
+    int _logCount;          // Log entries written since that snapshot
+    size_t _bytesWritten;
+    
+    // Group commit; _lock is held by every mutation and by tick()/flush(),
+    // which run on the main loop while the web server mutates state.
+    // Recursive so a batch can hold it across several mutations.
+    std::recursive_mutex _lock;
+    bool _groupCommit;
+    String _pending;        // Serialized records not yet written, one per line
+    bool _snapshotDue;      // Pending changes need a snapshot, not a log entry
+    int _pendingChanges;
+    uint32_t _firstChangeAt;
+    uint32_t _lastChangeAt;
+    uint32_t _flushCount;
+    uint32_t _flushesAvoided;
+    
+    // Set by a write NVS refused, under _storeLock, until a snapshot
+    // is stored; read under _lock to retry it
+    std::atomic<bool> _writeFailed;
+    std::atomic<uint32_t> _failedAt;
+    bool _loadFailed;       // Saved data not loaded; never written over
+    
+    // Deferred writes. _storeLock is held for each NVS write and taken
+    // while _lock is still held, so writes are stored in the order they
+    // were taken: inline writers keep _lock throughout, and persist()
+    // runs on one task only, so at most one writer ever waits for it.
+    std::function<void()> _onWriteRequest;
+    std::mutex _storeLock;
+    LatencyHistogram _writeTimes;
+    uint32_t _maxWriteTimeUs;
+    LatencyHistogram _loadTimes;
+    LatencyHistogram _stateTimes;
+    FlashWear _wear;        // Also under _storeLock, once begin() is done
+    
+    // State version, read without the lock, the version getVersion()
+    // reports, which a batch only moves on commit, and the last
+    // published snapshot, swapped atomically
+    uint32_t _bootId;
+    std::atomic<uint32_t> _version;
+    std::atomic<uint32_t> _committedVersion;
+    std::shared_ptr<const StateSnapshot> _snapshot;
+    
+    // Ring of the last CHANGE_JOURNAL_SIZE changes; complete for every
+    // version after _journalFloor
+    std::vector<ChangeEntry> _journal;
+    size_t _journalNext;    // Oldest entry once the ring is full
+    uint32_t _journalFloor;
+    
+    // What a batch changed, to undo it: the records it touched, and
+    // the counters as they were when it began. Item consumption counts
+    // and the ledger follow from the records and are rebuilt.
+    struct Savepoint {
+        UndoLog<User> users;
+        UndoLog<Item> items;
+        UndoLog<ConsumptionRecord> consumption;
+        UndoLog<PaymentRecord> payments;
+        UndoLog<ChangeEntry> journal;
+        size_t journalNext;
+        uint32_t journalFloor;
+        uint32_t version;
+        size_t pendingLength;
+        int pendingChanges;
+        bool snapshotDue;
+    };
+    Savepoint _savepoint;
+    bool _inBatch;
+    
+    // ========================================
+    // Mutation primitives (shared by the public
+    // operations and by log replay)
+    // ========================================
+    
+    void applyAddUser(const char* id, const char* name) {
+        User user;
+        copyField(user.id, sizeof(user.id), id);
+        copyName(user.name, sizeof(user.name), name, id);
+        _userIndex.add(user);
+        if (_inBatch) {
+            _savepoint.users.added();
+        }
+    }
+    
+    bool applyRemoveUser(const char* id) {
+        int slot = _userIndex.find(id);
+        if (slot < 0) {
+            return false;
+        }
+        if (_inBatch) {
+            _savepoint.users.erased(slot, _users[slot]);
+        }
+        _userIndex.removeAt(slot);
+        
+        // Also remove related consumption and payments
+        removeConsumptionByUser(id);
+        removePaymentsByUser(id);
+        return true;
+    }
+    
+    void applyAddItem(const char* id, const char* name, float price, int stock) {
+        Item item;
+        copyField(item.id, sizeof(item.id), id);
+        copyName(item.name, sizeof(item.name), name, id);
+        item.price = price;
+        item.initialStock = stock;
+        item.consumed = sumConsumed(id);
+        _itemIndex.add(item);
+        if (_inBatch) {
+            _savepoint.items.added();
+        }
+    }
+    
+    bool applyRemoveItem(const char* id) {
+        int slot = _itemIndex.find(id);
+        if (slot < 0) {
+            return false;
+        }
+        if (_inBatch) {
+            _savepoint.items.erased(slot, _items[slot]);
+        }
+        _itemIndex.removeAt(slot);
+        
+        // Also remove related consumption and payments
+        removeConsumptionByItem(id);
+        removePaymentsByItem(id);
+        return true;
+    }
+    
+    bool applyUpdateItemStock(const char* id, int stock) {
+        Item* item = findItem(id);
+        if (!item) {
+            return false;
+        }
+        if (_inBatch) {
+            _savepoint.items.changed(item - _items.data(), *item);
+        }
+        item->initialStock = stock;
+        return true;
+    }
+    
+    void applyAddConsumption(const char* id, const char* userId, const char* itemId,
+                             int quantity, uint32_t timestamp) {
+        ConsumptionRecord record;
+        copyField(record.id, sizeof(record.id), id);
+        copyField(record.userId, sizeof(record.userId), userId);
+        copyField(record.itemId, sizeof(record.itemId), itemId);
+        record.quantity = quantity;
+        record.timestamp = timestamp;
+        _consumptionIndex.add(record);
+        if (_inBatch) {
+            _savepoint.consumption.added();
+        }
+        
+        adjustConsumed(itemId, quantity);
+        findLedgerEntry(userId, itemId, true)->quantity += quantity;
+    }
+    
+    bool applyRemoveConsumption(const char* id) {
+        int slot = _consumptionIndex.find(id);
+        if (slot < 0) {
+            return false;
+        }
+        
+        const ConsumptionRecord& record = _consumption[slot];
+        adjustConsumed(record.itemId, -(int32_t)record.quantity);
+        LedgerEntry* entry = findLedgerEntry(record.userId, record.itemId, false);
+        if (entry) {
+            entry->quantity -= record.quantity;
+            if (entry->quantity == 0 && entry->paid == 0) {
+                _ledgerIndex.removeAt(entry - _ledger.data());
+            }
+        }
+        
+        if (_inBatch) {
+            _savepoint.consumption.erased(slot, _consumption[slot]);
+        }
+        _consumptionIndex.removeAt(slot);
+        return true;
+    }
+    
+    void applyAddPayment(const char* id, const char* userId, const char* itemId,
+                         float amount, uint32_t timestamp) {
+        PaymentRecord payment;
+        copyField(payment.id, sizeof(payment.id), id);
+        copyField(payment.userId, sizeof(payment.userId), userId);
+        copyField(payment.itemId, sizeof(payment.itemId), itemId);
+        payment.amount = amount;
+        payment.timestamp = timestamp;
+        _paymentIndex.add(payment);
+        if (_inBatch) {
+            _savepoint.payments.added();
+        }
+        
+        findLedgerEntry(userId, itemId, true)->paid += amount;
+    }
+    
+    // ========================================
+    // Per-item consumption counters
+    // ========================================
+    
+    Item* findItem(const char* id) {
+        int slot = _itemIndex.find(id);
+        return slot < 0 ? nullptr : &_items[slot];
+    }
+    
+    void adjustConsumed(const char* itemId, int32_t delta) {
+        Item* item = findItem(itemId);
+        if (item) {
+            item->consumed += delta;
+        }
+    }
+    
+    /**
+     * Sum consumption for one item with a full scan
+     */
+    int32_t sumConsumed(const char* itemId) {
+        int32_t consumed = 0;
+        for (const auto& record : _consumption) {
+            if (strcmp(record.itemId, itemId) == 0) {
+                consumed += record.quantity;
+            }
+        }
+        return consumed;
+    }
+    
+    void rebuildConsumedCounts() {
+        for (auto& item : _items) {
+            item.consumed = sumConsumed(item.id);
+        }
+    }
+    
+    // ========================================
+    // Balance ledger
+    // ========================================
+    
+    LedgerEntry* findLedgerEntry(const char* userId, const char* itemId, bool create) {
+        // Compared as stored, cut to the field length
+        LedgerEntry entry;
+        copyField(entry.userId, sizeof(entry.userId), userId);
+        copyField(entry.itemId, sizeof(entry.itemId), itemId);
+        int slot = _ledgerIndex.find(LedgerKey::of(entry));
+        if (slot >= 0) {
+            return &_ledger[slot];
+        }
+        if (!create) {
+            return nullptr;
+        }
+        
+        entry.quantity = 0;
+        entry.paid = 0;
+        _ledgerIndex.add(entry);
+        return &_ledger.back();
+    }
+    
+    /**
+     * Zero the quantity and/or paid side of matching entries and drop
+     * entries that end up empty. A null id matches any user or item.
+     */
+    void clearLedgerEntries(const char* userId, const char* itemId, bool quantity, bool paid) {
+        auto it = _ledger.begin();
+        while (it != _ledger.end()) {
+            if ((!userId || strcmp(it->userId, userId) == 0) &&
+                (!itemId || strcmp(it->itemId, itemId) == 0)) {
+                if (quantity) it->quantity = 0;
+                if (paid) it->paid = 0;
+            }
+            
+            if (it->quantity == 0 && it->paid == 0) {
+                it = _ledger.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        _ledgerIndex.rebuild();
+    }
+    
+    void rebuildLedger() {
+        _ledger.clear();
+        _ledgerIndex.rebuild();
+        for (const auto& record : _consumption) {
+            findLedgerEntry(record.userId, record.itemId, true)->quantity += record.quantity;
+        }
+        for (const auto& payment : _payments) {
+            findLedgerEntry(payment.userId, payment.itemId, true)->paid += payment.amount;
+        }
+    }
+    
+    // Quoted entity tag of version
+    void formatETag(char* etag, size_t size, uint32_t version) const {
+        snprintf(etag, size, "\"%08lx-%lu\"", (unsigned long)_bootId, (unsigned long)version);
+    }
     
     /**
-     * Load all data from NVS
+     * True if value is non-null and at most maxLength characters
+     */
+    static bool fits(const char* value, size_t maxLength) {
+        return value && strlen(value) <= maxLength;
+    }
+    
+    /**
+     * Copy a string into a fixed-size field, truncating if needed
+     */
+    static void copyField(char* dest, size_t size, const char* src) {
+        strncpy(dest, src ? src : "", size - 1);
+        dest[size - 1] = '\0';
+    }
+    
+    /**
+     * Copy the name of record id; only data saved before names were
+     * limited to MAX_NAME_LENGTH can hold a longer one, which is
+     * truncated with a warning
+     */
+    static void copyName(char* dest, size_t size, const char* name, const char* id) {
+        if (name && strlen(name) >= size) {
+            DEBUG_PRINTF("[DATA] WARNING: Name of %s truncated to %u characters\n", id, (unsigned)(size - 1));
+        }
+        copyField(dest, size, name);
+    }
+    
+    /**
+     * Timestamps are strings in the JSON API and numbers internally
+     */
+    static uint32_t parseTimestamp(JsonVariant value) {
+        if (value.is<const char*>()) {
+            return strtoul(value.as<const char*>(), nullptr, 10);
+        }
+        return value.as<uint32_t>();
+    }
+    
+    /**
+     * Apply one log record to the in-memory state
+     */
+    bool applyLogRecord(JsonDocument& record) {
+        const char* op = record["op"] | "";
+        const char* id = record["id"] | "";
+        
+        if (strcmp(op, "au") == 0) {
+            applyAddUser(id, record["n"] | "");
+        } else if (strcmp(op, "ru") == 0) {
+            applyRemoveUser(id);
+        } else if (strcmp(op, "ai") == 0) {
+            applyAddItem(id, record["n"] | "", record["p"] | 0.0f, record["s"] | 0);
+        } else if (strcmp(op, "ri") == 0) {
+            applyRemoveItem(id);
+        } else if (strcmp(op, "us") == 0) {
+            applyUpdateItemStock(id, record["s"] | 0);
+        } else if (strcmp(op, "ac") == 0) {
+            applyAddConsumption(id, record["u"] | "", record["i"] | "",
+                                record["q"] | 0, parseTimestamp(record["t"]));
+        } else if (strcmp(op, "rc") == 0) {
+            applyRemoveConsumption(id);
+        } else if (strcmp(op, "ap") == 0) {
+            applyAddPayment(id, record["u"] | "", record["i"] | "",
+                            record["a"] | 0.0f, parseTimestamp(record["t"]));
+        } else {
+            return false;
+        }
+        return true;
+    }
+    
+    // ========================================
+    // Persistence
+    // ========================================
+    
+    /**
+     * Write the users, items, consumption and payments members of the
+     * state object. Each record goes through its own small document so
+     * strings are escaped exactly as before; record fields are passed
+     * by pointer, nothing is copied.
+     */
+    size_t writeRecords(Print& out) {
+        StaticJsonDocument<JSON_OBJECT_SIZE(5)> doc;
+        char timestamp[12];
+        size_t written = 0;
+        
+        // Users array
+        written += out.print("\"users\":[");
+        for (size_t i = 0; i < _users.size(); i++) {
+            doc.clear();
+            toJson(doc.to<JsonObject>(), _users[i], timestamp);
+            written += writeElement(out, doc, i);
+        }
+        
+        // Items array
+        written += out.print("],\"items\":[");
+        for (size_t i = 0; i < _items.size(); i++) {
+            doc.clear();
+            toJson(doc.to<JsonObject>(), _items[i], timestamp);
+            written += writeElement(out, doc, i);
+        }
+        
+        // Consumption array
+        written += out.print("],\"consumption\":[");
+        for (size_t i = 0; i < _consumption.size(); i++) {
+            doc.clear();
+            toJson(doc.to<JsonObject>(), _consumption[i], timestamp);
+            written += writeElement(out, doc, i);
+        }
+        
+        // Payments array
+        written += out.print("],\"payments\":[");
+        for (size_t i = 0; i < _payments.size(); i++) {
+            doc.clear();
+            toJson(doc.to<JsonObject>(), _payments[i], timestamp);
+            written += writeElement(out, doc, i);
+        }
+        written += out.print(']');
+        
+        return written;
+    }
+    
+    // Fields of one record as they appear in the state JSON. Strings
+    // are stored by reference, so timestamp must outlive the document.
+    static void toJson(JsonObject obj, const User& user, char*) {
+        obj["id"] = (const char*)user.id;
+        obj["name"] = (const char*)user.name;
+    }
+    
+    static void toJson(JsonObject obj, const Item& item, char*) {
+        obj["id"] = (const char*)item.id;
+        obj["name"] = (const char*)item.name;
+        obj["price"] = item.price;
+        obj["initialStock"] = item.initialStock;
+    }
+    
+    static void toJson(JsonObject obj, const ConsumptionRecord& record, char* timestamp) {
+        snprintf(timestamp, 12, "%lu", (unsigned long)record.timestamp);
+        obj["id"] = (const char*)record.id;
+        obj["userId"] = (const char*)record.userId;
+        obj["itemId"] = (const char*)record.itemId;
+        obj["quantity"] = record.quantity;
+        obj["timestamp"] = (const char*)timestamp;
+    }
+    
+    static void toJson(JsonObject obj, const PaymentRecord& payment, char* timestamp) {
+        snprintf(timestamp, 12, "%lu", (unsigned long)payment.timestamp);
+        obj["id"] = (const char*)payment.id;
+        obj["userId"] = (const char*)payment.userId;
+        obj["itemId"] = (const char*)payment.itemId;
+        obj["amount"] = payment.amount;
+        obj["timestamp"] = (const char*)timestamp;
+    }
+    
+    /**
+     * Fill obj with the current record id of collection; false if it
+     * no longer exists
+     */
+    bool writeRecordJson(JsonObject obj, uint8_t collection, const char* id, char* timestamp) {
+        switch (collection) {
+            case COLLECTION_USERS:
+                return writeRecordJson(obj, _userIndex.find(id), _users, timestamp);
+            case COLLECTION_ITEMS:
+                return writeRecordJson(obj, _itemIndex.find(id), _items, timestamp);
+            case COLLECTION_CONSUMPTION:
+                return writeRecordJson(obj, _consumptionIndex.find(id), _consumption, timestamp);
+            default:
+                return writeRecordJson(obj, _paymentIndex.find(id), _payments, timestamp);
+        }
+    }
+    
+    template <typename Record>
+    static bool writeRecordJson(JsonObject obj, int slot, const std::vector<Record>& records, char* timestamp) {
+        if (slot < 0) {
+            return false;
+        }
+        toJson(obj, records[slot], timestamp);
+        return true;
+    }
+    
+    static const char* collectionName(uint8_t collection) {
+        static const char* const names[] = {"users", "items", "consumption", "payments"};
+        return names[collection];
+    }
+    
+    /**
+     * Add an entry for the change that produced the current version
+     */
+    void journal(uint8_t kind, uint8_t collection, const char* id) {
+        ChangeEntry entry;
+        entry.version = _version;
+        entry.kind = kind;
+        entry.collection = collection;
+        copyField(entry.id, sizeof(entry.id), id);
+        
+        if (_journal.size() < CHANGE_JOURNAL_SIZE) {
+            _journal.push_back(entry);
+            if (_inBatch) {
+                _savepoint.journal.added();
+            }
+            return;
+        }
+        
+        // Overwrite the oldest entry; its version is no longer complete
+        if (_inBatch) {
+            _savepoint.journal.changed(_journalNext, _journal[_journalNext]);
+        }
+        _journalFloor = std::max(_journalFloor, _journal[_journalNext].version);
+        _journal[_journalNext] = entry;
+        _journalNext = (_journalNext + 1) % CHANGE_JOURNAL_SIZE;
+    }
+    
+    static size_t writeElement(Print& out, JsonDocument& doc, size_t index) {
+        size_t written = index > 0 ? out.print(',') : 0;
+        return written + serializeJson(doc, out);
+    }
+    
+    /**
+     * Move data saved before STORAGE_PARTITION existed out of the
+     * default nvs partition: copied key by key, "state" and "snap" last
+     * so the copy only counts once whole, then erased there. The wear
+     * counters start over with the new partition. False if the copy
+     * failed; it is removed again and the data left where it was.
+     */
+    bool moveFromDefaultPartition() {
+        if (_prefs.isKey("snap") || _prefs.isKey("state")) {
+            return true;
+        }
+        Preferences old;
+        if (!old.begin(NVS_NAMESPACE, true)) {
+            return true;    // Nothing was ever saved there
+        }
+        
+        bool copied = true;
+        char key[12];
+        for (int i = 0; copied && i < STORAGE_LOG_MAX_ENTRIES; i++) {
+            logKey(key, i);
+            if (!old.isKey(key)) {
+                break;
+            }
+            copied = copyValue(old, key);
+        }
+        for (int slot = 0; slot < 2; slot++) {
+            for (int i = 0; copied; i++) {
+                chunkKey(key, slot, i);
+                if (!old.isKey(key)) {
+                    break;
+                }
+                copied = copyValue(old, key);
+            }
+        }
+        copied = copied && copyValue(old, "state") && copyValue(old, "snap");
+        old.end();
+        
+        if (!copied) {
+            DEBUG_PRINTLN("[DATA] ERROR: Saved data could not be moved to the " STORAGE_PARTITION " partition");
+            _prefs.clear();
+            return false;
+        }
+        old.begin(NVS_NAMESPACE, false);
+        old.clear();
+        old.end();
+        DEBUG_PRINTLN("[DATA] Moved saved data to the " STORAGE_PARTITION " partition");
+        return true;
+    }
+    
+    // Copy key, if from has it; false if NVS refused it
+    bool copyValue(Preferences& from, const char* key) {
+        if (!from.isKey(key)) {
+            return true;
+        }
+        String value = from.getString(key);
+        return _prefs.putString(key, value) == value.length();
+    }
+    
+    /**
+     * Load snapshot and replay the log from NVS
      */
     void loadData() {
+        ScopedLatency timer(_loadTimes);
+        if (loadSnapshot()) {
+            replayLog();
+        } else {
+            _loadFailed = true;
+            DEBUG_PRINTLN("[DATA] ERROR: Saved data could not be loaded, not writing to NVS");
+        }
+        rebuildConsumedCounts();
+        rebuildLedger();
+        
+        DEBUG_PRINTF("[DATA] Loaded %d users, %d items, %d consumption records, %d payments\n",
+            _users.size(), _items.size(), _consumption.size(), _payments.size());
+    }
+    
+    /**
+     * Load the last snapshot from NVS; false if there is one that
+     * could not be loaded
+     */
+    bool loadSnapshot() {
+        if (_prefs.isKey("snap")) {
+            return loadChunks();
+        }
+        
         String stateJson = _prefs.getString("state", "{}");
         
         if (stateJson == "{}") {
             DEBUG_PRINTLN("[DATA] No saved data found, starting fresh");
-            return;
+            return true;
         }
+        _wear.noteLive("state", FlashWear::stringEntries(stateJson.length()));
         
-        DynamicJsonDocument doc(16384);
+        // Written as one string, so within what NVS stores in one; the
+        // document is sized for it, and not allocated if it cannot be
+        DynamicJsonDocument doc(LEGACY_SNAPSHOT_CAPACITY(stateJson.length()));
+        if (doc.capacity() == 0) {
+            DEBUG_PRINTF("[DATA] No memory to parse saved data (%u bytes)\n", stateJson.length());
+            return false;
+        }
         DeserializationError error = deserializeJson(doc, stateJson);
         
         if (error) {
             DEBUG_PRINTF("[DATA] Error parsing saved data: %s\n", error.c_str());
-            return;
+            return false;
         }
         
+        // Snapshots written before the log existed have no generation
+        _generation = doc["gen"] | 0;
+        
         // Load users
         JsonArray usersArray = doc["users"].as<JsonArray>();
         for (JsonObject userObj : usersArray) {
-            User user;
-            user.id = userObj["id"].as<String>();
-            user.name = userObj["name"].as<String>();
-            _users.push_back(user);
+            if (_users.size() >= MAX_USERS) break;
+            applyAddUser(userObj["id"] | "", userObj["name"] | "");
         }
         
         // Load items
         JsonArray itemsArray = doc["items"].as<JsonArray>();
         for (JsonObject itemObj : itemsArray) {
-            Item item;
-            item.id = itemObj["id"].as<String>();
-            item.name = itemObj["name"].as<String>();
-            item.price = itemObj["price"].as<float>();
-            item.initialStock = itemObj["initialStock"].as<int>();
-            _items.push_back(item);
+            if (_items.size() >= MAX_ITEMS) break;
+            applyAddItem(itemObj["id"] | "", itemObj["name"] | "",
+                         itemObj["price"].as<float>(), itemObj["initialStock"].as<int>());
         }
         
         // Load consumption
         JsonArray consumptionArray = doc["consumption"].as<JsonArray>();
         for (JsonObject recObj : consumptionArray) {
-            ConsumptionRecord record;
-            record.id = recObj["id"].as<String>();
-            record.userId = recObj["userId"].as<String>();
-            record.itemId = recObj["itemId"].as<String>();
-            record.quantity = recObj["quantity"].as<int>();
-            record.timestamp = recObj["timestamp"].as<String>();
-            _consumption.push_back(record);
+            if (_consumption.size() >= MAX_CONSUMPTION_RECORDS) break;
+            applyAddConsumption(recObj["id"] | "", recObj["userId"] | "", recObj["itemId"] | "",
+                                recObj["quantity"].as<int>(), parseTimestamp(recObj["timestamp"]));
         }
         
         // Load payments
         JsonArray paymentsArray = doc["payments"].as<JsonArray>();
         for (JsonObject payObj : paymentsArray) {
-            PaymentRecord payment;
-            payment.id = payObj["id"].as<String>();
-            payment.userId = payObj["userId"].as<String>();
-            payment.itemId = payObj["itemId"].as<String>();
-            payment.amount = payObj["amount"].as<float>();
-            payment.timestamp = payObj["timestamp"].as<String>();
-            _payments.push_back(payment);
+            if (_payments.size() >= MAX_PAYMENT_RECORDS) break;
+            applyAddPayment(payObj["id"] | "", payObj["userId"] | "", payObj["itemId"] | "",
+                            payObj["amount"].as<float>(), parseTimestamp(payObj["timestamp"]));
         }
+        return true;
+    }
+    
+    /**
+     * Load a snapshot stored as chunks of records, one record at a
+     * time; false if a chunk is missing or does not parse
+     */
+    bool loadChunks() {
+        String header = _prefs.getString("snap");
+        _wear.noteLive("snap", FlashWear::stringEntries(header.length()));
+        StaticJsonDocument<SNAPSHOT_HEADER_CAPACITY> doc;
+        DeserializationError error = deserializeJson(doc, header);
+        if (error) {
+            DEBUG_PRINTF("[DATA] Error parsing snapshot header: %s\n", error.c_str());
+            return false;
+        }
+        _generation = doc["gen"] | 0;
+        // Headers written before the slot was stored: slot generation % 2
+        _snapshotSlot = doc["slot"] | (int)(_generation % 2);
         
-        DEBUG_PRINTF("[DATA] Loaded %d users, %d items, %d consumption records, %d payments\n",
-            _users.size(), _items.size(), _consumption.size(), _payments.size());
+        int chunks = doc["chunks"] | 0;
+        for (int i = 0; i < chunks; i++) {
+            char key[12];
+            chunkKey(key, _snapshotSlot, i);
+            String chunk = _prefs.getString(key);
+            _wear.noteLive(key, FlashWear::stringEntries(chunk.length()));
+            if (chunk.length() == 0 || !applyRecords(chunk, false)) {
+                DEBUG_PRINTF("[DATA] Error loading snapshot chunk %d\n", i);
+                return false;
+            }
+        }
+        return true;
     }
     
     /**
-     * Save all data to NVS
+     * Replay log records written after the snapshot.
+     * Records left over from an older generation end the replay.
      */
-    void saveData() {
-        String stateJson = getStateJson();
+    void replayLog() {
+        _logCount = 0;
         
-        // NVS has limited space, check size
-        if (stateJson.length() > 15000) {
-            DEBUG_PRINTLN("[DATA] WARNING: Data size exceeds recommended limit!");
+        while (_logCount < STORAGE_LOG_MAX_ENTRIES) {
+            char key[12];
+            logKey(key, _logCount);
+            if (!_prefs.isKey(key)) {
+                break;
+            }
+            
+            String entry = _prefs.getString(key);
+            _wear.noteLive(key, FlashWear::stringEntries(entry.length()));
+            if (!replayEntry(entry)) {
+                break;
+            }
+            _logCount++;
         }
         
-        _prefs.putString("state", stateJson);
-        DEBUG_PRINTLN("[DATA] State saved to NVS");
+        if (_logCount > 0) {
+            DEBUG_PRINTF("[DATA] Replayed %d log entries\n", _logCount);
+        }
     }
+    
+    bool replayEntry(const String& entry) {
+        return applyRecords(entry, true);
+    }
+    
+    /**
+     * Apply records, one per line, of a log entry (logged: checking
+     * their generation) or of a snapshot chunk
+     */
+    bool applyRecords(const String& entry, bool logged) {
+        unsigned int start = 0;
+        while (start < entry.length()) {
+            int end = entry.indexOf('\n', start);
+            if (end < 0) {
+                end = entry.length();
+            }
+            
+            StaticJsonDocument<LOG_PARSE_CAPACITY> record;
+            DeserializationError error = deserializeJson(record, entry.c_str() + start, end - start);
+            if (error) {
+                DEBUG_PRINTF("[DATA] Error parsing log entry %d: %s\n", _logCount, error.c_str());
+                return false;
+            }
+            
+            uint32_t generation = record["g"] | 0;
+            if ((logged && generation != _generation) || !applyLogRecord(record)) {
+                return false;
+            }
+            start = end + 1;
+        }
+        return true;
+    }
+    
+    static void logKey(char* key, int index) {
+        snprintf(key, 12, "log%d", index);
+    }
+    
+    static void chunkKey(char* key, int slot, int index) {
+        snprintf(key, 12, "snap%d_%d", slot, index);
+    }
+    
+    /**
+     * Queue one change for persistence and write it unless group
+     * commit defers it. Falls back to a full snapshot when the log
+     * is disabled, full, or the record does not fit.
+     */
+    void appendLog(JsonDocument& record) {
+        AllocScope scope(ALLOC_STORAGE);
+        _version++;
+        if (!_inBatch) {
+            _committedVersion = _version.load();
+        }
+        
+        if (!_useLog || _logCount >= STORAGE_LOG_MAX_ENTRIES) {
+            _snapshotDue = true;
+        } else if (!_snapshotDue) {
+            record["g"] = _generation;
+            
+            char buffer[LOG_RECORD_SIZE];
+            if (measureJson(record) >= sizeof(buffer)) {
+                _snapshotDue = true;
+            } else {
+                serializeJson(record, buffer, sizeof(buffer));
+                if (_pending.length() > 0) {
+                    _pending += '\n';
+                }
+                _pending += buffer;
+            }
+        }
+        
+        markChanged();
+        
+        if (_inBatch) {
+            // Written once on commit; too many records for one log
+            // entry become a snapshot instead
+            if (_pending.length() >= STORAGE_COMMIT_BYTE_BUDGET) {
+                _snapshotDue = true;
+            }
+        } else if (!_groupCommit || _pending.length() >= STORAGE_COMMIT_BYTE_BUDGET) {
+            requestWrite();
+        }
+    }
+    
+    void markChanged() {
+        uint32_t now = millis();
+        if (_pendingChanges == 0) {
+            _firstChangeAt = now;
+        }
+        _lastChangeAt = now;
+        _pendingChanges++;
+    }
+    
+    // Quiet period or maximum delay of group commit over, or the
+    // maximum delay since a write failed
+    bool writeDue() const {
+        uint32_t now = millis();
+        if (_writeFailed) {
+            return now - _failedAt >= STORAGE_COMMIT_MAX_DELAY_MS;
+        }
+        if (_pendingChanges == 0) {
+            return false;
+        }
+        return now - _lastChangeAt >= STORAGE_COMMIT_QUIET_MS ||
+               now - _firstChangeAt >= STORAGE_COMMIT_MAX_DELAY_MS;
+    }
+    
+    /**
+     * Hand pending changes to the persistence task if there is one,
+     * else write them now
+     */
+    void requestWrite() {
+        if (_onWriteRequest) {
+            _onWriteRequest();
+        } else {
+            writePending();
+        }
+    }
+    
+    // One NVS write, taken from the pending changes
+    struct PendingWrite {
+        bool snapshot;
+        uint32_t generation;    // Of a snapshot
+        char key[12];           // Of a log entry
+        String value;
+    };
+    
+    /**
+     * Write all pending changes as one log entry, or as a snapshot,
+     * holding _lock throughout
+     */
+    void writePending() {
+        AllocScope scope(ALLOC_STORAGE);
+        PendingWrite write;
+        if (!takePending(write)) {
+            return;
+        }
+        std::lock_guard<std::mutex> store(_storeLock);
+        storeWrite(write);
+    }
+    
+    /**
+     * Take all pending changes as one log entry, or as a snapshot if
+     * one is due or a write failed; false if there is nothing to write.
+     * Counters move on as if written, so changes made meanwhile are
+     * logged for the generation taken and the next take gets the next
+     * log key; should the write fail, storeWrite() drops the log
+     * entries that follow until the snapshot taken next is stored.
+     */
+    bool takePending(PendingWrite& write) {
+        if (_loadFailed) {
+            return false;
+        }
+        if (_writeFailed) {
+            _snapshotDue = true;
+        }
+        if (_pendingChanges == 0 && !_snapshotDue) {
+            return false;
+        }
+        if (_pendingChanges > 1) {
+            _flushesAvoided += _pendingChanges - 1;
+        }
+        
+        write.snapshot = _snapshotDue;
+        if (_snapshotDue) {
+            serializeSnapshot(write.value);
+            _generation++;
+            write.generation = _generation;
+            _logCount = 0;
+        } else {
+            logKey(write.key, _logCount);
+            write.value = _pending;
+            _logCount++;
+        }
+        _flushCount++;
+        clearPending();
+        return true;
+    }
+    
+    /**
+     * Store a taken write in NVS; the caller holds _storeLock. A log
+     * entry is dropped while an earlier write has failed: it would
+     * not follow from what is stored.
+     */
+    bool storeWrite(const PendingWrite& write) {
+        if (!write.snapshot && _writeFailed) {
+            return false;
+        }
+        
+        uint32_t started = micros();
+        bool stored = write.snapshot ? storeSnapshot(write) : putValue(write.key, write.value);
+        uint32_t elapsed = micros() - started;
+        
+        _writeTimes.record(elapsed);
+        if (elapsed > _maxWriteTimeUs) {
+            _maxWriteTimeUs = elapsed;
+        }
+        if (!stored) {
+            DEBUG_PRINTLN("[DATA] ERROR: NVS write failed, retrying with a snapshot");
+            _failedAt = millis();
+            _writeFailed = true;
+        } else if (write.snapshot) {
+            DEBUG_PRINTLN("[DATA] State saved to NVS");
+            _writeFailed = false;
+        }
+        
+        if (_wear.saveDue(millis())) {
+            saveWear();
+        }
+        return stored;
+    }
+    
+    /**
+     * Store a snapshot: its chunks in the slot the stored snapshot is
+     * not in, then "snap", which makes it the one loaded. The previous
+     * snapshot's chunks, and leftovers, are removed afterwards.
+     */
+    bool storeSnapshot(const PendingWrite& write) {
+        const String& records = write.value;
+        int slot = _snapshotSlot == 0 ? 1 : 0;
+        char key[12];
+        int chunks = 0;
+        unsigned int start = 0;
+        while (start < records.length()) {
+            unsigned int end = records.length();
+            if (end - start > SNAPSHOT_CHUNK_SIZE) {
+                end = records.lastIndexOf('\n', start + SNAPSHOT_CHUNK_SIZE);
+            }
+            chunkKey(key, slot, chunks++);
+            if (!putValue(key, records.substring(start, end))) {
+                return false;
+            }
+            start = end + 1;
+        }
+        
+        char header[48];
+        snprintf(header, sizeof(header), "{\"gen\":%lu,\"slot\":%d,\"chunks\":%d}",
+                 (unsigned long)write.generation, slot, chunks);
+        if (!putValue("snap", header)) {
+            return false;
+        }
+        
+        removeChunks(slot, chunks);
+        removeChunks(1 - slot, 0);
+        _snapshotSlot = slot;
+        if (_prefs.isKey("state")) {
+            _prefs.remove("state");
+            _wear.noteLive("state", 0);
+        }
+        return true;
+    }
+    
+    // Remove the chunks of slot from index on
+    void removeChunks(int slot, int index) {
+        char key[12];
+        for (chunkKey(key, slot, index); _prefs.isKey(key); chunkKey(key, slot, ++index)) {
+            _prefs.remove(key);
+            _wear.noteLive(key, 0);
+        }
+    }
+    
+    // Put one string, counting it; false if NVS refused it
+    bool putValue(const char* key, const String& value) {
+        if (_prefs.putString(key, value) != value.length()) {
+            return false;
+        }
+        _bytesWritten += value.length();
+        _wear.record(key, value.length(), FlashWear::stringEntries(value.length()), millis());
+        return true;
+    }
+    
+    /**
+     * Continue the wear counters saved before the last restart
+     */
+    void loadWear() {
+        FlashWear::Record record;
+        if (_prefs.isKey("wear") && _prefs.getBytes("wear", &record, sizeof(record)) == sizeof(record)) {
+            if (_wear.restore(record)) {
+                _wear.noteLive("wear", FlashWear::blobEntries(sizeof(record)));
+            } else {
+                DEBUG_PRINTLN("[DATA] Flash wear counters of another version, starting over");
+            }
+        }
+        _wear.begin(millis());
+    }
+    
+    // Save the wear counters, their own write included; the caller holds _storeLock
+    void saveWear() {
+        uint32_t now = millis();
+        _wear.record("wear", sizeof(FlashWear::Record), FlashWear::blobEntries(sizeof(FlashWear::Record)), now);
+        const FlashWear::Record& record = _wear.save(now);
+        _prefs.putBytes("wear", &record, sizeof(record));
+    }
+    
+    /**
+     * Keep the wear uptime going between writes, and save the counters
+     * once due; the caller holds _lock
+     */
+    void tickWear() {
+        std::lock_guard<std::mutex> store(_storeLock);
+        uint32_t now = millis();
+        _wear.advance(now);
+        if (_wear.saveDue(now)) {
+            saveWear();
+        }
+    }
+    
+    void releaseSavepoint() {
+        _savepoint.users.clear();
+        _savepoint.items.clear();
+        _savepoint.consumption.clear();
+        _savepoint.payments.clear();
+        _savepoint.journal.clear();
+    }
+    
+    void clearPending() {
+        _pending = "";
+        _snapshotDue = false;
+        _pendingChanges = 0;
+    }
+    
+    /**
+     * Serialize all data as the next snapshot: records as the log
+     * writes them, one per line. Log records of the previous
+     * generation are left in place; they are ignored on replay and
+     * overwritten as the new log fills up.
+     */
+    void serializeSnapshot(String& records) {
+        records.reserve(measureStateJson());
+        StaticJsonDocument<LOG_RECORD_CAPACITY> record;
+        
+        for (const User& user : _users) {
+            record.clear();
+            record["op"] = "au";
+            record["id"] = (const char*)user.id;
+            record["n"] = (const char*)user.name;
+            writeLine(records, record);
+        }
+        for (const Item& item : _items) {
+            record.clear();
+            record["op"] = "ai";
+            record["id"] = (const char*)item.id;
+            record["n"] = (const char*)item.name;
+            record["p"] = item.price;
+            record["s"] = item.initialStock;
+            writeLine(records, record);
+        }
+        for (const ConsumptionRecord& consumption : _consumption) {
+            record.clear();
+            record["op"] = "ac";
+            record["id"] = (const char*)consumption.id;
+            record["u"] = (const char*)consumption.userId;
+            record["i"] = (const char*)consumption.itemId;
+            record["q"] = consumption.quantity;
+            record["t"] = consumption.timestamp;
+            writeLine(records, record);
+        }
+        for (const PaymentRecord& payment : _payments) {
+            record.clear();
+            record["op"] = "ap";
+            record["id"] = (const char*)payment.id;
+            record["u"] = (const char*)payment.userId;
+            record["i"] = (const char*)payment.itemId;
+            record["a"] = payment.amount;
+            record["t"] = payment.timestamp;
+            writeLine(records, record);
+        }
+    }
+    
+    static void writeLine(String& records, JsonDocument& record) {
+        if (records.length() > 0) {
+            records += '\n';
+        }
+        StringPrint sink(records);
+        serializeJson(record, sink);
+    }
+};
+
+/**
+ * Scope of a batch: rolled back on destruction unless committed
+ */
+class StorageBatch {
+public:
+    explicit StorageBatch(DataStorage& storage) : _storage(storage), _done(false) {
+        _storage.beginBatch();
+    }
+    
+    ~StorageBatch() {
+        if (!_done) {
+            _storage.abortBatch();
+        }
+    }
+    
+    void commit() {
+        _storage.commitBatch();
+        _done = true;
+    }
+
+private:
+    DataStorage& _storage;
+    bool _done;
 };
 
 #endif // DATA_STORAGE_H
@@ -0,0 +1,282 @@
+/**
+ * Flash Wear for Mate Tracker ESP32-C3
+ * Estimates what DataStorage's writes cost the NVS partition, from the
+ * way NVS lays values out: 32-byte entries in 4 KB pages of 126, a
+ * value taking a header entry and its data, values longer than a page
+ * split into chunks. Values are appended to the active page; once only
+ * the reserved free page is left, every new page costs an erase of an
+ * old one, whose live values are moved over first; the entries of each
+ * key's live value, and the page it is on, are followed for that. From
+ * the rate pages fill up it projects how long the partition lasts.
+ * 
+ * The counters are saved in NVS (see DataStorage) so they add up across
+ * reboots. The layout of the partition itself is not read back: after
+ * a boot, values loaded are taken as live and the pages as filled from
+ * the start. [env:native] checks the estimates against NvsEmulator.
+ */
+
+#ifndef FLASH_WEAR_H
+#define FLASH_WEAR_H
+
+#include <Arduino.h>
+#include "config.h"
+
+#define NVS_PAGE_SIZE 4096
+#define NVS_ENTRY_SIZE 32
+#define NVS_PAGE_ENTRIES 126
+
+// Keys whose live entries are followed: the log, the snapshot chunks
+// of both slots and the rest
+#define FLASH_WEAR_MAX_KEYS 72
+
+class FlashWear {
+public:
+    // Saved counters; version changes whenever the layout does
+    struct Record {
+        uint32_t version;
+        uint32_t writes;
+        uint64_t logicalBytes;  // Value bytes handed to NVS
+        uint64_t entries;       // Entries written for them
+        uint64_t moved;         // Entries moved by garbage collection
+        uint32_t pagesFilled;
+        uint32_t pagesErased;
+        uint64_t uptimeMs;      // Across reboots, until the last save
+    };
+    
+    static const uint32_t RECORD_VERSION = 1;
+    
+    FlashWear() : _record(), _pageUsed(0), _keyCount(0), _lastAt(0), _lastSave(0), _dirty(false) {
+        _record.version = RECORD_VERSION;
+    }
+    
+    /**
+     * Start counting uptime from now
+     */
+    void begin(uint32_t now) {
+        _lastAt = now;
+        _lastSave = now;
+    }
+    
+    /**
+     * Continue from saved counters; false if they are of another version
+     */
+    bool restore(const Record& record) {
+        if (record.version != RECORD_VERSION) {
+            return false;
+        }
+        _record = record;
+        return true;
+    }
+    
+    /**
+     * The counters to save, up to now
+     */
+    const Record& save(uint32_t now) {
+        advance(now);
+        _lastSave = now;
+        _dirty = false;
+        return _record;
+    }
+    
+    /**
+     * Written to since the last save, at least FLASH_WEAR_SAVE_INTERVAL_MS ago
+     */
+    bool saveDue(uint32_t now) const {
+        return _dirty && now - _lastSave >= FLASH_WEAR_SAVE_INTERVAL_MS;
+    }
+    
+    bool isDirty() const { return _dirty; }
+    
+    /**
+     * Add the time since the last call to the uptime; call at least
+     * once per millis() wrap
+     */
+    void advance(uint32_t now) {
+        _record.uptimeMs += now - _lastAt;
+        _lastAt = now;
+    }
+    
+    /**
+     * Entries a string of length bytes takes, with its terminating zero
+     */
+    static size_t stringEntries(size_t length) {
+        return blobEntries(length + 1);
+    }
+    
+    // Chunks of a header and up to a page of data, plus an index
+    static size_t blobEntries(size_t length) {
+        size_t data = (length + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE;
+        if (data < NVS_PAGE_ENTRIES) {
+            return 1 + data;
+        }
+        size_t chunks = (data + NVS_PAGE_ENTRIES - 2) / (NVS_PAGE_ENTRIES - 1);
+        return data + chunks + 1;
+    }
+    
+    static size_t getPageCount() { return NVS_PARTITION_SIZE / NVS_PAGE_SIZE; }
+    
+    /**
+     * Note a value found in NVS, as live, without counting a write
+     */
+    void noteLive(const char* key, size_t entries) {
+        setLive(key, entries);
+    }
+    
+    /**
+     * Count a write of length bytes taking entries to key
+     */
+    void record(const char* key, size_t length, size_t entries, uint32_t now) {
+        advance(now);
+        _record.writes++;
+        _record.logicalBytes += length;
+        _record.entries += entries;
+        _dirty = true;
+        
+        // The value it replaces is dead from here on
+        setLive(key, 0);
+        for (size_t left = entries; left > 0;) {
+            size_t chunk = left < NVS_PAGE_ENTRIES ? left : NVS_PAGE_ENTRIES;
+            if (_pageUsed + chunk > NVS_PAGE_ENTRIES) {
+                nextPage();
+            }
+            _pageUsed += chunk;
+            left -= chunk;
+        }
+        setLive(key, entries);
+    }
+    
+    uint32_t getWrites() const { return _record.writes; }
+    uint64_t getLogicalBytes() const { return _record.logicalBytes; }
+    uint64_t getEntriesWritten() const { return _record.entries; }
+    uint64_t getEntriesMoved() const { return _record.moved; }
+    uint32_t getPagesErased() const { return _record.pagesErased; }
+    
+    // Bytes programmed into entries, values and moves together
+    uint64_t getPhysicalBytes() const { return (_record.entries + _record.moved) * NVS_ENTRY_SIZE; }
+    
+    uint64_t getUptimeMs(uint32_t now) const { return _record.uptimeMs + (now - _lastAt); }
+    
+    size_t getLiveEntries() const {
+        size_t live = 0;
+        for (size_t i = 0; i < _keyCount; i++) {
+            live += _keys[i].entries;
+        }
+        return live;
+    }
+    
+    /**
+     * Physical bytes per logical byte; 0 before the first write
+     */
+    float getWriteAmplification() const {
+        return _record.logicalBytes == 0 ? 0 : (float)getPhysicalBytes() / _record.logicalBytes;
+    }
+    
+    float getWritesPerHour(uint32_t now) const {
+        uint64_t uptime = getUptimeMs(now);
+        return uptime == 0 ? 0 : _record.writes * 3600000.0f / uptime;
+    }
+    
+    /**
+     * Page erases the partition is good for, each page being rated
+     * for FLASH_ENDURANCE_CYCLES, and the share of them used (percent)
+     */
+    uint32_t getEraseBudget() const { return getPageCount() * FLASH_ENDURANCE_CYCLES; }
+    float getBudgetUsed() const { return _record.pagesErased * 100.0f / getEraseBudget(); }
+    
+    /**
+     * Years until the erase budget is used up at the rate pages have
+     * filled so far; -1 before there is a rate to go by
+     */
+    float getLifetimeYears(uint32_t now) const {
+        uint64_t uptime = getUptimeMs(now);
+        float pages = (float)(_record.entries + _record.moved) / NVS_PAGE_ENTRIES;
+        if (uptime == 0 || pages == 0) {
+            return -1;
+        }
+        float left = getEraseBudget() > _record.pagesErased ? getEraseBudget() - _record.pagesErased : 0;
+        float hours = left / (pages * 3600000.0f / uptime);
+        return hours / (24 * 365.0f);
+    }
+
+private:
+    struct Key {
+        uint32_t hash;
+        uint32_t page;      // Counted as in pagesFilled
+        uint16_t entries;
+    };
+    
+    Record _record;
+    size_t _pageUsed;       // Entries used on the active page
+    Key _keys[FLASH_WEAR_MAX_KEYS];
+    size_t _keyCount;
+    uint32_t _lastAt;
+    uint32_t _lastSave;
+    bool _dirty;
+    
+    /**
+     * Move on to a fresh page. Past the free pages, the oldest page is
+     * erased, and the live values still on it moved to the new one
+     * first. Pages are counted as they fill, so a value is on the
+     * oldest once as many pages as the partition has, less the
+     * reserve, were filled after it.
+     */
+    void nextPage() {
+        uint32_t page = ++_record.pagesFilled;
+        _pageUsed = 0;
+        if (page + 1 < getPageCount()) {
+            return;
+        }
+        for (size_t i = 0; i < _keyCount; i++) {
+            Key& key = _keys[i];
+            if (key.entries > 0 && page - key.page >= getPageCount() - 1) {
+                key.page = page;
+                _pageUsed += key.entries;
+            }
+        }
+        if (_pageUsed > NVS_PAGE_ENTRIES) {
+            _pageUsed = NVS_PAGE_ENTRIES;
+        }
+        _record.moved += _pageUsed;
+        _record.pagesErased++;
+    }
+    
+    // Entries of key's live value, now on the active page
+    void setLive(const char* key, size_t entries) {
+        uint32_t hash = hashKey(key);
+        for (size_t i = 0; i < _keyCount; i++) {
+            if (_keys[i].hash == hash) {
+                _keys[i].entries = entries;
+                _keys[i].page = _record.pagesFilled;
+                return;
+            }
+        }
+        if (entries == 0) {
+            return;
+        }
+        // Reuse the place of a key removed since
+        size_t i = 0;
+        while (i < _keyCount && _keys[i].entries > 0) {
+            i++;
+        }
+        if (i == _keyCount) {
+            if (_keyCount == FLASH_WEAR_MAX_KEYS) {
+                return;
+            }
+            _keyCount++;
+        }
+        _keys[i].hash = hash;
+        _keys[i].entries = entries;
+        _keys[i].page = _record.pagesFilled;
+    }
+    
+    // FNV-1a; keys are a few characters, collisions are not a concern
+    static uint32_t hashKey(const char* key) {
+        uint32_t hash = 2166136261u;
+        while (*key) {
+            hash = (hash ^ (uint8_t)*key++) * 16777619u;
+        }
+        return hash;
+    }
+};
+
+#endif // FLASH_WEAR_H
@@ -0,0 +1,104 @@
+/**
+ * Heap Monitor for Mate Tracker ESP32-C3
+ * Watches for fragmentation, where plenty of heap is free but no block
+ * is large enough for a big document: samples the free heap and the
+ * largest free block, keeps their lows since boot, and optionally
+ * prints them with the allocation counts of AllocTrace to serial.
+ */
+
+#ifndef HEAP_MONITOR_H
+#define HEAP_MONITOR_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "alloc_trace.h"
+
+class HeapMonitor {
+public:
+    HeapMonitor()
+        : _freeHeap(0), _largestBlock(0), _minFreeHeap(UINT32_MAX), _minLargestBlock(UINT32_MAX),
+          _lastSample(0), _lastDump(0) {}
+    
+    /**
+     * Take a sample now and start counting allocations
+     */
+    void begin() {
+        sample();
+        AllocTrace::begin();
+    }
+    
+    /**
+     * Sample every HEAP_SAMPLE_INTERVAL_MS and print a summary every
+     * HEAP_DUMP_INTERVAL_MS, if that is not 0; call from loop()
+     */
+    void tick() {
+        uint32_t now = millis();
+        if (now - _lastSample >= HEAP_SAMPLE_INTERVAL_MS) {
+            _lastSample = now;
+            sample();
+        }
+        if (HEAP_DUMP_INTERVAL_MS > 0 && now - _lastDump >= HEAP_DUMP_INTERVAL_MS) {
+            _lastDump = now;
+            dump(Serial);
+        }
+    }
+    
+    void sample() {
+        update(ESP.getFreeHeap(), ESP.getMaxAllocHeap(), ESP.getMinFreeHeap());
+    }
+    
+    /**
+     * Record a sample; minFreeHeap is the allocator's own low since boot
+     */
+    void update(uint32_t freeHeap, uint32_t largestBlock, uint32_t minFreeHeap) {
+        _freeHeap = freeHeap;
+        _largestBlock = largestBlock;
+        _minFreeHeap = minFreeHeap < freeHeap ? minFreeHeap : freeHeap;
+        if (largestBlock < _minLargestBlock) {
+            _minLargestBlock = largestBlock;
+        }
+    }
+    
+    uint32_t getFreeHeap() const { return _freeHeap; }
+    uint32_t getLargestBlock() const { return _largestBlock; }
+    uint32_t getMinFreeHeap() const { return _minFreeHeap; }
+    uint32_t getMinLargestBlock() const { return _minLargestBlock; }
+    
+    /**
+     * Share of the free heap outside the largest block (percent): 0 if
+     * it is all in one piece
+     */
+    uint8_t getFragmentation() const {
+        return _freeHeap == 0 ? 0 : 100 - (uint8_t)((uint64_t)_largestBlock * 100 / _freeHeap);
+    }
+    
+    /**
+     * One line of the last sample, and with tracing one more of the
+     * allocations per subsystem
+     */
+    void dump(Print& out) const {
+        out.printf("[HEAP] free %lu (min %lu), largest block %lu (min %lu), fragmentation %u%%\n",
+                   (unsigned long)_freeHeap, (unsigned long)_minFreeHeap, (unsigned long)_largestBlock,
+                   (unsigned long)_minLargestBlock, (unsigned)getFragmentation());
+        if (!AllocTrace::isTracing()) {
+            return;
+        }
+        out.print("[HEAP] allocations");
+        for (int i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+            const AllocTrace::Counters& counters = AllocTrace::get((AllocSubsystem)i);
+            out.printf(" %s %lu (%lu KB)", AllocTrace::name((AllocSubsystem)i), (unsigned long)counters.count,
+                       (unsigned long)(counters.bytes / 1024));
+        }
+        out.println();
+    }
+
+private:
+    uint32_t _freeHeap;
+    uint32_t _largestBlock;
+    uint32_t _minFreeHeap;
+    uint32_t _minLargestBlock;
+    uint32_t _lastSample;
+    uint32_t _lastDump;
+};
+
+#endif // HEAP_MONITOR_H
@@ -0,0 +1,317 @@
+/**
+ * Id Index for Mate Tracker ESP32-C3
+ * Open-addressing hash indexes from record id (and optionally
+ * case-folded name), or another key, to vector slot
+ */
+
+#ifndef ID_INDEX_H
+#define ID_INDEX_H
+
+#include <Arduino.h>
+#include <algorithm>
+#include <ctype.h>
+#include <vector>
+
+// Smallest power of two with room for capacity records at half load
+constexpr size_t idIndexTableSize(size_t capacity, size_t size = 1) {
+    return size >= 2 * capacity ? size : idIndexTableSize(capacity, size * 2);
+}
+
+// ========================================
+// Keys
+// ========================================
+
+// Exact match on Record::id
+struct IdKey {
+    template <typename Record>
+    static const char* of(const Record& record) { return record.id; }
+    
+    // FNV-1a
+    static uint32_t hash(const char* key) {
+        uint32_t hash = 2166136261UL;
+        while (*key) {
+            hash = (hash ^ (uint8_t)*key++) * 16777619UL;
+        }
+        return hash;
+    }
+    
+    static bool equal(const char* a, const char* b) { return strcmp(a, b) == 0; }
+};
+
+// Case-insensitive match on Record::name, same semantics as strcasecmp
+struct FoldedNameKey {
+    template <typename Record>
+    static const char* of(const Record& record) { return record.name; }
+    
+    // FNV-1a over the lower-cased bytes
+    static uint32_t hash(const char* key) {
+        uint32_t hash = 2166136261UL;
+        while (*key) {
+            hash = (hash ^ (uint8_t)tolower((uint8_t)*key++)) * 16777619UL;
+        }
+        return hash;
+    }
+    
+    static bool equal(const char* a, const char* b) { return strcasecmp(a, b) == 0; }
+};
+
+// No secondary key
+struct NoKey {};
+
+// A Key names the field(s) records are looked up by: of() reads them
+// from a record, hash() and equal() take what of() returns. Keys are
+// C strings above; other key types only need the same three functions.
+
+// ========================================
+// Hash table of vector slots
+// ========================================
+
+/**
+ * Linear probing with backward-shift deletion, so erasing never leaves
+ * tombstones behind. Entries are slots into a record vector that is
+ * passed in on every call; the key is read from the record itself.
+ */
+template <typename Record, size_t Capacity, typename Key>
+class SlotTable {
+public:
+    SlotTable() : _table(TABLE_SIZE, EMPTY), _count(0) {}
+    
+    template <typename KeyType>
+    int find(const std::vector<Record>& records, const KeyType& key) const {
+        for (size_t pos = home(key); _table[pos] != EMPTY; pos = next(pos)) {
+            if (Key::equal(Key::of(records[_table[pos]]), key)) {
+                return _table[pos];
+            }
+        }
+        return -1;
+    }
+    
+    /**
+     * Index records[slot]; false if the table is at its load limit
+     */
+    bool insert(const std::vector<Record>& records, size_t slot) {
+        if (_count >= TABLE_SIZE * 3 / 4) {
+            return false;
+        }
+        
+        size_t pos = home(Key::of(records[slot]));
+        while (_table[pos] != EMPTY) {
+            pos = next(pos);
+        }
+        _table[pos] = slot;
+        _count++;
+        return true;
+    }
+    
+    /**
+     * Drop slot and close the gap it leaves in its probe run.
+     * records[slot] and every other indexed record must still be in place.
+     */
+    void unlink(const std::vector<Record>& records, size_t slot) {
+        size_t hole = locate(records, slot);
+        for (size_t pos = next(hole); _table[pos] != EMPTY; pos = next(pos)) {
+            size_t want = home(Key::of(records[_table[pos]]));
+            // Move the entry back unless its home lies after the hole
+            if (((pos - want) & (TABLE_SIZE - 1)) >= ((pos - hole) & (TABLE_SIZE - 1))) {
+                _table[hole] = _table[pos];
+                hole = pos;
+            }
+        }
+        _table[hole] = EMPTY;
+        _count--;
+    }
+    
+    /**
+     * Point the entry for records[from] at slot to
+     */
+    void move(const std::vector<Record>& records, size_t from, size_t to) {
+        _table[locate(records, from)] = to;
+    }
+    
+    /**
+     * Every slot after slot moved down by one
+     */
+    void shiftAfter(size_t slot) {
+        for (auto& entry : _table) {
+            if (entry != EMPTY && entry > slot) {
+                entry--;
+            }
+        }
+    }
+    
+    void clear() {
+        std::fill(_table.begin(), _table.end(), EMPTY);
+        _count = 0;
+    }
+
+private:
+    static constexpr size_t TABLE_SIZE = idIndexTableSize(Capacity);
+    static constexpr uint16_t EMPTY = 0xFFFF;
+    
+    static_assert(Capacity < EMPTY, "SlotTable slots are 16 bit");
+    
+    std::vector<uint16_t> _table;
+    size_t _count;
+    
+    template <typename KeyType>
+    static size_t home(const KeyType& key) {
+        return Key::hash(key) & (TABLE_SIZE - 1);
+    }
+    
+    static size_t next(size_t pos) {
+        return (pos + 1) & (TABLE_SIZE - 1);
+    }
+    
+    size_t locate(const std::vector<Record>& records, size_t slot) const {
+        size_t pos = home(Key::of(records[slot]));
+        while (_table[pos] != slot) {
+            pos = next(pos);
+        }
+        return pos;
+    }
+};
+
+template <typename Record, size_t Capacity, typename Key>
+constexpr size_t SlotTable<Record, Capacity, Key>::TABLE_SIZE;
+
+template <typename Record, size_t Capacity, typename Key>
+constexpr uint16_t SlotTable<Record, Capacity, Key>::EMPTY;
+
+// Empty stand-in when there is no secondary key
+template <typename Record, size_t Capacity>
+class SlotTable<Record, Capacity, NoKey> {
+public:
+    int find(const std::vector<Record>&, const char*) const { return -1; }
+    bool insert(const std::vector<Record>&, size_t) { return true; }
+    void unlink(const std::vector<Record>&, size_t) {}
+    void move(const std::vector<Record>&, size_t, size_t) {}
+    void shiftAfter(size_t) {}
+    void clear() {}
+};
+
+// ========================================
+// Indexed record vector
+// ========================================
+
+/**
+ * Owns the insert/erase path of a record vector and keeps an
+ * id -> slot table, plus an optional name table, in sync with it.
+ * 
+ * Records need a char id[] member, unless PrimaryKey reads another
+ * key. Duplicate keys are tolerated; find returns one of them.
+ */
+template <typename Record, size_t Capacity, typename NameKey = NoKey, typename PrimaryKey = IdKey>
+class IdIndex {
+public:
+    explicit IdIndex(std::vector<Record>& records)
+        : _records(records), _overflow(false) {}
+    
+    /**
+     * Slot of the record with this id, or -1
+     */
+    template <typename KeyType>
+    int find(const KeyType& id) const {
+        if (_overflow) {
+            return scan<PrimaryKey>(id);
+        }
+        return _ids.find(_records, id);
+    }
+    
+    /**
+     * Slot of a record whose name matches under NameKey, or -1
+     */
+    int findName(const char* name) const {
+        if (_overflow) {
+            return scan<NameKey>(name);
+        }
+        return _names.find(_records, name);
+    }
+    
+    /**
+     * Append a record and index it
+     */
+    void add(const Record& record) {
+        _records.push_back(record);
+        insert(_records.size() - 1);
+    }
+    
+    /**
+     * Erase the record at slot, keeping the order of the others
+     */
+    void removeAt(size_t slot) {
+        if (_overflow) {
+            _records.erase(_records.begin() + slot);
+            rebuild();
+            return;
+        }
+        
+        _ids.unlink(_records, slot);
+        _names.unlink(_records, slot);
+        _records.erase(_records.begin() + slot);
+        _ids.shiftAfter(slot);
+        _names.shiftAfter(slot);
+    }
+    
+    /**
+     * Erase the record at slot by moving the last record into it
+     */
+    void swapRemoveAt(size_t slot) {
+        size_t last = _records.size() - 1;
+        if (_overflow) {
+            _records[slot] = _records[last];
+            _records.pop_back();
+            rebuild();
+            return;
+        }
+        
+        _ids.unlink(_records, slot);
+        _names.unlink(_records, slot);
+        if (slot != last) {
+            _ids.move(_records, last, slot);
+            _names.move(_records, last, slot);
+            _records[slot] = _records[last];
+        }
+        _records.pop_back();
+    }
+    
+    /**
+     * Re-index every record, after the vector was filtered or cleared
+     */
+    void rebuild() {
+        _ids.clear();
+        _names.clear();
+        _overflow = false;
+        for (size_t slot = 0; slot < _records.size(); slot++) {
+            insert(slot);
+        }
+    }
+
+private:
+    std::vector<Record>& _records;
+    SlotTable<Record, Capacity, PrimaryKey> _ids;
+    SlotTable<Record, Capacity, NameKey> _names;
+    bool _overflow;     // More records than the tables take; lookups scan
+    
+    void insert(size_t slot) {
+        if (_overflow) {
+            return;
+        }
+        
+        if (!_ids.insert(_records, slot) || !_names.insert(_records, slot)) {
+            // Only reachable if records were loaded past Capacity
+            _overflow = true;
+        }
+    }
+    
+    template <typename Key, typename KeyType>
+    int scan(const KeyType& key) const {
+        for (size_t slot = 0; slot < _records.size(); slot++) {
+            if (Key::equal(Key::of(_records[slot]), key)) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+};
+
+#endif // ID_INDEX_H
@@ -0,0 +1,130 @@
+/**
+ * JSON Pool for Mate Tracker ESP32-C3
+ * Preallocated documents for parsing request bodies and buffers for
+ * serializing responses, checked out per request instead of taken from
+ * the heap. Used from the AsyncTCP task only, so it takes no lock.
+ */
+
+#ifndef JSON_POOL_H
+#define JSON_POOL_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+#include "config.h"
+
+class JsonPool {
+public:
+    JsonPool() : _checkouts(0), _fallbacks(0) {
+        for (size_t i = 0; i < JSON_POOL_DOCUMENTS; i++) {
+            _documentInUse[i] = false;
+        }
+        for (size_t i = 0; i < JSON_POOL_BUFFERS; i++) {
+            _bufferInUse[i] = false;
+        }
+    }
+    
+    /**
+     * A document checked out for the lifetime of this object; a heap
+     * one, counted as a fallback, if all pooled ones are in use
+     */
+    class Document {
+    public:
+        explicit Document(JsonPool& pool) : _pool(pool), _index(pool.takeDocument()), _heap(nullptr) {
+            if (_index < 0) {
+                _heap = new DynamicJsonDocument(JSON_POOL_DOCUMENT_SIZE);
+            }
+        }
+        
+        ~Document() {
+            if (_heap) {
+                delete _heap;
+            } else {
+                _pool._documents[_index].clear();
+                _pool._documentInUse[_index] = false;
+            }
+        }
+        
+        JsonDocument& operator*() { return _heap ? static_cast<JsonDocument&>(*_heap) : _pool._documents[_index]; }
+        JsonDocument* operator->() { return &**this; }
+    
+    private:
+        JsonPool& _pool;
+        int _index;
+        DynamicJsonDocument* _heap;
+        
+        Document(const Document&) = delete;
+        Document& operator=(const Document&) = delete;
+    };
+    
+    /**
+     * Send doc from a pooled buffer that returns to the pool when the
+     * server is done with the response; false if none is free or doc
+     * does not fit, so the caller has to send it some other way
+     */
+    bool send(AsyncWebServerRequest* request, JsonDocument& doc, int code,
+              void (*addHeaders)(AsyncWebServerResponse*)) {
+        size_t length = measureJson(doc);
+        int index = length < JSON_POOL_BUFFER_SIZE ? takeBuffer() : -1;
+        if (index < 0) {
+            _fallbacks++;
+            return false;
+        }
+        
+        serializeJson(doc, _buffers[index], JSON_POOL_BUFFER_SIZE);
+        AsyncWebServerResponse* response = new PooledResponse(*this, index, code, length);
+        addHeaders(response);
+        request->send(response);
+        return true;
+    }
+    
+    uint32_t getCheckouts() const { return _checkouts; }
+    uint32_t getFallbacks() const { return _fallbacks; }    // Heap used instead
+
+private:
+    // Sends a pooled buffer, released with the response
+    class PooledResponse : public AsyncProgmemResponse {
+    public:
+        PooledResponse(JsonPool& pool, int index, int code, size_t length)
+            : AsyncProgmemResponse(code, "application/json", reinterpret_cast<const uint8_t*>(pool._buffers[index]), length),
+              _pool(pool), _index(index) {}
+        
+        ~PooledResponse() { _pool._bufferInUse[_index] = false; }
+    
+    private:
+        JsonPool& _pool;
+        int _index;
+    };
+    
+    StaticJsonDocument<JSON_POOL_DOCUMENT_SIZE> _documents[JSON_POOL_DOCUMENTS];
+    bool _documentInUse[JSON_POOL_DOCUMENTS];
+    char _buffers[JSON_POOL_BUFFERS][JSON_POOL_BUFFER_SIZE];
+    bool _bufferInUse[JSON_POOL_BUFFERS];
+    uint32_t _checkouts;
+    uint32_t _fallbacks;
+    
+    int takeDocument() {
+        for (size_t i = 0; i < JSON_POOL_DOCUMENTS; i++) {
+            if (!_documentInUse[i]) {
+                _documentInUse[i] = true;
+                _checkouts++;
+                return i;
+            }
+        }
+        _fallbacks++;
+        return -1;
+    }
+    
+    int takeBuffer() {
+        for (size_t i = 0; i < JSON_POOL_BUFFERS; i++) {
+            if (!_bufferInUse[i]) {
+                _bufferInUse[i] = true;
+                _checkouts++;
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+#endif // JSON_POOL_H
@@ -0,0 +1,64 @@
+/**
+ * Latency Histogram for Mate Tracker ESP32-C3
+ * Counts durations into fixed, log-spaced buckets: recording is a few
+ * compares and increments, never an allocation
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <Arduino.h>
+
+// Finite buckets; their upper bounds are 64us, 256us, ... ~16.8s,
+// each four times the last. Longer durations go to a last, open bucket.
+#define LATENCY_BUCKETS 10
+#define LATENCY_FIRST_BOUND_US 64
+
+class LatencyHistogram {
+public:
+    LatencyHistogram() : _count(0), _sumUs(0), _buckets() {}
+    
+    void record(uint32_t us) {
+        size_t bucket = 0;
+        while (bucket < LATENCY_BUCKETS && us > bound(bucket)) {
+            bucket++;
+        }
+        _buckets[bucket]++;
+        _count++;
+        _sumUs += us;
+    }
+    
+    uint32_t getCount() const { return _count; }
+    uint64_t getSumUs() const { return _sumUs; }
+    
+    /**
+     * Durations counted in bucket, 0..LATENCY_BUCKETS; the last one is
+     * open-ended. Not cumulative.
+     */
+    uint32_t getBucket(size_t bucket) const { return _buckets[bucket]; }
+    
+    /**
+     * Upper bound of finite bucket, inclusive (microseconds)
+     */
+    static uint32_t bound(size_t bucket) {
+        return (uint32_t)LATENCY_FIRST_BOUND_US << (2 * bucket);
+    }
+
+private:
+    uint32_t _count;
+    uint64_t _sumUs;
+    uint32_t _buckets[LATENCY_BUCKETS + 1];
+};
+
+// Records the time until it goes out of scope into a histogram
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram) : _histogram(histogram), _started(micros()) {}
+    ~ScopedLatency() { _histogram.record(micros() - _started); }
+
+private:
+    LatencyHistogram& _histogram;
+    uint32_t _started;
+};
+
+#endif // LATENCY_HISTOGRAM_H
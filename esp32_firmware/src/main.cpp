@@ -21,15 +21,24 @@
 #include <LittleFS.h>
 #include <ArduinoJson.h>
 #include <Preferences.h>
+#include <esp_system.h>
 
 #include "config.h"
 #include "wifi_manager.h"
 #include "data_storage.h"
+#include "persistence_task.h"
 #include "web_handlers.h"
 
 // Global objects
 AsyncWebServer server(80);
 DataStorage dataStorage;
+PersistenceTask persistenceTask(dataStorage);
+ChangeEvents changeEvents(dataStorage);
+StaticAssets staticAssets(LittleFS);
+JsonPool jsonPool;
+AdmissionControl admission;
+Metrics metrics;
+HeapMonitor heapMonitor;
 WiFiManager wifiManager;
 
 // RGB LED (WS2812/NeoPixel on ESP32-C3-DevKitM-1)
@@ -58,6 +67,35 @@ void blinkLED(uint8_t r, uint8_t g, uint8_t b, int times, int delayMs = 200) {
     }
 }
 
+#if ALLOC_TRACING
+// Every allocation passes through AllocTrace, see env:esp32c3_trace
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    AllocTrace::count(size);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    AllocTrace::count(count * size);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    AllocTrace::count(size);
+    return __real_realloc(ptr, size);
+}
+}
+#endif
+
+// Write buffered changes before esp_restart()
+void flushStorageOnShutdown() {
+    dataStorage.flush();
+}
+
 void setup() {
     Serial.begin(115200);
     delay(1000);
@@ -66,6 +104,9 @@ void setup() {
     Serial.println("   Mate Tracker ESP32-C3 Starting...   ");
     Serial.println("========================================\n");
     
+    // Heap lows and allocation counts from here on
+    heapMonitor.begin();
+    
     // Start with RED LED to indicate startup/not ready
     setLEDRed();
     Serial.println("[LED] Status: RED (starting up...)");
@@ -76,11 +117,16 @@ void setup() {
     Serial.println("[FS] Initializing LittleFS...");
     if (!LittleFS.begin(true)) {
         Serial.println("[FS] ERROR: LittleFS mount failed!");
+#ifdef EMBEDDED_WEB_ASSETS
+        Serial.println("[FS] Serving the web files built into the firmware");
+#else
         setLEDRed();  // Keep RED for error
         blinkLED(25, 0, 0, 10, 100);  // Rapid RED blink indicates error
         return;
+#endif
+    } else {
+        Serial.println("[FS] LittleFS mounted successfully");
     }
-    Serial.println("[FS] LittleFS mounted successfully");
     
     // List files for debugging
     Serial.println("[FS] Files in LittleFS:");
@@ -97,6 +143,12 @@ void setup() {
         Serial.println("[DATA] ERROR: Data storage initialization failed!");
     }
     Serial.println("[DATA] Data storage ready");
+    esp_register_shutdown_handler(flushStorageOnShutdown);
+    
+    // NVS writes from here on happen on their own task
+    if (!persistenceTask.begin()) {
+        Serial.println("[DATA] Writing from the main loop instead");
+    }
     
     // Connect to WiFi
     Serial.println("\n[WIFI] Connecting to WiFi...");
@@ -121,7 +173,7 @@ void setup() {
     
     // Setup web server routes
     Serial.println("\n[WEB] Setting up web server...");
-    setupWebHandlers(server, dataStorage);
+    setupWebHandlers(server, dataStorage, changeEvents, staticAssets, jsonPool, admission, persistenceTask, metrics, heapMonitor);
     
     // Start server
     server.begin();
@@ -137,10 +189,14 @@ void setup() {
     Serial.println("\nAPI Endpoints:");
     Serial.println("  GET  /api/state       - Get full state");
     Serial.println("  GET  /api/status      - Get system status");
+    Serial.println("  GET  /api/balances    - Get user balances");
+    Serial.println("  GET  /api/changes     - Get changes since a version");
+    Serial.println("  WS   /api/events      - Live change events");
     Serial.println("  POST /api/users       - Add user");
     Serial.println("  POST /api/items       - Add item");
     Serial.println("  POST /api/consumption - Record consumption");
     Serial.println("  POST /api/payments    - Process payment");
+    Serial.println("  POST /api/batch       - Apply several changes at once");
     Serial.println("  POST /api/reset       - Reset all data");
     Serial.println("========================================\n");
     
@@ -210,6 +266,15 @@ void loop() {
         heartbeatDimActive = false;
     }
     
+    // Sample the heap for its lows, and print it if configured to
+    heapMonitor.tick();
+    
+    // Write grouped storage changes once they are due, unless the
+    // persistence task does
+    if (!persistenceTask.isRunning()) {
+        dataStorage.tick();
+    }
+    
     // Small delay to prevent watchdog issues
     delay(10);
 }
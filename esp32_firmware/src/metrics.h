@@ -0,0 +1,270 @@
+/**
+ * Metrics for Mate Tracker ESP32-C3
+ * Per-route request counts by status code and handler latency, plus
+ * the latency of storage and parsing stages, exposed in Prometheus
+ * text format. All counters live in fixed arrays sized at compile
+ * time: recording a request never allocates, and neither does writing
+ * the exposition, which is produced line by line into the caller's
+ * buffer.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+#include <stdio.h>
+#include "config.h"
+#include "latency_histogram.h"
+
+// Status codes counted per route; anything else is counted as "other"
+#define METRICS_STATUS_CODES 9
+
+// Stages whose latency is exposed besides the routes'
+#define METRICS_MAX_STAGES 4
+
+class Metrics {
+public:
+    Metrics() : _routeCount(0), _stageCount(0), _routes(), _stages() {
+        addStage("json_parse", _parseTimes);
+    }
+    
+    /**
+     * Add a route, labelled with method and pattern, which are kept,
+     * not copied. Returns its slot for record(), or -1 when all
+     * METRICS_MAX_ROUTES are taken.
+     */
+    int addRoute(const char* method, const char* pattern) {
+        if (_routeCount >= METRICS_MAX_ROUTES) {
+            DEBUG_PRINTLN("[METRICS] Too many routes");
+            return -1;
+        }
+        _routes[_routeCount].method = method;
+        _routes[_routeCount].pattern = pattern;
+        return _routeCount++;
+    }
+    
+    /**
+     * Expose histogram, owned by the caller, as stage name
+     */
+    void addStage(const char* name, const LatencyHistogram& histogram) {
+        if (_stageCount < METRICS_MAX_STAGES) {
+            _stages[_stageCount].name = name;
+            _stages[_stageCount].histogram = &histogram;
+            _stageCount++;
+        }
+    }
+    
+    // Request bodies parsed into JSON documents
+    LatencyHistogram& getParseTimes() { return _parseTimes; }
+    
+    /**
+     * Note the status code of the response sent for the request being
+     * handled. Requests are handled on the server's task only, one at
+     * a time, so a single slot is enough.
+     */
+    static void noteStatus(int code) { currentStatus() = code; }
+    
+    // The noted status code, 0 if none; clears it
+    static int takeStatus() {
+        int code = currentStatus();
+        currentStatus() = 0;
+        return code;
+    }
+    
+    /**
+     * Count a request to route, answered with code after us
+     * microseconds; route -1 is ignored
+     */
+    void record(int route, int code, uint32_t us) {
+        if (route < 0 || route >= (int)_routeCount) {
+            return;
+        }
+        _routes[route].codes[statusSlot(code)]++;
+        _routes[route].latency.record(us);
+    }
+    
+    uint32_t getRequests(int route) const { return _routes[route].latency.getCount(); }
+    uint32_t getRequests(int route, int code) const { return _routes[route].codes[statusSlot(code)]; }
+    
+    /**
+     * Write the exposition from line on into buffer, whole lines only,
+     * and advance line past them. Returns the bytes written: 0 once
+     * finished(line), or if the next line does not fit in size.
+     */
+    size_t fill(char* buffer, size_t size, size_t& line) const {
+        size_t written = 0;
+        int length;
+        while ((length = formatLine(line, buffer + written, size - written)) >= 0 &&
+               (size_t)length < size - written) {
+            written += length;
+            line++;
+        }
+        return written;
+    }
+    
+    bool finished(size_t line) const {
+        return formatLine(line, nullptr, 0) < 0;
+    }
+
+private:
+    struct Route {
+        const char* method;
+        const char* pattern;
+        uint32_t codes[METRICS_STATUS_CODES + 1];
+        LatencyHistogram latency;
+    };
+    
+    struct Stage {
+        const char* name;
+        const LatencyHistogram* histogram;
+    };
+    
+    size_t _routeCount;
+    size_t _stageCount;
+    Route _routes[METRICS_MAX_ROUTES];
+    Stage _stages[METRICS_MAX_STAGES];
+    LatencyHistogram _parseTimes;
+    
+    // Lines of one histogram series: its buckets, +Inf, _sum and _count
+    static const size_t HISTOGRAM_LINES = LATENCY_BUCKETS + 3;
+    
+    static int& currentStatus() {
+        static int code = 0;
+        return code;
+    }
+    
+    static int statusCode(size_t slot) {
+        static const int codes[METRICS_STATUS_CODES] = {200, 204, 304, 400, 404, 413, 429, 500, 503};
+        return codes[slot];
+    }
+    
+    static size_t statusSlot(int code) {
+        for (size_t slot = 0; slot < METRICS_STATUS_CODES; slot++) {
+            if (statusCode(slot) == code) {
+                return slot;
+            }
+        }
+        return METRICS_STATUS_CODES;
+    }
+    
+    /**
+     * Format line number line of the exposition into out: its length
+     * as snprintf() reports it, 0 for a line left out because it would
+     * only say zero, -1 past the last line
+     */
+    int formatLine(size_t line, char* out, size_t size) const {
+        if (line < 2) {
+            return header(out, size, line, "mate_http_requests_total", "counter",
+                          "Requests answered, by route and status code.");
+        }
+        line -= 2;
+        if (line < _routeCount * (METRICS_STATUS_CODES + 1)) {
+            const Route& route = _routes[line / (METRICS_STATUS_CODES + 1)];
+            size_t slot = line % (METRICS_STATUS_CODES + 1);
+            if (route.codes[slot] == 0) {
+                return 0;
+            }
+            char code[8];
+            if (slot < METRICS_STATUS_CODES) {
+                snprintf(code, sizeof(code), "%d", statusCode(slot));
+            } else {
+                strcpy(code, "other");
+            }
+            return snprintf(out, size, "mate_http_requests_total{method=\"%s\",route=\"%s\",code=\"%s\"} %lu\n",
+                            route.method, route.pattern, code, (unsigned long)route.codes[slot]);
+        }
+        line -= _routeCount * (METRICS_STATUS_CODES + 1);
+        
+        if (line < 2) {
+            return header(out, size, line, "mate_http_request_duration_seconds", "histogram",
+                          "Time in the route's handler, until its response was queued.");
+        }
+        line -= 2;
+        if (line < _routeCount * HISTOGRAM_LINES) {
+            const Route& route = _routes[line / HISTOGRAM_LINES];
+            if (route.latency.getCount() == 0) {
+                return 0;
+            }
+            char labels[96];
+            snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"", route.method, route.pattern);
+            return histogramLine(out, size, "mate_http_request_duration_seconds", labels, route.latency,
+                                 line % HISTOGRAM_LINES);
+        }
+        line -= _routeCount * HISTOGRAM_LINES;
+        
+        if (line < 2) {
+            return header(out, size, line, "mate_stage_duration_seconds", "histogram",
+                          "Time in storage and parsing stages, by stage.");
+        }
+        line -= 2;
+        if (line < _stageCount * HISTOGRAM_LINES) {
+            const Stage& stage = _stages[line / HISTOGRAM_LINES];
+            char labels[48];
+            snprintf(labels, sizeof(labels), "stage=\"%s\"", stage.name);
+            return histogramLine(out, size, "mate_stage_duration_seconds", labels, *stage.histogram,
+                                 line % HISTOGRAM_LINES);
+        }
+        return -1;
+    }
+    
+    // # HELP (line 0) or # TYPE (line 1) of a metric
+    static int header(char* out, size_t size, size_t line, const char* name, const char* type, const char* help) {
+        if (line == 0) {
+            return snprintf(out, size, "# HELP %s %s\n", name, help);
+        }
+        return snprintf(out, size, "# TYPE %s %s\n", name, type);
+    }
+    
+    // Line part of a histogram series; buckets are cumulative
+    static int histogramLine(char* out, size_t size, const char* name, const char* labels,
+                             const LatencyHistogram& histogram, size_t part) {
+        uint64_t count = 0;
+        for (size_t bucket = 0; bucket <= part && bucket <= LATENCY_BUCKETS; bucket++) {
+            count += histogram.getBucket(bucket);
+        }
+        
+        if (part < LATENCY_BUCKETS) {
+            uint32_t bound = LatencyHistogram::bound(part);
+            return snprintf(out, size, "%s_bucket{%s,le=\"%lu.%06lu\"} %lu\n", name, labels,
+                            (unsigned long)(bound / 1000000), (unsigned long)(bound % 1000000),
+                            (unsigned long)count);
+        }
+        if (part == LATENCY_BUCKETS) {
+            return snprintf(out, size, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, (unsigned long)count);
+        }
+        if (part == LATENCY_BUCKETS + 1) {
+            uint64_t sum = histogram.getSumUs();
+            return snprintf(out, size, "%s_sum{%s} %lu.%06lu\n", name, labels,
+                            (unsigned long)(sum / 1000000), (unsigned long)(sum % 1000000));
+        }
+        // _count agrees with the +Inf bucket, even if a request was
+        // recorded in between
+        return snprintf(out, size, "%s_count{%s} %lu\n", name, labels, (unsigned long)count);
+    }
+};
+
+/**
+ * Times a request from construction to destruction and records it,
+ * with the status code noted meanwhile, for a route of metrics
+ * (which may be null)
+ */
+class RequestTimer {
+public:
+    RequestTimer(Metrics* metrics, int route) : _metrics(metrics), _route(route), _started(micros()) {
+        Metrics::takeStatus();
+    }
+    
+    ~RequestTimer() {
+        int code = Metrics::takeStatus();
+        if (_metrics) {
+            _metrics->record(_route, code, micros() - _started);
+        }
+    }
+
+private:
+    Metrics* _metrics;
+    int _route;
+    uint32_t _started;
+};
+
+#endif // METRICS_H
@@ -0,0 +1,154 @@
+/**
+ * Persistence Task for Mate Tracker ESP32-C3
+ * Does the NVS writes of DataStorage on a task of its own, so the web
+ * server's task never waits for flash. Mutations only queue a write
+ * request; requests that pile up while a write is in progress are
+ * served by the next write together.
+ */
+
+#ifndef PERSISTENCE_TASK_H
+#define PERSISTENCE_TASK_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "config.h"
+#include "data_storage.h"
+
+class PersistenceTask {
+public:
+    explicit PersistenceTask(DataStorage& storage)
+        : _storage(storage), _queue(nullptr), _stopped(nullptr), _task(nullptr),
+          _requests(0), _queueFull(0), _maxQueueDepth(0), _writes(0) {}
+    
+    ~PersistenceTask() {
+        end();
+    }
+    
+    /**
+     * Start the task and route the storage's writes through it.
+     * False if it could not be created; storage then writes inline.
+     */
+    bool begin() {
+        _queue = xQueueCreate(PERSIST_QUEUE_LENGTH, sizeof(uint8_t));
+        _stopped = xSemaphoreCreateBinary();
+        if (!_queue || !_stopped ||
+            xTaskCreate(run, "persist", PERSIST_TASK_STACK, this, PERSIST_TASK_PRIORITY, &_task) != pdPASS) {
+            DEBUG_PRINTLN("[PERSIST] Failed to start task");
+            _task = nullptr;
+            release();
+            return false;
+        }
+        
+        _storage.setWriteRequestHandler([this]() { request(); });
+        DEBUG_PRINTLN("[PERSIST] Task started");
+        return true;
+    }
+    
+    /**
+     * Write what is pending, stop the task and go back to writing inline
+     */
+    void end() {
+        if (!_task) {
+            return;
+        }
+        _storage.setWriteRequestHandler(nullptr);
+        
+        uint8_t command = STOP;
+        xQueueSend(_queue, &command, portMAX_DELAY);
+        xSemaphoreTake(_stopped, portMAX_DELAY);
+        _task = nullptr;
+        release();
+    }
+    
+    bool isRunning() const { return _task != nullptr; }
+    
+    /**
+     * Write requests waiting in the queue now, and the most ever
+     */
+    uint32_t getQueueDepth() const { return _queue ? uxQueueMessagesWaiting(_queue) : 0; }
+    uint32_t getMaxQueueDepth() const { return _maxQueueDepth; }
+    
+    /**
+     * Write requests made, those not queued because the queue was full
+     * (a queued one covers them), and NVS writes the task made
+     */
+    uint32_t getRequests() const { return _requests; }
+    uint32_t getQueueFull() const { return _queueFull; }
+    uint32_t getWrites() const { return _writes; }
+
+private:
+    enum Command : uint8_t { WRITE, STOP };
+    
+    DataStorage& _storage;
+    QueueHandle_t _queue;
+    SemaphoreHandle_t _stopped;
+    TaskHandle_t _task;
+    
+    // Updated by request(), which runs with the storage lock held
+    uint32_t _requests;
+    uint32_t _queueFull;
+    uint32_t _maxQueueDepth;
+    
+    // Updated by the task only
+    uint32_t _writes;
+    
+    // Called by the storage instead of writing; must not block
+    void request() {
+        _requests++;
+        uint8_t command = WRITE;
+        if (xQueueSend(_queue, &command, 0) != pdTRUE) {
+            _queueFull++;
+            return;
+        }
+        uint32_t depth = uxQueueMessagesWaiting(_queue);
+        if (depth > _maxQueueDepth) {
+            _maxQueueDepth = depth;
+        }
+    }
+    
+    static void run(void* self) {
+        static_cast<PersistenceTask*>(self)->loop();
+    }
+    
+    void loop() {
+        uint8_t command;
+        for (;;) {
+            if (xQueueReceive(_queue, &command, pdMS_TO_TICKS(PERSIST_TICK_MS)) != pdTRUE) {
+                // Nothing requested; group commit may still be due
+                if (_storage.persist(false)) {
+                    _writes++;
+                }
+                continue;
+            }
+            
+            // One write covers every request queued meanwhile
+            while (command != STOP && xQueueReceive(_queue, &command, 0) == pdTRUE) {
+            }
+            if (_storage.persist(true)) {
+                _writes++;
+            }
+            if (command == STOP) {
+                break;
+            }
+        }
+        
+        xSemaphoreGive(_stopped);
+        vTaskDelete(nullptr);
+    }
+    
+    void release() {
+        if (_queue) {
+            vQueueDelete(_queue);
+            _queue = nullptr;
+        }
+        if (_stopped) {
+            vSemaphoreDelete(_stopped);
+            _stopped = nullptr;
+        }
+    }
+};
+
+#endif // PERSISTENCE_TASK_H
@@ -0,0 +1,196 @@
+/**
+ * Static Assets for Mate Tracker ESP32-C3
+ * Serves the web app gzipped, with content-hash ETags so unchanged
+ * files cost only a 304: from the copies scripts/compress_assets.py
+ * compiles into the firmware, else from LittleFS (the .gz variant when
+ * the browser accepts gzip)
+ */
+
+#ifndef STATIC_ASSETS_H
+#define STATIC_ASSETS_H
+
+#include <ESPAsyncWebServer.h>
+#include <FS.h>
+#include <vector>
+#include "config.h"
+
+// A gzipped web file compiled into the firmware
+struct EmbeddedAsset {
+    const char* path;
+    const char* contentType;
+    const uint8_t* data;
+    size_t length;
+    const char* etag;
+};
+
+#ifdef EMBEDDED_WEB_ASSETS
+#include "web_assets.h"     // Generated into the build directory
+#endif
+
+class StaticAssets : public AsyncWebHandler {
+public:
+    explicit StaticAssets(fs::FS& fs) : _fs(fs) {}
+    
+    /**
+     * Hash the files in the root directory and register with the server
+     */
+    void begin(AsyncWebServer& server) {
+        File root = _fs.open("/");
+        for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+            // Bare name on newer cores, full path on older ones
+            String path = file.name();
+            if (!path.startsWith("/")) {
+                path = "/" + path;
+            }
+            if (file.isDirectory() || path.endsWith(".gz")) {
+                continue;
+            }
+            
+            Asset asset;
+            asset.path = path;
+            asset.etag = makeETag(file);
+            File gzip = _fs.open(path + ".gz", "r");
+            asset.gzip = gzip && !gzip.isDirectory();
+            if (asset.gzip) {
+                asset.gzipETag = makeETag(gzip);
+            }
+            _assets.push_back(asset);
+            
+            DEBUG_PRINTF("[WEB] Asset %s %s%s\n", path.c_str(), asset.etag.c_str(), asset.gzip ? " (gzip)" : "");
+        }
+        server.addHandler(this);
+    }
+    
+    bool canHandle(AsyncWebServerRequest* request) override {
+        if (request->method() != HTTP_GET || (!findEmbedded(request->url()) && !find(request->url()))) {
+            return false;
+        }
+        // The server drops request headers no handler asked for
+        request->addInterestingHeader("If-None-Match");
+        request->addInterestingHeader("Accept-Encoding");
+        return true;
+    }
+    
+    void handleRequest(AsyncWebServerRequest* request) override {
+        send(request, request->url());
+    }
+    
+    /**
+     * Send the asset at url ("/" for index.html); false if there is none
+     */
+    bool send(AsyncWebServerRequest* request, const String& url) {
+        const EmbeddedAsset* embedded = findEmbedded(url);
+        const Asset* asset = find(url);
+        bool acceptsGzip = request->hasHeader("Accept-Encoding") &&
+                           request->header("Accept-Encoding").indexOf("gzip") >= 0;
+        
+        // Embedded copies match the firmware, so they win over files
+        // left in LittleFS; only gzip-less clients need the file system
+        if (embedded && (acceptsGzip || !asset)) {
+            sendEmbedded(request, *embedded);
+            return true;
+        }
+        if (!asset) {
+            return false;
+        }
+        
+        bool gzip = asset->gzip && acceptsGzip;
+        const String& etag = gzip ? asset->gzipETag : asset->etag;
+        
+        AsyncWebServerResponse* response;
+        if (isCurrent(request, etag.c_str())) {
+            response = request->beginResponse(304);
+        } else {
+            // Sent with Content-Encoding: gzip because the file ends in .gz
+            File file = _fs.open(gzip ? asset->path + ".gz" : asset->path, "r");
+            response = request->beginResponse(file, asset->path);
+        }
+        addCacheHeaders(request, response, etag.c_str(), asset->gzip);
+        request->send(response);
+        return true;
+    }
+
+private:
+    struct Asset {
+        String path;
+        String etag;
+        String gzipETag;
+        bool gzip;
+    };
+    
+    fs::FS& _fs;
+    std::vector<Asset> _assets;
+    
+    static String assetPath(const String& url) {
+        return url.endsWith("/") ? url + "index.html" : url;
+    }
+    
+    const Asset* find(const String& url) const {
+        String path = assetPath(url);
+        for (const Asset& asset : _assets) {
+            if (asset.path == path) {
+                return &asset;
+            }
+        }
+        return nullptr;
+    }
+    
+    static const EmbeddedAsset* findEmbedded(const String& url) {
+#ifdef EMBEDDED_WEB_ASSETS
+        String path = assetPath(url);
+        for (const EmbeddedAsset& asset : EMBEDDED_ASSETS) {
+            if (path == asset.path) {
+                return &asset;
+            }
+        }
+#endif
+        return nullptr;
+    }
+    
+    // Sent straight from flash, no file system involved
+    static void sendEmbedded(AsyncWebServerRequest* request, const EmbeddedAsset& asset) {
+        AsyncWebServerResponse* response;
+        if (isCurrent(request, asset.etag)) {
+            response = request->beginResponse(304);
+        } else {
+            response = request->beginResponse_P(200, asset.contentType, asset.data, asset.length);
+            response->addHeader("Content-Encoding", "gzip");
+        }
+        addCacheHeaders(request, response, asset.etag, true);
+        request->send(response);
+    }
+    
+    static bool isCurrent(AsyncWebServerRequest* request, const char* etag) {
+        return request->hasHeader("If-None-Match") && request->header("If-None-Match") == etag;
+    }
+    
+    static void addCacheHeaders(AsyncWebServerRequest* request, AsyncWebServerResponse* response,
+                                const char* etag, bool vary) {
+        // index.html references the other files as name?v=<hash>, so
+        // those URLs never change content and can be cached for good
+        response->addHeader("ETag", etag);
+        response->addHeader("Cache-Control", request->hasParam("v") ? STATIC_CACHE_CONTROL : "no-cache");
+        if (vary) {
+            response->addHeader("Vary", "Accept-Encoding");
+        }
+    }
+    
+    // Quoted FNV-1a hash of the file's content
+    static String makeETag(File& file) {
+        uint32_t hash = 2166136261UL;
+        uint8_t buffer[128];
+        size_t length;
+        while ((length = file.read(buffer, sizeof(buffer))) > 0) {
+            for (size_t i = 0; i < length; i++) {
+                hash = (hash ^ buffer[i]) * 16777619UL;
+            }
+        }
+        file.seek(0);
+        
+        char etag[12];
+        snprintf(etag, sizeof(etag), "\"%08lx\"", (unsigned long)hash);
+        return String(etag);
+    }
+};
+
+#endif // STATIC_ASSETS_H
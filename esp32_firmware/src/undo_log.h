@@ -0,0 +1,83 @@
+/**
+ * Undo Log for Mate Tracker ESP32-C3
+ * What a batch did to one record vector, so it can be undone: only the
+ * records it added, erased or overwrote are kept, not a copy of the
+ * vector
+ */
+
+#ifndef UNDO_LOG_H
+#define UNDO_LOG_H
+
+#include <Arduino.h>
+#include <vector>
+
+template <typename Record>
+class UndoLog {
+public:
+    // Record appended
+    void added() {
+        push(ADDED, 0, nullptr);
+    }
+    
+    // Record at slot erased, keeping the order of the others
+    void erased(size_t slot, const Record& record) {
+        push(ERASED, slot, &record);
+    }
+    
+    // Record at slot about to be overwritten
+    void changed(size_t slot, const Record& record) {
+        push(CHANGED, slot, &record);
+    }
+    
+    /**
+     * Undo every step in reverse, leaving records as it was before the
+     * first; the caller re-indexes it. Empties the log.
+     */
+    void rollback(std::vector<Record>& records) {
+        for (size_t i = _steps.size(); i-- > 0;) {
+            const Step& step = _steps[i];
+            switch (step.kind) {
+                case ADDED:
+                    records.pop_back();
+                    break;
+                case ERASED:
+                    records.insert(records.begin() + step.slot, step.record);
+                    break;
+                case CHANGED:
+                    records[step.slot] = step.record;
+                    break;
+            }
+        }
+        clear();
+    }
+    
+    // Give the memory back; swap, since clear() keeps capacity
+    void clear() {
+        std::vector<Step>().swap(_steps);
+    }
+    
+    size_t size() const { return _steps.size(); }
+
+private:
+    enum Kind : uint8_t { ADDED, ERASED, CHANGED };
+    
+    struct Step {
+        Kind kind;
+        uint16_t slot;
+        Record record;      // Before the step; unused for ADDED
+    };
+    
+    std::vector<Step> _steps;
+    
+    void push(Kind kind, size_t slot, const Record* record) {
+        Step step = Step();
+        step.kind = kind;
+        step.slot = slot;
+        if (record) {
+            step.record = *record;
+        }
+        _steps.push_back(step);
+    }
+};
+
+#endif // UNDO_LOG_H
@@ -12,82 +12,315 @@
 #include <ArduinoJson.h>
 #include <WiFi.h>
 #include "data_storage.h"
+#include "change_events.h"
+#include "static_assets.h"
+#include "api_operations.h"
+#include "api_router.h"
+#include "json_pool.h"
+#include "admission.h"
+#include "persistence_task.h"
+#include "metrics.h"
+#include "heap_monitor.h"
 #include "config.h"
 
 // Forward declaration
-void setupWebHandlers(AsyncWebServer& server, DataStorage& storage);
+void setupWebHandlers(AsyncWebServer& server, DataStorage& storage, ChangeEvents& events, StaticAssets& assets,
+                      JsonPool& pool, AdmissionControl& admission, PersistenceTask& persistence,
+                      Metrics& metrics, HeapMonitor& heap);
 
 // Helper to set CORS headers
 void setCORSHeaders(AsyncWebServerResponse* response) {
     response->addHeader("Access-Control-Allow-Origin", "*");
     response->addHeader("Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
-    response->addHeader("Access-Control-Allow-Headers", "Content-Type");
+    response->addHeader("Access-Control-Allow-Headers", "Content-Type, If-None-Match");
+    response->addHeader("Access-Control-Expose-Headers", "ETag");
 }
 
-// Send JSON response
-void sendJsonResponse(AsyncWebServerRequest* request, DynamicJsonDocument& doc, int code = 200) {
+// Send response, noting its status code for the request's metrics
+void sendResponse(AsyncWebServerRequest* request, AsyncWebServerResponse* response, int code) {
+    Metrics::noteStatus(code);
+    request->send(response);
+}
+
+// Send JSON response, from a pooled buffer if one is free
+void sendJsonResponse(AsyncWebServerRequest* request, JsonPool& pool, JsonDocument& doc, int code = 200) {
+    AllocScope scope(ALLOC_JSON);
+    Metrics::noteStatus(code);
+    if (pool.send(request, doc, code, setCORSHeaders)) {
+        return;
+    }
+    
     String json;
     serializeJson(doc, json);
     AsyncWebServerResponse* response = request->beginResponse(code, "application/json", json);
     setCORSHeaders(response);
-    request->send(response);
+    sendResponse(request, response, code);
+}
+
+// Send the full state from a snapshot, tagged with its own version;
+// the response holds a reference, so later changes do not disturb it
+void sendStateResponse(AsyncWebServerRequest* request, std::shared_ptr<const StateSnapshot> state) {
+    AsyncWebServerResponse* response = request->beginResponse("application/json", state->json.length(),
+        [state](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+            size_t length = std::min(maxLen, state->json.length() - index);
+            memcpy(buffer, state->json.c_str() + index, length);
+            return length;
+        });
+    response->addHeader("ETag", state->etag);
+    response->addHeader("Cache-Control", "no-cache");
+    setCORSHeaders(response);
+    sendResponse(request, response, 200);
+}
+
+// Send the full state from the published snapshot
+void sendStateResponse(AsyncWebServerRequest* request, DataStorage& storage) {
+    sendStateResponse(request, storage.getSnapshot());
+}
+
+// Read the client's ?since=<version> and ?boot=<hex>
+void getSyncParams(AsyncWebServerRequest* request, DataStorage& storage, uint32_t& since, uint32_t& boot) {
+    since = UINT32_MAX;
+    boot = storage.getBootId();
+    if (request->hasParam("since")) {
+        since = strtoul(request->getParam("since")->value().c_str(), nullptr, 10);
+    }
+    if (request->hasParam("boot")) {
+        boot = strtoul(request->getParam("boot")->value().c_str(), nullptr, 16);
+    }
+}
+
+// Send the changes after ?since=<version> of boot ?boot=<hex>, or the
+// full state in the same envelope when since is missing or too old.
+// Serialized once: the changes into a string, or just the envelope,
+// sent around the json of the state's snapshot as it is
+void sendChangesResponse(AsyncWebServerRequest* request, DataStorage& storage) {
+    uint32_t since;
+    uint32_t boot;
+    getSyncParams(request, storage, since, boot);
+    
+    std::shared_ptr<String> head(new String());
+    StringPrint sink(*head);
+    size_t written = 0;
+    std::shared_ptr<const StateSnapshot> state = storage.writeChangesHead(sink, since, boot, written);
+    size_t length = head->length() + (state ? state->json.length() + 1 : 0);
+    AsyncWebServerResponse* response = request->beginResponse("application/json", length,
+        [head, state](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+            const char* parts[] = {head->c_str(), state ? state->json.c_str() : "", "}"};
+            size_t lengths[] = {head->length(), state ? state->json.length() : 0, state ? 1u : 0u};
+            size_t copied = 0;
+            for (size_t i = 0; i < 3 && copied < maxLen; i++) {
+                if (index >= lengths[i]) {
+                    index -= lengths[i];
+                    continue;
+                }
+                size_t part = std::min(maxLen - copied, lengths[i] - index);
+                memcpy(buffer + copied, parts[i] + index, part);
+                copied += part;
+                index = 0;
+            }
+            return copied;
+        });
+    setCORSHeaders(response);
+    sendResponse(request, response, 200);
+}
+
+// Answer a successful change: only the delta if the client sent
+// ?since=, otherwise the full state. Other browsers get it pushed.
+void sendChangeResponse(AsyncWebServerRequest* request, DataStorage& storage, ChangeEvents& events) {
+    events.broadcast();
+    if (request->hasParam("since")) {
+        sendChangesResponse(request, storage);
+    } else {
+        sendStateResponse(request, storage);
+    }
+}
+
+// Send error response; the body is a constant, sent as it is
+void sendError(AsyncWebServerRequest* request, const ApiError& error, int code = 400) {
+    AsyncWebServerResponse* response = request->beginResponse_P(code, "application/json",
+        reinterpret_cast<const uint8_t*>(error.body), strlen(error.body));
+    setCORSHeaders(response);
+    sendResponse(request, response, code);
+}
+
+// Answer a single operation: its error, or the change it made
+void sendOperationResponse(AsyncWebServerRequest* request, const OperationResult& result,
+                           DataStorage& storage, ChangeEvents& events) {
+    if (result.error.message) {
+        sendError(request, result.error, result.code);
+        return;
+    }
+    sendChangeResponse(request, storage, events);
+}
+
+// {"results":[...],"update":<as GET /api/changes>}
+void writeBatchJson(Print& out, JsonArray results, DataStorage& storage, uint32_t since, uint32_t boot) {
+    out.print("{\"results\":");
+    serializeJson(results, out);
+    out.print(",\"update\":");
+    storage.writeChangesJson(out, since, boot);
+    out.print('}');
+}
+
+// Let request through admission control, or answer it with 503 or
+// 429 and Retry-After
+bool admitRequest(AsyncWebServerRequest* request, AdmissionControl& admission, AdmissionControl::Kind kind) {
+    AdmissionControl::Verdict verdict = admission.admit(request, kind);
+    if (verdict == AdmissionControl::ADMIT) {
+        return true;
+    }
+    
+    ApiError error = verdict == AdmissionControl::BUSY ? API_ERROR("Too many requests") : API_ERROR("Low on memory");
+    int code = verdict == AdmissionControl::BUSY ? 429 : 503;
+    AsyncWebServerResponse* response = request->beginResponse_P(code, "application/json",
+        reinterpret_cast<const uint8_t*>(error.body), strlen(error.body));
+    response->addHeader("Retry-After", String(ADMISSION_RETRY_AFTER_S));
+    setCORSHeaders(response);
+    sendResponse(request, response, code);
+    return false;
+}
+
+// handler, run only for requests admitted as kind
+ApiRequestHandler admitted(AdmissionControl& admission, AdmissionControl::Kind kind, ApiRequestHandler handler) {
+    return [&admission, kind, handler](AsyncWebServerRequest* request, const RouteParams& params) {
+        if (admitRequest(request, admission, kind)) {
+            handler(request, params);
+        }
+    };
 }
 
-// Send error response
-void sendError(AsyncWebServerRequest* request, const char* message, int code = 400) {
-    DynamicJsonDocument doc(256);
-    doc["error"] = message;
-    sendJsonResponse(request, doc, code);
+ApiBodyHandler admitted(AdmissionControl& admission, AdmissionControl::Kind kind, ApiBodyHandler handler) {
+    return [&admission, kind, handler](AsyncWebServerRequest* request, const RouteParams& params, char* body,
+                                       size_t length) {
+        if (admitRequest(request, admission, kind)) {
+            handler(request, params, body, length);
+        }
+    };
 }
 
-// Get current timestamp as string
-String getTimestamp() {
-    // Simple timestamp based on millis since we don't have RTC
-    // Format: relative time in seconds since boot
-    return String(millis() / 1000);
+// Parse a request body into doc, timed as the json_parse stage
+DeserializationError parseBody(Metrics& metrics, JsonDocument& doc, char* body, size_t length) {
+    ScopedLatency timer(metrics.getParseTimes());
+    AllocScope scope(ALLOC_JSON);
+    return deserializeJson(doc, body, length);
 }
 
 /**
  * Setup all web server routes
  */
-void setupWebHandlers(AsyncWebServer& server, DataStorage& storage) {
+void setupWebHandlers(AsyncWebServer& server, DataStorage& storage, ChangeEvents& events, StaticAssets& assets,
+                      JsonPool& pool, AdmissionControl& admission, PersistenceTask& persistence,
+                      Metrics& metrics, HeapMonitor& heap) {
     
     // ========================================
     // Static File Serving
     // ========================================
     
-    // Serve static files from LittleFS
-    server.serveStatic("/", LittleFS, "/").setDefaultFile("index.html");
+    // Serve static files from LittleFS, gzipped and with ETags
+    assets.begin(server);
     
     // ========================================
     // CORS Preflight Handler
     // ========================================
-    server.on("/*", HTTP_OPTIONS, [](AsyncWebServerRequest* request) {
+    int optionsMetric = metrics.addRoute("OPTIONS", "/*");
+    server.on("/*", HTTP_OPTIONS, [&metrics, optionsMetric](AsyncWebServerRequest* request) {
+        RequestTimer timer(&metrics, optionsMetric);
+        AllocScope scope(ALLOC_HTTP);
         AsyncWebServerResponse* response = request->beginResponse(204);
         setCORSHeaders(response);
-        request->send(response);
+        sendResponse(request, response, 204);
     });
     
+    // ========================================
+    // API Routes, matched by path segment; the
+    // server owns and frees the router
+    // ========================================
+    ApiRouter* api = new ApiRouter(sendError, &metrics);
+    
     // ========================================
     // System Status API
     // ========================================
     
-    // GET /api/status - System status
-    server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest* request) {
-        DynamicJsonDocument doc(1024);
+    // GET /api/status - System status. Not subject to admission: small,
+    // from the pool, and wanted most when the heap runs low.
+    api->on("/api/status", HTTP_GET, [&storage, &events, &pool, &admission, &persistence, &heap](AsyncWebServerRequest* request, const RouteParams& params) {
+        JsonPool::Document status(pool);
+        JsonDocument& doc = *status;
         
         doc["device"] = "ESP32-C3";
         doc["firmware"] = "1.0.0";
         doc["uptime"] = millis() / 1000;
         doc["freeHeap"] = ESP.getFreeHeap();
         doc["totalHeap"] = ESP.getHeapSize();
+        doc["largestFreeBlock"] = ESP.getMaxAllocHeap();
+        heap.sample();
+        doc["heap"]["minFree"] = heap.getMinFreeHeap();
+        doc["heap"]["minLargestBlock"] = heap.getMinLargestBlock();
+        doc["heap"]["fragmentation"] = heap.getFragmentation();
+        doc["heap"]["tracing"] = AllocTrace::isTracing();
+        if (AllocTrace::isTracing()) {
+            JsonObject allocations = doc["heap"].createNestedObject("allocations");
+            for (int i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+                const AllocTrace::Counters& counters = AllocTrace::get((AllocSubsystem)i);
+                JsonObject subsystem = allocations.createNestedObject(AllocTrace::name((AllocSubsystem)i));
+                subsystem["count"] = counters.count;
+                subsystem["kb"] = (uint32_t)(counters.bytes / 1024);
+            }
+        }
         doc["wifi"]["connected"] = WiFi.status() == WL_CONNECTED;
         doc["wifi"]["ssid"] = WiFi.SSID();
         doc["wifi"]["ip"] = WiFi.localIP().toString();
         doc["wifi"]["rssi"] = WiFi.RSSI();
         doc["wifi"]["signalQuality"] = WiFi.RSSI() <= -100 ? 0 : (WiFi.RSSI() >= -50 ? 100 : 2 * (WiFi.RSSI() + 100));
+        doc["storage"]["pendingChanges"] = storage.getPendingChanges();
+        doc["storage"]["flushes"] = storage.getFlushCount();
+        doc["storage"]["flushesAvoided"] = storage.getFlushesAvoided();
+        doc["storage"]["bytesWritten"] = storage.getBytesWritten();
+        doc["storage"]["logLength"] = storage.getLogLength();
+        doc["storage"]["writeTimeMs"] = (uint32_t)(storage.getWriteTimeUs() / 1000);
+        doc["storage"]["maxWriteUs"] = storage.getMaxWriteTimeUs();
+        const FlashWear& wear = storage.getFlashWear();
+        doc["flash"]["writesPerHour"] = wear.getWritesPerHour(millis());
+        doc["flash"]["logicalKb"] = (uint32_t)(wear.getLogicalBytes() / 1024);
+        doc["flash"]["physicalKb"] = (uint32_t)(wear.getPhysicalBytes() / 1024);
+        doc["flash"]["pagesErased"] = wear.getPagesErased();
+        doc["flash"]["budgetUsed"] = wear.getBudgetUsed();
+        doc["flash"]["lifetimeYears"] = wear.getLifetimeYears(millis());
+        doc["persist"]["running"] = persistence.isRunning();
+        doc["persist"]["queueDepth"] = persistence.getQueueDepth();
+        doc["persist"]["maxQueueDepth"] = persistence.getMaxQueueDepth();
+        doc["persist"]["requests"] = persistence.getRequests();
+        doc["persist"]["writes"] = persistence.getWrites();
+        doc["events"]["clients"] = events.getClientCount();
+        doc["events"]["pushes"] = events.getPushCount();
+        doc["events"]["dropped"] = events.getDroppedCount();
+        doc["json"]["pooled"] = pool.getCheckouts();
+        doc["json"]["fallbacks"] = pool.getFallbacks();
+        doc["admission"]["heavyInFlight"] = admission.getHeavyInFlight();
+        doc["admission"]["rejectedLowHeap"] = admission.getRejectedLowHeap();
+        doc["admission"]["rejectedBusy"] = admission.getRejectedBusy();
         
-        sendJsonResponse(request, doc);
+        sendJsonResponse(request, pool, doc);
+    });
+    
+    // GET /api/metrics - Request counts and latencies, Prometheus text
+    // format. Written line by line into the response's own buffers, so
+    // it neither allocates nor needs admission.
+    metrics.addStage("storage_load", storage.getLoadTimes());
+    metrics.addStage("nvs_write", storage.getWriteTimes());
+    metrics.addStage("state_json", storage.getStateTimes());
+    api->on("/api/metrics", HTTP_GET, [&metrics](AsyncWebServerRequest* request, const RouteParams& params) {
+        size_t line = 0;
+        AsyncWebServerResponse* response = request->beginChunkedResponse("text/plain; version=0.0.4",
+            [&metrics, line](uint8_t* buffer, size_t maxLen, size_t index) mutable -> size_t {
+                size_t written = metrics.fill(reinterpret_cast<char*>(buffer), maxLen, line);
+                if (written == 0 && !metrics.finished(line)) {
+                    return RESPONSE_TRY_AGAIN;  // Next line does not fit yet
+                }
+                return written;
+            });
+        setCORSHeaders(response);
+        sendResponse(request, response, 200);
     });
     
     // ========================================
@@ -95,163 +328,103 @@ void setupWebHandlers(AsyncWebServer& server, DataStorage& storage) {
     // ========================================
     
     // GET /api/state - Get full application state
-    server.on("/api/state", HTTP_GET, [&storage](AsyncWebServerRequest* request) {
-        String stateJson = storage.getStateJson();
-        AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
+    api->on("/api/state", HTTP_GET, admitted(admission, AdmissionControl::HEAVY_READ, [&storage](AsyncWebServerRequest* request, const RouteParams& params) {
+        // Unchanged since the client's copy: headers only. Compared with
+        // the snapshot that would be sent, which may lag the live version
+        std::shared_ptr<const StateSnapshot> state = storage.getSnapshot();
+        if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == state->etag) {
+            AsyncWebServerResponse* response = request->beginResponse(304);
+            response->addHeader("ETag", state->etag);
+            response->addHeader("Cache-Control", "no-cache");
+            setCORSHeaders(response);
+            sendResponse(request, response, 304);
+            return;
+        }
+        sendStateResponse(request, state);
+    }));
+    
+    // GET /api/changes?since=<version>&boot=<hex> - Changes since a version
+    api->on("/api/changes", HTTP_GET, admitted(admission, AdmissionControl::HEAVY_READ, [&storage](AsyncWebServerRequest* request, const RouteParams& params) {
+        sendChangesResponse(request, storage);
+    }));
+    
+    // GET /api/balances - Per-user and per-item balances
+    api->on("/api/balances", HTTP_GET, admitted(admission, AdmissionControl::HEAVY_READ, [&storage](AsyncWebServerRequest* request, const RouteParams& params) {
+        String balancesJson = storage.getBalancesJson();
+        AsyncWebServerResponse* response = request->beginResponse(200, "application/json", balancesJson);
         setCORSHeaders(response);
-        request->send(response);
-    });
+        sendResponse(request, response, 200);
+    }));
+    
+    // Live change events for open browsers
+    events.begin(server);
     
     // ========================================
     // Users API
     // ========================================
     
     // POST /api/users - Add new user
-    server.on("/api/users", HTTP_POST, [](AsyncWebServerRequest* request) {},
-        NULL,
-        [&storage](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
-            DynamicJsonDocument doc(512);
-            DeserializationError error = deserializeJson(doc, data, len);
+    api->on("/api/users", HTTP_POST,
+        admitted(admission, AdmissionControl::MUTATION, [&storage, &events, &pool, &metrics](AsyncWebServerRequest* request, const RouteParams& params, char* body, size_t length) {
+            JsonPool::Document doc(pool);
+            DeserializationError error = parseBody(metrics, *doc, body, length);
             
             if (error) {
-                sendError(request, "Invalid JSON");
-                return;
-            }
-            
-            const char* name = doc["name"];
-            if (!name || strlen(name) == 0) {
-                sendError(request, "Name is required");
-                return;
-            }
-            
-            if (storage.userExists(name)) {
-                sendError(request, "User already exists");
-                return;
-            }
-            
-            String id = String(millis());
-            if (!storage.addUser(id.c_str(), name)) {
-                sendError(request, "Failed to add user", 500);
+                sendError(request, API_ERROR("Invalid JSON"));
                 return;
             }
             
-            String stateJson = storage.getStateJson();
-            AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-            setCORSHeaders(response);
-            request->send(response);
-        }
+            sendOperationResponse(request, addUserOperation(storage, doc->as<JsonObject>()), storage, events);
+        }), MAX_REQUEST_BODY_SIZE
     );
     
     // DELETE /api/users/{id} - Remove user
-    server.on("^\\/api\\/users\\/([a-zA-Z0-9]+)$", HTTP_DELETE, [&storage](AsyncWebServerRequest* request) {
-        String userId = request->pathArg(0);
-        
-        if (!storage.removeUser(userId.c_str())) {
-            sendError(request, "User not found", 404);
-            return;
-        }
-        
-        String stateJson = storage.getStateJson();
-        AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-        setCORSHeaders(response);
-        request->send(response);
-    });
+    api->on("/api/users/{id}", HTTP_DELETE, admitted(admission, AdmissionControl::MUTATION, [&storage, &events](AsyncWebServerRequest* request, const RouteParams& params) {
+        const String& userId = params[0];
+        sendOperationResponse(request, removeUserOperation(storage, userId.c_str()), storage, events);
+    }));
     
     // ========================================
     // Items API
     // ========================================
     
     // POST /api/items - Add new item
-    server.on("/api/items", HTTP_POST, [](AsyncWebServerRequest* request) {},
-        NULL,
-        [&storage](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
-            DynamicJsonDocument doc(512);
-            DeserializationError error = deserializeJson(doc, data, len);
+    api->on("/api/items", HTTP_POST,
+        admitted(admission, AdmissionControl::MUTATION, [&storage, &events, &pool, &metrics](AsyncWebServerRequest* request, const RouteParams& params, char* body, size_t length) {
+            JsonPool::Document doc(pool);
+            DeserializationError error = parseBody(metrics, *doc, body, length);
             
             if (error) {
-                sendError(request, "Invalid JSON");
-                return;
-            }
-            
-            const char* name = doc["name"];
-            JsonVariant priceVar = doc["price"];
-            float price = priceVar.isNull() ? 0.0f : priceVar.as<float>();
-            JsonVariant stockVar = doc["stock"];
-            int stock = stockVar.isNull() ? 24 : stockVar.as<int>();
-            
-            if (!name || strlen(name) == 0) {
-                sendError(request, "Name is required");
-                return;
-            }
-            
-            if (price <= 0) {
-                sendError(request, "Invalid price");
-                return;
-            }
-            
-            if (storage.itemExists(name)) {
-                sendError(request, "Item already exists");
+                sendError(request, API_ERROR("Invalid JSON"));
                 return;
             }
             
-            String id = String(millis());
-            if (!storage.addItem(id.c_str(), name, price, stock)) {
-                sendError(request, "Failed to add item", 500);
-                return;
-            }
-            
-            String stateJson = storage.getStateJson();
-            AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-            setCORSHeaders(response);
-            request->send(response);
-        }
+            sendOperationResponse(request, addItemOperation(storage, doc->as<JsonObject>()), storage, events);
+        }), MAX_REQUEST_BODY_SIZE
     );
     
     // DELETE /api/items/{id} - Remove item
-    server.on("^\\/api\\/items\\/([a-zA-Z0-9]+)$", HTTP_DELETE, [&storage](AsyncWebServerRequest* request) {
-        String itemId = request->pathArg(0);
-        
-        if (!storage.removeItem(itemId.c_str())) {
-            sendError(request, "Item not found", 404);
-            return;
-        }
-        
-        String stateJson = storage.getStateJson();
-        AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-        setCORSHeaders(response);
-        request->send(response);
-    });
+    api->on("/api/items/{id}", HTTP_DELETE, admitted(admission, AdmissionControl::MUTATION, [&storage, &events](AsyncWebServerRequest* request, const RouteParams& params) {
+        const String& itemId = params[0];
+        sendOperationResponse(request, removeItemOperation(storage, itemId.c_str()), storage, events);
+    }));
     
     // PUT /api/items/{id}/stock - Update item stock
-    server.on("^\\/api\\/items\\/([a-zA-Z0-9]+)\\/stock$", HTTP_PUT, [](AsyncWebServerRequest* request) {},
-        NULL,
-        [&storage](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
-            String itemId = request->pathArg(0);
+    api->on("/api/items/{id}/stock", HTTP_PUT,
+        admitted(admission, AdmissionControl::MUTATION, [&storage, &events, &pool, &metrics](AsyncWebServerRequest* request, const RouteParams& params, char* body, size_t length) {
+            const String& itemId = params[0];
             
-            DynamicJsonDocument doc(256);
-            DeserializationError error = deserializeJson(doc, data, len);
+            JsonPool::Document doc(pool);
+            DeserializationError error = parseBody(metrics, *doc, body, length);
             
             if (error) {
-                sendError(request, "Invalid JSON");
-                return;
-            }
-            
-            int stock = doc["stock"] | -1;
-            if (stock < 0) {
-                sendError(request, "Invalid stock value");
-                return;
-            }
-            
-            if (!storage.updateItemStock(itemId.c_str(), stock)) {
-                sendError(request, "Item not found", 404);
+                sendError(request, API_ERROR("Invalid JSON"));
                 return;
             }
             
-            String stateJson = storage.getStateJson();
-            AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-            setCORSHeaders(response);
-            request->send(response);
-        }
+            sendOperationResponse(request, updateItemStockOperation(storage, itemId.c_str(), doc->as<JsonObject>()),
+                storage, events);
+        }), MAX_REQUEST_BODY_SIZE
     );
     
     // ========================================
@@ -259,97 +432,89 @@ void setupWebHandlers(AsyncWebServer& server, DataStorage& storage) {
     // ========================================
     
     // POST /api/consumption - Record consumption
-    server.on("/api/consumption", HTTP_POST, [](AsyncWebServerRequest* request) {},
-        NULL,
-        [&storage](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
-            DynamicJsonDocument doc(512);
-            DeserializationError error = deserializeJson(doc, data, len);
+    api->on("/api/consumption", HTTP_POST,
+        admitted(admission, AdmissionControl::MUTATION, [&storage, &events, &pool, &metrics](AsyncWebServerRequest* request, const RouteParams& params, char* body, size_t length) {
+            JsonPool::Document doc(pool);
+            DeserializationError error = parseBody(metrics, *doc, body, length);
             
             if (error) {
-                sendError(request, "Invalid JSON");
+                sendError(request, API_ERROR("Invalid JSON"));
                 return;
             }
             
-            const char* userId = doc["userId"];
-            const char* itemId = doc["itemId"];
-            int quantity = doc["quantity"] | 0;
-            
-            if (!userId || !itemId || quantity <= 0) {
-                sendError(request, "Invalid input");
-                return;
-            }
-            
-            // Check available stock
-            int available = storage.getAvailableStock(itemId);
-            if (quantity > available) {
-                sendError(request, "Not enough stock");
-                return;
-            }
-            
-            String id = String(millis());
-            if (!storage.addConsumption(id.c_str(), userId, itemId, quantity)) {
-                sendError(request, "Failed to record consumption", 500);
-                return;
-            }
-            
-            String stateJson = storage.getStateJson();
-            AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-            setCORSHeaders(response);
-            request->send(response);
-        }
+            sendOperationResponse(request, addConsumptionOperation(storage, doc->as<JsonObject>()), storage, events);
+        }), MAX_REQUEST_BODY_SIZE
     );
     
     // DELETE /api/consumption/{id} - Remove consumption record
-    server.on("^\\/api\\/consumption\\/([a-zA-Z0-9]+)$", HTTP_DELETE, [&storage](AsyncWebServerRequest* request) {
-        String consumptionId = request->pathArg(0);
-        
-        if (!storage.removeConsumption(consumptionId.c_str())) {
-            sendError(request, "Consumption record not found", 404);
-            return;
-        }
-        
-        String stateJson = storage.getStateJson();
-        AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-        setCORSHeaders(response);
-        request->send(response);
-    });
+    api->on("/api/consumption/{id}", HTTP_DELETE, admitted(admission, AdmissionControl::MUTATION, [&storage, &events](AsyncWebServerRequest* request, const RouteParams& params) {
+        const String& consumptionId = params[0];
+        sendOperationResponse(request, removeConsumptionOperation(storage, consumptionId.c_str()), storage, events);
+    }));
     
     // ========================================
     // Payments API
     // ========================================
     
     // POST /api/payments - Process payment
-    server.on("/api/payments", HTTP_POST, [](AsyncWebServerRequest* request) {},
-        NULL,
-        [&storage](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
-            DynamicJsonDocument doc(512);
-            DeserializationError error = deserializeJson(doc, data, len);
+    api->on("/api/payments", HTTP_POST,
+        admitted(admission, AdmissionControl::MUTATION, [&storage, &events, &pool, &metrics](AsyncWebServerRequest* request, const RouteParams& params, char* body, size_t length) {
+            JsonPool::Document doc(pool);
+            DeserializationError error = parseBody(metrics, *doc, body, length);
             
             if (error) {
-                sendError(request, "Invalid JSON");
+                sendError(request, API_ERROR("Invalid JSON"));
                 return;
             }
             
-            const char* userId = doc["userId"];
-            const char* itemId = doc["itemId"];
-            float amount = doc["amount"] | 0.0f;
+            sendOperationResponse(request, addPaymentOperation(storage, doc->as<JsonObject>()), storage, events);
+        }), MAX_REQUEST_BODY_SIZE
+    );
+    
+    // ========================================
+    // Batch API
+    // ========================================
+    
+    // POST /api/batch - Apply an array of operations, all or none
+    api->on("/api/batch", HTTP_POST,
+        admitted(admission, AdmissionControl::MUTATION, [&storage, &events, &pool, &metrics](AsyncWebServerRequest* request, const RouteParams& params, char* body, size_t length) {
+            // Parsed in place: strings point into the body buffer
+            DynamicJsonDocument doc(JSON_ARRAY_SIZE(MAX_BATCH_OPERATIONS) +
+                                    MAX_BATCH_OPERATIONS * JSON_OBJECT_SIZE(8));
+            DeserializationError error = parseBody(metrics, doc, body, length);
+            if (error || !doc.is<JsonArray>()) {
+                sendError(request, API_ERROR("Invalid JSON"));
+                return;
+            }
             
-            if (!userId || !itemId || amount <= 0) {
-                sendError(request, "Invalid input");
+            JsonArray operations = doc.as<JsonArray>();
+            if (operations.size() == 0 || operations.size() > MAX_BATCH_OPERATIONS) {
+                sendError(request, API_ERROR("Invalid number of operations"));
                 return;
             }
             
-            String id = String(millis());
-            if (!storage.addPayment(id.c_str(), userId, itemId, amount)) {
-                sendError(request, "Failed to process payment", 500);
+            DynamicJsonDocument outcome(JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(MAX_BATCH_OPERATIONS) +
+                                        MAX_BATCH_OPERATIONS * (JSON_OBJECT_SIZE(2) + 16));
+            JsonArray results = outcome.createNestedArray("results");
+            int code = runBatch(storage, operations, results);
+            if (code != 200) {
+                outcome["error"] = "Batch rolled back";
+                sendJsonResponse(request, pool, outcome, code);
                 return;
             }
             
-            String stateJson = storage.getStateJson();
-            AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
+            events.broadcast();
+            uint32_t since;
+            uint32_t boot;
+            getSyncParams(request, storage, since, boot);
+            
+            ByteCounter counter;
+            writeBatchJson(counter, results, storage, since, boot);
+            AsyncResponseStream* response = request->beginResponseStream("application/json", counter.count());
+            writeBatchJson(*response, results, storage, since, boot);
             setCORSHeaders(response);
-            request->send(response);
-        }
+            sendResponse(request, response, 200);
+        }), MAX_BATCH_BODY_SIZE
     );
     
     // ========================================
@@ -357,27 +522,34 @@ void setupWebHandlers(AsyncWebServer& server, DataStorage& storage) {
     // ========================================
     
     // POST /api/reset - Reset all data
-    server.on("/api/reset", HTTP_POST, [&storage](AsyncWebServerRequest* request) {
+    api->on("/api/reset", HTTP_POST, admitted(admission, AdmissionControl::MUTATION, [&storage, &events](AsyncWebServerRequest* request, const RouteParams& params) {
         storage.reset();
         
-        String stateJson = storage.getStateJson();
-        AsyncWebServerResponse* response = request->beginResponse(200, "application/json", stateJson);
-        setCORSHeaders(response);
-        request->send(response);
-    });
+        sendChangeResponse(request, storage, events);
+    }));
+    
+    server.addHandler(api);
     
     // ========================================
     // 404 Handler
     // ========================================
-    server.onNotFound([](AsyncWebServerRequest* request) {
+    int notFoundMetric = metrics.addRoute("ANY", "(not found)");
+    server.onNotFound([&assets, &metrics, notFoundMetric](AsyncWebServerRequest* request) {
+        RequestTimer timer(&metrics, notFoundMetric);
+        AllocScope scope(ALLOC_HTTP);
+        
         // For API routes, return JSON error
         if (request->url().startsWith("/api/")) {
-            sendError(request, "Endpoint not found", 404);
+            sendError(request, API_ERROR("Endpoint not found"), 404);
             return;
         }
         
-        // For other routes, try to serve index.html (SPA support)
-        request->send(LittleFS, "/index.html", "text/html");
+        // For other routes, try to serve index.html (SPA support);
+        // a 304 from assets is counted as 200
+        Metrics::noteStatus(200);
+        if (!assets.send(request, "/index.html")) {
+            request->send(LittleFS, "/index.html", "text/html");
+        }
     });
     
     DEBUG_PRINTLN("[WEB] All routes configured");
@@ -0,0 +1,96 @@
+/**
+ * Unit Tests for AdmissionControl
+ * 
+ * Checks the heap watermarks, that mutations are let in below the
+ * watermark of reads, and the cap on full-state responses in flight.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+
+#include "admission.h"
+
+#define PLENTY 262144
+
+AdmissionControl* admission = nullptr;
+
+void setUp(void) {
+    admission = new AdmissionControl();
+}
+
+void tearDown(void) {
+    delete admission;
+    admission = nullptr;
+}
+
+// ============================================
+// Watermark Tests
+// ============================================
+
+void test_admitted_with_plenty_of_heap(void) {
+    TEST_ASSERT_EQUAL(AdmissionControl::ADMIT, admission->check(AdmissionControl::MUTATION, PLENTY, PLENTY));
+    TEST_ASSERT_EQUAL(AdmissionControl::ADMIT, admission->check(AdmissionControl::HEAVY_READ, PLENTY, PLENTY));
+    TEST_ASSERT_EQUAL(0, admission->getRejectedLowHeap());
+}
+
+void test_mutations_before_reads(void) {
+    // Between the two watermarks only mutations get in
+    uint32_t freeHeap = (ADMISSION_READ_MIN_FREE_HEAP + ADMISSION_WRITE_MIN_FREE_HEAP) / 2;
+    TEST_ASSERT_EQUAL(AdmissionControl::LOW_HEAP, admission->check(AdmissionControl::HEAVY_READ, freeHeap, PLENTY));
+    TEST_ASSERT_EQUAL(AdmissionControl::ADMIT, admission->check(AdmissionControl::MUTATION, freeHeap, PLENTY));
+    
+    // Below both, nothing does
+    freeHeap = ADMISSION_WRITE_MIN_FREE_HEAP - 1;
+    TEST_ASSERT_EQUAL(AdmissionControl::LOW_HEAP, admission->check(AdmissionControl::MUTATION, freeHeap, PLENTY));
+    TEST_ASSERT_EQUAL(2, admission->getRejectedLowHeap());
+}
+
+void test_fragmented_heap_rejected(void) {
+    // Enough free heap in total, but no block large enough
+    uint32_t largestBlock = ADMISSION_READ_MIN_BLOCK - 1;
+    TEST_ASSERT_EQUAL(AdmissionControl::LOW_HEAP, admission->check(AdmissionControl::HEAVY_READ, PLENTY, largestBlock));
+    TEST_ASSERT_EQUAL(AdmissionControl::ADMIT, admission->check(AdmissionControl::MUTATION, PLENTY, largestBlock));
+    
+    largestBlock = ADMISSION_WRITE_MIN_BLOCK - 1;
+    TEST_ASSERT_EQUAL(AdmissionControl::LOW_HEAP, admission->check(AdmissionControl::MUTATION, PLENTY, largestBlock));
+}
+
+// ============================================
+// In-Flight Tests
+// ============================================
+
+void test_heavy_reads_capped(void) {
+    for (int i = 0; i < ADMISSION_MAX_HEAVY_RESPONSES; i++) {
+        TEST_ASSERT_EQUAL(AdmissionControl::ADMIT, admission->check(AdmissionControl::HEAVY_READ, PLENTY, PLENTY));
+        admission->beginHeavy();
+    }
+    TEST_ASSERT_EQUAL(AdmissionControl::BUSY, admission->check(AdmissionControl::HEAVY_READ, PLENTY, PLENTY));
+    TEST_ASSERT_EQUAL(1, admission->getRejectedBusy());
+    
+    // Mutations are not held up by reads in flight
+    TEST_ASSERT_EQUAL(AdmissionControl::ADMIT, admission->check(AdmissionControl::MUTATION, PLENTY, PLENTY));
+    
+    admission->endHeavy();
+    TEST_ASSERT_EQUAL(AdmissionControl::ADMIT, admission->check(AdmissionControl::HEAVY_READ, PLENTY, PLENTY));
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_admitted_with_plenty_of_heap);
+    RUN_TEST(test_mutations_before_reads);
+    RUN_TEST(test_fragmented_heap_rejected);
+    RUN_TEST(test_heavy_reads_capped);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
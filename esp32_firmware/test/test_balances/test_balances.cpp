@@ -0,0 +1,189 @@
+/**
+ * Unit Tests for the balance ledger
+ * 
+ * Checks getBalancesJson against balances recomputed from the raw
+ * consumption and payment records after random operation sequences.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <math.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_bal"
+
+#include "data_storage.h"
+
+DataStorage* storage = nullptr;
+
+// Small deterministic generator so failures are reproducible
+uint32_t rngState = 1;
+uint32_t nextRandom(uint32_t range) {
+    rngState = rngState * 1103515245UL + 12345UL;
+    return (rngState >> 16) % range;
+}
+
+void setUp(void) {
+    storage = new DataStorage();
+    storage->begin();
+    storage->reset();
+}
+
+void tearDown(void) {
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+// Recompute every user's totals from the state JSON and compare
+void assertBalancesMatchRescan() {
+    DynamicJsonDocument state(32768);
+    TEST_ASSERT_FALSE(deserializeJson(state, storage->getStateJson()));
+    DynamicJsonDocument balances(32768);
+    TEST_ASSERT_FALSE(deserializeJson(balances, storage->getBalancesJson()));
+    
+    JsonArray users = balances["users"].as<JsonArray>();
+    TEST_ASSERT_EQUAL(state["users"].size(), users.size());
+    
+    for (JsonObject user : users) {
+        const char* userId = user["userId"];
+        int quantity = 0;
+        float owed = 0;
+        float paid = 0;
+        
+        for (JsonObject record : state["consumption"].as<JsonArray>()) {
+            if (strcmp(record["userId"].as<const char*>(), userId) != 0) {
+                continue;
+            }
+            quantity += record["quantity"].as<int>();
+            for (JsonObject item : state["items"].as<JsonArray>()) {
+                if (strcmp(item["id"].as<const char*>(), record["itemId"].as<const char*>()) == 0) {
+                    owed += record["quantity"].as<int>() * item["price"].as<float>();
+                }
+            }
+        }
+        for (JsonObject payment : state["payments"].as<JsonArray>()) {
+            if (strcmp(payment["userId"].as<const char*>(), userId) == 0) {
+                paid += payment["amount"].as<float>();
+            }
+        }
+        
+        TEST_ASSERT_EQUAL(quantity, user["quantity"].as<int>());
+        TEST_ASSERT_FLOAT_WITHIN(0.01, owed, user["owed"].as<float>());
+        TEST_ASSERT_FLOAT_WITHIN(0.01, paid, user["paid"].as<float>());
+        TEST_ASSERT_FLOAT_WITHIN(0.01, owed - paid, user["balance"].as<float>());
+    }
+}
+
+void runRandomSequence(uint32_t seed, int operations) {
+    rngState = seed;
+    char id[16];
+    char userId[16];
+    char itemId[16];
+    int nextId = 0;
+    
+    for (int i = 0; i < operations; i++) {
+        snprintf(userId, sizeof(userId), "u%u", (unsigned)nextRandom(6));
+        snprintf(itemId, sizeof(itemId), "i%u", (unsigned)nextRandom(4));
+        
+        switch (nextRandom(10)) {
+            case 0:
+                if (!storage->userExists(userId)) {
+                    storage->addUser(userId, userId);
+                }
+                break;
+            case 1:
+                if (!storage->itemExists(itemId)) {
+                    storage->addItem(itemId, itemId, 0.5f + nextRandom(4), 1000);
+                }
+                break;
+            case 2:
+                storage->removeUser(userId);
+                break;
+            case 3:
+                if (nextRandom(4) == 0) {
+                    storage->removeItem(itemId);
+                }
+                break;
+            case 4:
+                snprintf(id, sizeof(id), "p%d", nextId++);
+                storage->addPayment(id, userId, itemId, 0.25f * (1 + nextRandom(20)));
+                break;
+            case 5:
+                snprintf(id, sizeof(id), "c%u", (unsigned)nextRandom(nextId + 1));
+                storage->removeConsumption(id);
+                break;
+            default:
+                snprintf(id, sizeof(id), "c%d", nextId++);
+                storage->addConsumption(id, userId, itemId, 1 + nextRandom(3));
+                break;
+        }
+    }
+}
+
+// ============================================
+// Balance Tests
+// ============================================
+
+void test_balance_for_single_user(void) {
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 100);
+    storage->addItem("item2", "Tea", 1.50, 50);
+    storage->addConsumption("cons1", "user1", "item1", 2);
+    storage->addConsumption("cons2", "user1", "item2", 4);
+    storage->addPayment("pay1", "user1", "item1", 3.00);
+    
+    DynamicJsonDocument doc(4096);
+    TEST_ASSERT_FALSE(deserializeJson(doc, storage->getBalancesJson()));
+    JsonObject user = doc["users"][0];
+    
+    TEST_ASSERT_EQUAL_STRING("Alice", user["name"].as<const char*>());
+    TEST_ASSERT_EQUAL(6, user["quantity"].as<int>());
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 11.00, user["owed"].as<float>());
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 3.00, user["paid"].as<float>());
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 8.00, user["balance"].as<float>());
+    TEST_ASSERT_EQUAL(2, user["items"].size());
+}
+
+void test_balances_match_rescan_after_random_operations(void) {
+    for (uint32_t seed = 1; seed <= 5; seed++) {
+        storage->reset();
+        runRandomSequence(seed, 150);
+        assertBalancesMatchRescan();
+    }
+}
+
+void test_balances_rebuilt_on_load(void) {
+    runRandomSequence(42, 150);
+    
+    delete storage;
+    storage = new DataStorage();
+    storage->begin();
+    
+    assertBalancesMatchRescan();
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_balance_for_single_user);
+    RUN_TEST(test_balances_match_rescan_after_random_operations);
+    RUN_TEST(test_balances_rebuilt_on_load);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
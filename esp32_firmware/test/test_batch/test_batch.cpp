@@ -0,0 +1,228 @@
+/**
+ * Unit Tests for batches of operations (POST /api/batch)
+ * 
+ * Checks that a batch is applied and written as one change, and that a
+ * failing operation leaves the state, the version and NVS exactly as
+ * they were before the batch.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_batch"
+
+#include "data_storage.h"
+#include "api_operations.h"
+
+DataStorage* storage = nullptr;
+DynamicJsonDocument operations(8192);
+DynamicJsonDocument results(8192);
+
+void setUp(void) {
+    storage = new DataStorage(true, false);
+    storage->begin();
+    storage->reset();
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 10);
+}
+
+void tearDown(void) {
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+int runJsonBatch(const char* json) {
+    operations.clear();
+    results.clear();
+    TEST_ASSERT_FALSE(deserializeJson(operations, json));
+    return runBatch(*storage, operations.as<JsonArray>(), results.to<JsonArray>());
+}
+
+const char* resultError(size_t index) {
+    return results[index]["error"] | "";
+}
+
+// ============================================
+// Batch Tests
+// ============================================
+
+void test_batch_applied_with_one_write(void) {
+    uint32_t version = storage->getVersion();
+    uint32_t flushes = storage->getFlushCount();
+    
+    int code = runJsonBatch("["
+        "{\"op\":\"addConsumption\",\"userId\":\"user1\",\"itemId\":\"item1\",\"quantity\":2},"
+        "{\"op\":\"addConsumption\",\"userId\":\"user1\",\"itemId\":\"item1\",\"quantity\":1},"
+        "{\"op\":\"addPayment\",\"userId\":\"user1\",\"itemId\":\"item1\",\"amount\":5.0},"
+        "{\"op\":\"updateStock\",\"id\":\"item1\",\"stock\":20}"
+    "]");
+    
+    TEST_ASSERT_EQUAL(200, code);
+    TEST_ASSERT_TRUE(results[0]["ok"]);
+    TEST_ASSERT_TRUE(results[3]["ok"]);
+    TEST_ASSERT_EQUAL(17, storage->getAvailableStock("item1"));
+    TEST_ASSERT_EQUAL(version + 4, storage->getVersion());
+    TEST_ASSERT_EQUAL(flushes + 1, storage->getFlushCount());
+    
+    // Created ids are distinct even within one millisecond
+    TEST_ASSERT_FALSE(results[0]["id"] == results[1]["id"]);
+}
+
+void test_failed_operation_rolls_back_batch(void) {
+    String state = storage->getStateJson();
+    uint32_t version = storage->getVersion();
+    size_t bytesWritten = storage->getBytesWritten();
+    
+    int code = runJsonBatch("["
+        "{\"op\":\"addUser\",\"name\":\"Bob\"},"
+        "{\"op\":\"addConsumption\",\"userId\":\"user1\",\"itemId\":\"item1\",\"quantity\":3},"
+        "{\"op\":\"removeItem\",\"id\":\"missing\"},"
+        "{\"op\":\"addPayment\",\"userId\":\"user1\",\"itemId\":\"item1\",\"amount\":5.0}"
+    "]");
+    
+    TEST_ASSERT_EQUAL(404, code);
+    TEST_ASSERT_EQUAL_STRING("Rolled back", resultError(0));
+    TEST_ASSERT_EQUAL_STRING("Rolled back", resultError(1));
+    TEST_ASSERT_EQUAL_STRING("Item not found", resultError(2));
+    TEST_ASSERT_EQUAL_STRING("Not applied", resultError(3));
+    
+    TEST_ASSERT_EQUAL_STRING(state.c_str(), storage->getStateJson().c_str());
+    TEST_ASSERT_EQUAL(version, storage->getVersion());
+    TEST_ASSERT_EQUAL(bytesWritten, storage->getBytesWritten());
+    TEST_ASSERT_FALSE(storage->userExists("Bob"));
+    TEST_ASSERT_EQUAL(10, storage->getAvailableStock("item1"));
+    
+    // Nothing of the batch reached NVS either
+    DataStorage reloaded(true, false);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(state.c_str(), reloaded.getStateJson().c_str());
+    
+    // And the storage still works normally afterwards
+    TEST_ASSERT_TRUE(storage->addUser("user2", "Bob"));
+}
+
+String changesSince(uint32_t since) {
+    String changes;
+    StringPrint sink(changes);
+    storage->writeChangesJson(sink, since, storage->getBootId());
+    return changes;
+}
+
+// Serialized afresh; getStateJson() would return the snapshot published
+// for the version, which rolling back restores
+String stateNow() {
+    String state;
+    StringPrint sink(state);
+    storage->writeStateJson(sink);
+    return state;
+}
+
+void test_rollback_restores_removed_records(void) {
+    char id[16];
+    storage->addUser("user2", "Bob");
+    storage->addItem("item2", "Mate", 1.50, 100);
+    for (int i = 0; i < CHANGE_JOURNAL_SIZE; i++) {
+        snprintf(id, sizeof(id), "c%d", i);
+        storage->addConsumption(id, i % 2 ? "user1" : "user2", i % 3 ? "item1" : "item2", 1);
+    }
+    storage->addPayment("p1", "user1", "item1", 2.0);
+    storage->addPayment("p2", "user2", "item2", 3.0);
+    
+    String state = stateNow();
+    String balances = storage->getBalancesJson();
+    uint32_t version = storage->getVersion();
+    String changes = changesSince(version - 10);
+    
+    // Swapped-out, cascaded and overwritten records, and journal
+    // entries written over in the ring
+    int code = runJsonBatch("["
+        "{\"op\":\"removeConsumption\",\"id\":\"c3\"},"
+        "{\"op\":\"updateStock\",\"id\":\"item1\",\"stock\":50},"
+        "{\"op\":\"removeUser\",\"id\":\"user1\"},"
+        "{\"op\":\"addConsumption\",\"userId\":\"user2\",\"itemId\":\"item1\",\"quantity\":2},"
+        "{\"op\":\"removeItem\",\"id\":\"item2\"},"
+        "{\"op\":\"removeConsumption\",\"id\":\"missing\"}"
+    "]");
+    
+    TEST_ASSERT_EQUAL(404, code);
+    TEST_ASSERT_EQUAL_STRING(state.c_str(), stateNow().c_str());
+    TEST_ASSERT_EQUAL_STRING(balances.c_str(), storage->getBalancesJson().c_str());
+    TEST_ASSERT_EQUAL(version, storage->getVersion());
+    TEST_ASSERT_EQUAL_STRING(changes.c_str(), changesSince(version - 10).c_str());
+    
+    // Indexes were rebuilt along
+    TEST_ASSERT_TRUE(storage->removeConsumption("c3"));
+    TEST_ASSERT_TRUE(storage->removeUser("user1"));
+    TEST_ASSERT_FALSE(storage->removeConsumption("c1"));
+}
+
+void test_references_to_earlier_operations(void) {
+    int code = runJsonBatch("["
+        "{\"op\":\"addUser\",\"name\":\"Bob\"},"
+        "{\"op\":\"addItem\",\"name\":\"Mate\",\"price\":1.5,\"stock\":5},"
+        "{\"op\":\"addConsumption\",\"userId\":\"$0\",\"itemId\":\"$1\",\"quantity\":2},"
+        "{\"op\":\"removeConsumption\",\"id\":\"$2\"},"
+        "{\"op\":\"addConsumption\",\"userId\":\"$0\",\"itemId\":\"$3\",\"quantity\":1}"
+    "]");
+    
+    // $3 created nothing
+    TEST_ASSERT_EQUAL(400, code);
+    TEST_ASSERT_EQUAL_STRING("Invalid reference", resultError(4));
+    TEST_ASSERT_FALSE(storage->userExists("Bob"));
+    
+    code = runJsonBatch("["
+        "{\"op\":\"addUser\",\"name\":\"Bob\"},"
+        "{\"op\":\"addItem\",\"name\":\"Mate\",\"price\":1.5,\"stock\":5},"
+        "{\"op\":\"addConsumption\",\"userId\":\"$0\",\"itemId\":\"$1\",\"quantity\":2}"
+    "]");
+    
+    TEST_ASSERT_EQUAL(200, code);
+    TEST_ASSERT_EQUAL(3, storage->getAvailableStock(results[1]["id"].as<const char*>()));
+}
+
+void test_large_batch_written_once(void) {
+    uint32_t flushes = storage->getFlushCount();
+    
+    String json = "[";
+    for (int i = 0; i < MAX_BATCH_OPERATIONS; i++) {
+        json += i ? "," : "";
+        json += "{\"op\":\"addPayment\",\"userId\":\"user1\",\"itemId\":\"item1\",\"amount\":1.0}";
+    }
+    json += "]";
+    
+    TEST_ASSERT_EQUAL(200, runJsonBatch(json.c_str()));
+    TEST_ASSERT_EQUAL(flushes + 1, storage->getFlushCount());
+    
+    DataStorage reloaded(true, false);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(storage->getStateJson().c_str(), reloaded.getStateJson().c_str());
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_batch_applied_with_one_write);
+    RUN_TEST(test_failed_operation_rolls_back_batch);
+    RUN_TEST(test_rollback_restores_removed_records);
+    RUN_TEST(test_references_to_earlier_operations);
+    RUN_TEST(test_large_batch_written_once);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
@@ -0,0 +1,333 @@
+/**
+ * Benchmarks for DataStorage at the configured capacity limits
+ * 
+ * Fills the storage to MAX_USERS, MAX_ITEMS, MAX_CONSUMPTION_RECORDS
+ * and MAX_PAYMENT_RECORDS and times the operations that matter at that
+ * size, reporting ns/op, allocations/op and bytes written to NVS per op
+ * as JSON so runs can be diffed between commits. The tests build on
+ * each other and run in order.
+ * 
+ *   pio test -e native_bench     # Report also in .pio/bench_storage.json
+ *   pio test -e esp32c3_bench -v # Report in the serial output
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <math.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "bench_storage"
+
+#include "data_storage.h"
+
+#define BENCH_LOOKUPS 10000
+#define BENCH_STATE_RUNS 20
+#define BENCH_LOAD_RUNS 5
+#define BENCH_MAX_RESULTS 8
+
+#ifndef BENCH_REPORT_PATH
+#define BENCH_REPORT_PATH ".pio/bench_storage.json"
+#endif
+
+// ============================================
+// Allocation Counting
+// ============================================
+
+volatile uint32_t allocations = 0;
+
+extern "C" {
+#ifdef ARDUINO
+// Needs -Wl,--wrap=malloc and so on, see env:esp32c3_bench
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+#else
+// glibc: replacing malloc catches operator new and libraries as well
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) noexcept {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+}
+
+// ============================================
+// Measurement
+// ============================================
+
+struct BenchResult {
+    const char* name;
+    uint32_t ops;
+    uint64_t micros;
+    uint32_t allocations;
+    size_t bytesPersisted;
+};
+
+BenchResult results[BENCH_MAX_RESULTS];
+size_t resultCount = 0;
+
+DataStorage* storage = nullptr;
+
+/**
+ * Adds the time, allocations and NVS bytes between start() and stop()
+ * to one result; untimed setup can go between the two
+ */
+class Measurement {
+public:
+    explicit Measurement(const char* name) : _result(results[resultCount++]) {
+        _result = BenchResult{name, 0, 0, 0, 0};
+    }
+    
+    void start() {
+        _bytes = storage->getBytesWritten();
+        _allocations = allocations;
+        _started = micros();
+    }
+    
+    void stop(uint32_t ops) {
+        _result.micros += micros() - _started;
+        _result.allocations += allocations - _allocations;
+        _result.bytesPersisted += storage->getBytesWritten() - _bytes;
+        _result.ops += ops;
+    }
+
+private:
+    BenchResult& _result;
+    uint32_t _started;
+    uint32_t _allocations;
+    size_t _bytes;
+};
+
+void formatId(char* id, char prefix, int index) {
+    snprintf(id, MAX_ID_LENGTH + 1, "%c%d", prefix, index);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+// ============================================
+// Benchmarks
+// ============================================
+
+void test_fill_users_and_items(void) {
+    storage = new DataStorage();
+    storage->begin();
+    storage->reset();
+    
+    char id[MAX_ID_LENGTH + 1];
+    char name[MAX_NAME_LENGTH + 1];
+    for (int i = 0; i < MAX_USERS; i++) {
+        formatId(id, 'u', i);
+        snprintf(name, sizeof(name), "User %d", i);
+        TEST_ASSERT_TRUE(storage->addUser(id, name));
+    }
+    for (int i = 0; i < MAX_ITEMS; i++) {
+        formatId(id, 'i', i);
+        snprintf(name, sizeof(name), "Item %d", i);
+        TEST_ASSERT_TRUE(storage->addItem(id, name, 1.50f, 1000));
+    }
+    storage->flush();
+}
+
+void test_bench_add_consumption(void) {
+    Measurement measurement("addConsumption");
+    char id[MAX_ID_LENGTH + 1];
+    char userId[MAX_ID_LENGTH + 1];
+    char itemId[MAX_ID_LENGTH + 1];
+    
+    // Written as it would be in use: flushed as group commit decides,
+    // and whatever is left at the end
+    measurement.start();
+    for (int i = 0; i < MAX_CONSUMPTION_RECORDS; i++) {
+        formatId(id, 'c', i);
+        formatId(userId, 'u', i % MAX_USERS);
+        formatId(itemId, 'i', i % MAX_ITEMS);
+        TEST_ASSERT_TRUE(storage->addConsumption(id, userId, itemId, 1));
+    }
+    storage->flush();
+    measurement.stop(MAX_CONSUMPTION_RECORDS);
+    
+    // Fill payments too, untimed
+    for (int i = 0; i < MAX_PAYMENT_RECORDS; i++) {
+        formatId(id, 'p', i);
+        formatId(userId, 'u', i % MAX_USERS);
+        formatId(itemId, 'i', i % MAX_ITEMS);
+        TEST_ASSERT_TRUE(storage->addPayment(id, userId, itemId, 1.50f));
+    }
+    storage->flush();
+}
+
+void test_bench_get_available_stock(void) {
+    Measurement measurement("getAvailableStock");
+    char itemIds[MAX_ITEMS][MAX_ID_LENGTH + 1];
+    for (int i = 0; i < MAX_ITEMS; i++) {
+        formatId(itemIds[i], 'i', i);
+    }
+    
+    long total = 0;
+    measurement.start();
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        total += storage->getAvailableStock(itemIds[i % MAX_ITEMS]);
+    }
+    measurement.stop(BENCH_LOOKUPS);
+    
+    long consumedPerRound = (long)MAX_CONSUMPTION_RECORDS * BENCH_LOOKUPS / MAX_ITEMS;
+    TEST_ASSERT_EQUAL(1000L * BENCH_LOOKUPS - consumedPerRound, total);
+}
+
+void test_bench_get_state_json(void) {
+    Measurement measurement("getStateJson");
+    char itemId[MAX_ID_LENGTH + 1];
+    
+    for (int i = 0; i < BENCH_STATE_RUNS; i++) {
+        // A change first, so the state is serialized, not the last copy
+        formatId(itemId, 'i', i % MAX_ITEMS);
+        storage->updateItemStock(itemId, 1000 + i);
+        storage->flush();
+        
+        measurement.start();
+        String json = storage->getStateJson();
+        measurement.stop(1);
+        TEST_ASSERT_GREATER_THAN(MAX_CONSUMPTION_RECORDS * 50, json.length());
+    }
+}
+
+void test_bench_load_data(void) {
+    Measurement measurement("loadData");
+    storage->compact();
+    size_t expected = storage->measureStateJson();
+    
+    // loadData() runs in begin(), from the snapshot and the log
+    for (int i = 0; i < BENCH_LOAD_RUNS; i++) {
+        DataStorage loaded;
+        measurement.start();
+        bool ok = loaded.begin();
+        measurement.stop(1);
+        TEST_ASSERT_TRUE(ok);
+        TEST_ASSERT_EQUAL(expected, loaded.measureStateJson());
+    }
+}
+
+void test_bench_remove_user(void) {
+    Measurement measurement("removeUser");
+    char id[MAX_ID_LENGTH + 1];
+    
+    // Each takes its consumption and payments along
+    measurement.start();
+    for (int i = 0; i < MAX_USERS; i++) {
+        formatId(id, 'u', i);
+        TEST_ASSERT_TRUE(storage->removeUser(id));
+    }
+    storage->flush();
+    measurement.stop(MAX_USERS);
+    
+    TEST_ASSERT_EQUAL(1000, storage->getAvailableStock("i0"));
+}
+
+// ============================================
+// Report
+// ============================================
+
+// Two decimals, so reruns diff cleanly
+double perOp(uint64_t total, uint32_t ops) {
+    return ops ? round(total * 100.0 / ops) / 100.0 : 0;
+}
+
+void test_write_report(void) {
+    DynamicJsonDocument doc(3072);
+    doc["suite"] = "data_storage";
+#ifdef ARDUINO
+    doc["platform"] = "esp32c3";
+#else
+    doc["platform"] = "native";
+#endif
+    JsonObject capacity = doc.createNestedObject("capacity");
+    capacity["users"] = MAX_USERS;
+    capacity["items"] = MAX_ITEMS;
+    capacity["consumption"] = MAX_CONSUMPTION_RECORDS;
+    capacity["payments"] = MAX_PAYMENT_RECORDS;
+    JsonObject mode = doc.createNestedObject("storage");
+    mode["log"] = STORAGE_LOG_ENABLED;
+    mode["groupCommit"] = STORAGE_GROUP_COMMIT;
+    
+    JsonObject benchmarks = doc.createNestedObject("results");
+    for (size_t i = 0; i < resultCount; i++) {
+        const BenchResult& result = results[i];
+        JsonObject entry = benchmarks.createNestedObject(result.name);
+        entry["ops"] = result.ops;
+        entry["nsPerOp"] = perOp(result.micros * 1000, result.ops);
+        entry["allocsPerOp"] = perOp(result.allocations, result.ops);
+        entry["bytesPersistedPerOp"] = perOp(result.bytesPersisted, result.ops);
+    }
+    TEST_ASSERT_FALSE(doc.overflowed());
+    
+    String report;
+    serializeJsonPretty(doc, report);
+    Serial.println(report);
+
+#ifndef ARDUINO
+    FILE* file = fopen(BENCH_REPORT_PATH, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs(report.c_str(), file);
+    fputc('\n', file);
+    fclose(file);
+#endif
+    
+    delete storage;
+    storage = nullptr;
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_fill_users_and_items);
+    RUN_TEST(test_bench_add_consumption);
+    RUN_TEST(test_bench_get_available_stock);
+    RUN_TEST(test_bench_get_state_json);
+    RUN_TEST(test_bench_load_data);
+    RUN_TEST(test_bench_remove_user);
+    RUN_TEST(test_write_report);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
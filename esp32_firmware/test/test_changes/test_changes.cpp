@@ -0,0 +1,256 @@
+/**
+ * Unit Tests for the change journal
+ * 
+ * Keeps a client-side copy of the state up to date from
+ * writeChangesJson alone, as data/app.js does, and checks it against
+ * the full state after random operation sequences.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_changes"
+
+#include "data_storage.h"
+
+DataStorage* storage = nullptr;
+DynamicJsonDocument mirror(32768);
+uint32_t mirrorVersion = 0;
+
+const char* COLLECTIONS[] = {"users", "items", "consumption", "payments"};
+
+// Small deterministic generator so failures are reproducible
+uint32_t rngState = 1;
+uint32_t nextRandom(uint32_t range) {
+    rngState = rngState * 1103515245UL + 12345UL;
+    return (rngState >> 16) % range;
+}
+
+void setUp(void) {
+    storage = new DataStorage(true, false);
+    storage->begin();
+    storage->reset();
+}
+
+void tearDown(void) {
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+String changesSince(uint32_t since) {
+    String json;
+    StringPrint sink(json);
+    storage->writeChangesJson(sink, since, storage->getBootId());
+    return json;
+}
+
+// Bring the client copy up to date; true if only changes were sent
+bool syncMirror() {
+    DynamicJsonDocument response(32768);
+    TEST_ASSERT_FALSE(deserializeJson(response, changesSince(mirrorVersion)));
+    mirrorVersion = response["version"];
+    
+    if (response.containsKey("state")) {
+        mirror.set(response["state"]);
+        return false;
+    }
+    
+    for (JsonObject change : response["changes"].as<JsonArray>()) {
+        JsonArray list = mirror[change["in"].as<const char*>()];
+        if (strcmp(change["op"], "put") == 0) {
+            JsonObject record = change["record"];
+            bool found = false;
+            for (JsonObject existing : list) {
+                if (strcmp(existing["id"], record["id"]) == 0) {
+                    existing.set(record);
+                    found = true;
+                }
+            }
+            if (!found) {
+                list.add(record);
+            }
+        } else {
+            const char* key = change.containsKey("id") ? "id" : change.containsKey("userId") ? "userId" : "itemId";
+            for (size_t i = list.size(); i-- > 0;) {
+                if (strcmp(list[i][key], change[key]) == 0) {
+                    list.remove(i);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Same records as the full state, order aside
+void assertMirrorMatchesState() {
+    DynamicJsonDocument state(32768);
+    TEST_ASSERT_FALSE(deserializeJson(state, storage->getStateJson()));
+    
+    for (const char* collection : COLLECTIONS) {
+        JsonArray expected = state[collection];
+        JsonArray actual = mirror[collection];
+        TEST_ASSERT_EQUAL_MESSAGE(expected.size(), actual.size(), collection);
+        
+        for (JsonObject record : expected) {
+            String want;
+            serializeJson(record, want);
+            String got;
+            for (JsonObject candidate : actual) {
+                if (strcmp(candidate["id"], record["id"]) == 0) {
+                    serializeJson(candidate, got);
+                }
+            }
+            TEST_ASSERT_EQUAL_STRING(want.c_str(), got.c_str());
+        }
+    }
+}
+
+void runRandomOperations(int operations) {
+    char id[16];
+    char userId[16];
+    char itemId[16];
+    static int nextId = 0;
+    
+    for (int i = 0; i < operations; i++) {
+        snprintf(userId, sizeof(userId), "u%u", (unsigned)nextRandom(6));
+        snprintf(itemId, sizeof(itemId), "i%u", (unsigned)nextRandom(4));
+        
+        switch (nextRandom(10)) {
+            case 0:
+                if (!storage->userExists(userId)) {
+                    storage->addUser(userId, userId);
+                }
+                break;
+            case 1:
+                if (!storage->itemExists(itemId)) {
+                    storage->addItem(itemId, itemId, 1.5f, 1000);
+                }
+                break;
+            case 2:
+                storage->removeUser(userId);
+                break;
+            case 3:
+                storage->updateItemStock(itemId, nextRandom(100));
+                break;
+            case 4:
+                snprintf(id, sizeof(id), "p%d", nextId++);
+                storage->addPayment(id, userId, itemId, 2.0f);
+                break;
+            case 5:
+                snprintf(id, sizeof(id), "c%u", (unsigned)nextRandom(nextId + 1));
+                storage->removeConsumption(id);
+                break;
+            case 6:
+                if (nextRandom(4) == 0) {
+                    storage->removeItem(itemId);
+                }
+                break;
+            default:
+                snprintf(id, sizeof(id), "c%d", nextId++);
+                storage->addConsumption(id, userId, itemId, 1 + nextRandom(3));
+                break;
+        }
+    }
+}
+
+// ============================================
+// Journal Tests
+// ============================================
+
+void test_single_change_is_small(void) {
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 100);
+    for (int i = 0; i < 50; i++) {
+        char id[16];
+        snprintf(id, sizeof(id), "c%d", i);
+        storage->addConsumption(id, "user1", "item1", 1);
+    }
+    
+    uint32_t version = storage->getVersion();
+    storage->addConsumption("bottle", "user1", "item1", 1);
+    String delta = changesSince(version);
+    
+    char message[96];
+    snprintf(message, sizeof(message), "One consumption: full state %u bytes, delta %u bytes",
+        (unsigned)storage->getStateJson().length(), (unsigned)delta.length());
+    TEST_MESSAGE(message);
+    
+    TEST_ASSERT_NOT_EQUAL(-1, delta.indexOf("\"since\":"));
+    TEST_ASSERT_NOT_EQUAL(-1, delta.indexOf("\"changes\":[{"));
+    TEST_ASSERT_LESS_THAN(200, delta.length());
+}
+
+void test_mirror_follows_random_changes(void) {
+    rngState = 3;
+    mirrorVersion = UINT32_MAX;   // No copy yet
+    TEST_ASSERT_FALSE(syncMirror());
+    
+    for (int round = 0; round < 40; round++) {
+        runRandomOperations(1 + nextRandom(8));
+        TEST_ASSERT_TRUE(syncMirror());
+        assertMirrorMatchesState();
+    }
+}
+
+void test_old_version_gets_snapshot(void) {
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 1000);
+    uint32_t version = storage->getVersion();
+    
+    char id[16];
+    for (int i = 0; i <= CHANGE_JOURNAL_SIZE; i++) {
+        snprintf(id, sizeof(id), "c%d", i);
+        storage->addConsumption(id, "user1", "item1", 1);
+    }
+    
+    mirrorVersion = version;
+    TEST_ASSERT_FALSE(syncMirror());
+    assertMirrorMatchesState();
+    
+    // One version back is still in the journal
+    storage->addConsumption("last", "user1", "item1", 1);
+    TEST_ASSERT_TRUE(syncMirror());
+    assertMirrorMatchesState();
+}
+
+void test_reset_and_other_boot_get_snapshot(void) {
+    storage->addUser("user1", "Alice");
+    uint32_t version = storage->getVersion();
+    
+    String json;
+    StringPrint sink(json);
+    storage->writeChangesJson(sink, version, storage->getBootId() + 1);
+    TEST_ASSERT_NOT_EQUAL(-1, json.indexOf("\"state\":"));
+    
+    storage->reset();
+    TEST_ASSERT_NOT_EQUAL(-1, changesSince(version).indexOf("\"state\":"));
+    TEST_ASSERT_NOT_EQUAL(-1, changesSince(storage->getVersion()).indexOf("\"changes\":[]"));
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_single_change_is_small);
+    RUN_TEST(test_mirror_follows_random_changes);
+    RUN_TEST(test_old_version_gets_snapshot);
+    RUN_TEST(test_reset_and_other_boot_get_snapshot);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
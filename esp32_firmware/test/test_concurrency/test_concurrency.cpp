@@ -0,0 +1,231 @@
+/**
+ * Stress Tests for concurrent DataStorage access
+ * 
+ * Writer threads apply batches while reader threads take snapshots and
+ * a third kind of thread plays loop() and flushes, as the AsyncTCP and
+ * Arduino tasks do on the device. Every snapshot must be a complete
+ * state as of one version, and readers must not wait for writers.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(ESP_PLATFORM)
+#include <esp_pthread.h>
+#endif
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_conc"
+
+#include "data_storage.h"
+
+#define WRITER_THREADS 2
+#define READER_THREADS 2
+#define BATCHES_PER_WRITER 200
+#define LIVE_PAIRS_PER_WRITER 8
+
+DataStorage* storage = nullptr;
+
+void setUp(void) {
+    storage = new DataStorage(true, true);
+    storage->begin();
+    storage->reset();
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 100000);
+}
+
+void tearDown(void) {
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+// Each batch books two records, "a<n>" and "b<n>", then drops an old
+// pair; every fourth batch is rolled back. So in any consistent state
+// every "a" record has its "b" record.
+void writer(int thread) {
+    char id[16];
+    for (int i = 0; i < BATCHES_PER_WRITER; i++) {
+        StorageBatch batch(*storage);
+        snprintf(id, sizeof(id), "a%d_%d", thread, i);
+        storage->addConsumption(id, "user1", "item1", 1);
+        snprintf(id, sizeof(id), "b%d_%d", thread, i);
+        storage->addConsumption(id, "user1", "item1", 1);
+        
+        if (i >= LIVE_PAIRS_PER_WRITER) {
+            int old = i - LIVE_PAIRS_PER_WRITER;
+            snprintf(id, sizeof(id), "a%d_%d", thread, old);
+            storage->removeConsumption(id);
+            snprintf(id, sizeof(id), "b%d_%d", thread, old);
+            storage->removeConsumption(id);
+        }
+        
+        if (i % 4 != 3) {
+            batch.commit();
+        }
+    }
+}
+
+// True if every "a" record in records has its "b" record and back
+bool pairsComplete(JsonArray records) {
+    std::set<std::string> ids;
+    for (JsonObject record : records) {
+        ids.insert(record["id"].as<const char*>());
+    }
+    for (const std::string& id : ids) {
+        std::string other = (id[0] == 'a' ? "b" : "a") + id.substr(1);
+        if (ids.count(other) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct ReaderStats {
+    uint32_t snapshots = 0;
+    uint32_t inconsistent = 0;
+    uint32_t wentBack = 0;
+};
+
+void reader(std::atomic<bool>& done, ReaderStats& stats) {
+    DynamicJsonDocument doc(32768);
+    uint32_t lastVersion = 0;
+    while (!done) {
+        std::shared_ptr<const StateSnapshot> snapshot = storage->getSnapshot();
+        if (snapshot->version < lastVersion) {
+            stats.wentBack++;
+        }
+        lastVersion = snapshot->version;
+        
+        if (deserializeJson(doc, snapshot->json.c_str()) || !pairsComplete(doc["consumption"])) {
+            stats.inconsistent++;
+        }
+        stats.snapshots++;
+    }
+}
+
+// ============================================
+// Stress Tests
+// ============================================
+
+void test_snapshots_consistent_under_load(void) {
+    std::atomic<bool> done(false);
+    ReaderStats stats[READER_THREADS];
+    
+    std::vector<std::thread> readers;
+    for (int i = 0; i < READER_THREADS; i++) {
+        readers.emplace_back(reader, std::ref(done), std::ref(stats[i]));
+    }
+    std::thread flusher([&done]() {
+        while (!done) {
+            storage->tick();
+            delay(1);
+        }
+    });
+    
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITER_THREADS; i++) {
+        writers.emplace_back(writer, i);
+    }
+    for (std::thread& thread : writers) {
+        thread.join();
+    }
+    done = true;
+    for (std::thread& thread : readers) {
+        thread.join();
+    }
+    flusher.join();
+    
+    uint32_t snapshots = 0;
+    for (const ReaderStats& s : stats) {
+        TEST_ASSERT_EQUAL(0, s.inconsistent);
+        TEST_ASSERT_EQUAL(0, s.wentBack);
+        snapshots += s.snapshots;
+    }
+    TEST_ASSERT_GREATER_THAN(0, snapshots);
+    
+    char message[64];
+    snprintf(message, sizeof(message), "%u snapshots read during %u batches",
+        (unsigned)snapshots, (unsigned)(WRITER_THREADS * BATCHES_PER_WRITER));
+    TEST_MESSAGE(message);
+    
+    // The last snapshot is the state, and the state is what NVS holds
+    String fresh;
+    StringPrint sink(fresh);
+    storage->writeStateJson(sink);
+    TEST_ASSERT_EQUAL_STRING(fresh.c_str(), storage->getStateJson().c_str());
+    
+    storage->flush();
+    DataStorage reloaded(true, true);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(fresh.c_str(), reloaded.getStateJson().c_str());
+}
+
+void test_reader_does_not_wait_for_writer(void) {
+    std::shared_ptr<const StateSnapshot> before = storage->getSnapshot();
+    std::atomic<bool> holding(false);
+    std::atomic<bool> release(false);
+    
+    // A writer in the middle of a long change, e.g. an NVS write
+    std::thread writer([&]() {
+        std::lock_guard<DataStorage> lock(*storage);
+        storage->addUser("user2", "Bob");
+        holding = true;
+        while (!release) {
+            delay(1);
+        }
+    });
+    while (!holding) {
+        delay(1);
+    }
+    
+    uint32_t start = millis();
+    std::shared_ptr<const StateSnapshot> during = storage->getSnapshot();
+    uint32_t waited = millis() - start;
+    release = true;
+    writer.join();
+    
+    // The last published version, not the half-done one
+    TEST_ASSERT_LESS_THAN(50, waited);
+    TEST_ASSERT_TRUE(during == before);
+    
+    std::shared_ptr<const StateSnapshot> after = storage->getSnapshot();
+    TEST_ASSERT_GREATER_THAN(before->version, after->version);
+    TEST_ASSERT_NOT_EQUAL(-1, after->json.indexOf("Bob"));
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+
+#if defined(ESP_PLATFORM)
+    // Room for a JSON parse on each thread
+    esp_pthread_cfg_t config = esp_pthread_get_default_config();
+    config.stack_size = 8192;
+    esp_pthread_set_cfg(&config);
+#endif
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_snapshots_consistent_under_load);
+    RUN_TEST(test_reader_does_not_wait_for_writer);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
@@ -1,366 +1,21 @@
 /**
  * Unit Tests for DataStorage class
  * 
- * Tests CRUD operations for users, items, consumption, and payments.
- * Uses Unity test framework (PlatformIO native testing).
+ * Tests CRUD operations for users, items, consumption, and payments
+ * against src/data_storage.h. Runs on the board (esp32c3_test) and on
+ * the build machine (native).
  */
 
 #include <unity.h>
 #include <Arduino.h>
 #include <ArduinoJson.h>
-#include <Preferences.h>
-#include <vector>
 
-// Configuration constants (reuse config.h, override NVS_NAMESPACE for tests)
+// Use a separate NVS namespace so device data is not touched
 #include "config.h"
 #undef NVS_NAMESPACE
 #define NVS_NAMESPACE "test_data"
 
-// Data structures (copied from data_storage.h to avoid include conflicts)
-struct User {
-    String id;
-    String name;
-};
-
-struct Item {
-    String id;
-    String name;
-    float price;
-    int initialStock;
-};
-
-struct ConsumptionRecord {
-    String id;
-    String userId;
-    String itemId;
-    int quantity;
-    String timestamp;
-};
-
-struct PaymentRecord {
-    String id;
-    String userId;
-    String itemId;
-    float amount;
-    String timestamp;
-};
-
-class DataStorage {
-public:
-    DataStorage() {}
-    
-    bool begin() {
-        _prefs.begin(NVS_NAMESPACE, false);
-        loadData();
-        return true;
-    }
-    
-    String getStateJson() {
-        DynamicJsonDocument doc(16384);
-        
-        JsonArray usersArray = doc.createNestedArray("users");
-        for (const auto& user : _users) {
-            JsonObject userObj = usersArray.createNestedObject();
-            userObj["id"] = user.id;
-            userObj["name"] = user.name;
-        }
-        
-        JsonArray itemsArray = doc.createNestedArray("items");
-        for (const auto& item : _items) {
-            JsonObject itemObj = itemsArray.createNestedObject();
-            itemObj["id"] = item.id;
-            itemObj["name"] = item.name;
-            itemObj["price"] = item.price;
-            itemObj["initialStock"] = item.initialStock;
-        }
-        
-        JsonArray consumptionArray = doc.createNestedArray("consumption");
-        for (const auto& record : _consumption) {
-            JsonObject recObj = consumptionArray.createNestedObject();
-            recObj["id"] = record.id;
-            recObj["userId"] = record.userId;
-            recObj["itemId"] = record.itemId;
-            recObj["quantity"] = record.quantity;
-            recObj["timestamp"] = record.timestamp;
-        }
-        
-        JsonArray paymentsArray = doc.createNestedArray("payments");
-        for (const auto& payment : _payments) {
-            JsonObject payObj = paymentsArray.createNestedObject();
-            payObj["id"] = payment.id;
-            payObj["userId"] = payment.userId;
-            payObj["itemId"] = payment.itemId;
-            payObj["amount"] = payment.amount;
-            payObj["timestamp"] = payment.timestamp;
-        }
-        
-        String output;
-        serializeJson(doc, output);
-        return output;
-    }
-    
-    bool userExists(const char* name) {
-        for (const auto& user : _users) {
-            if (user.name.equalsIgnoreCase(name)) {
-                return true;
-            }
-        }
-        return false;
-    }
-    
-    bool addUser(const char* id, const char* name) {
-        if (_users.size() >= MAX_USERS) return false;
-        User user;
-        user.id = id;
-        user.name = name;
-        _users.push_back(user);
-        saveData();
-        return true;
-    }
-    
-    bool removeUser(const char* id) {
-        String idStr = id;
-        auto it = _users.begin();
-        while (it != _users.end()) {
-            if (it->id == idStr) {
-                it = _users.erase(it);
-                removeConsumptionByUser(id);
-                removePaymentsByUser(id);
-                saveData();
-                return true;
-            } else {
-                ++it;
-            }
-        }
-        return false;
-    }
-    
-    bool itemExists(const char* name) {
-        for (const auto& item : _items) {
-            if (item.name.equalsIgnoreCase(name)) {
-                return true;
-            }
-        }
-        return false;
-    }
-    
-    bool addItem(const char* id, const char* name, float price, int stock) {
-        if (_items.size() >= MAX_ITEMS) return false;
-        Item item;
-        item.id = id;
-        item.name = name;
-        item.price = price;
-        item.initialStock = stock;
-        _items.push_back(item);
-        saveData();
-        return true;
-    }
-    
-    bool removeItem(const char* id) {
-        String idStr = id;
-        auto it = _items.begin();
-        while (it != _items.end()) {
-            if (it->id == idStr) {
-                it = _items.erase(it);
-                removeConsumptionByItem(id);
-                removePaymentsByItem(id);
-                saveData();
-                return true;
-            } else {
-                ++it;
-            }
-        }
-        return false;
-    }
-    
-    bool updateItemStock(const char* id, int stock) {
-        String idStr = id;
-        for (auto& item : _items) {
-            if (item.id == idStr) {
-                item.initialStock = stock;
-                saveData();
-                return true;
-            }
-        }
-        return false;
-    }
-    
-    int getAvailableStock(const char* itemId) {
-        String idStr = itemId;
-        int initialStock = 0;
-        for (const auto& item : _items) {
-            if (item.id == idStr) {
-                initialStock = item.initialStock;
-                break;
-            }
-        }
-        int consumed = 0;
-        for (const auto& record : _consumption) {
-            if (record.itemId == idStr) {
-                consumed += record.quantity;
-            }
-        }
-        return initialStock - consumed;
-    }
-    
-    bool addConsumption(const char* id, const char* userId, const char* itemId, int quantity) {
-        if (_consumption.size() >= MAX_CONSUMPTION_RECORDS) return false;
-        ConsumptionRecord record;
-        record.id = id;
-        record.userId = userId;
-        record.itemId = itemId;
-        record.quantity = quantity;
-        record.timestamp = String(millis());
-        _consumption.push_back(record);
-        saveData();
-        return true;
-    }
-    
-    bool removeConsumption(const char* id) {
-        String idStr = id;
-        auto it = _consumption.begin();
-        while (it != _consumption.end()) {
-            if (it->id == idStr) {
-                it = _consumption.erase(it);
-                saveData();
-                return true;
-            } else {
-                ++it;
-            }
-        }
-        return false;
-    }
-    
-    void removeConsumptionByUser(const char* userId) {
-        String idStr = userId;
-        auto it = _consumption.begin();
-        while (it != _consumption.end()) {
-            if (it->userId == idStr) {
-                it = _consumption.erase(it);
-            } else {
-                ++it;
-            }
-        }
-    }
-    
-    void removeConsumptionByItem(const char* itemId) {
-        String idStr = itemId;
-        auto it = _consumption.begin();
-        while (it != _consumption.end()) {
-            if (it->itemId == idStr) {
-                it = _consumption.erase(it);
-            } else {
-                ++it;
-            }
-        }
-    }
-    
-    bool addPayment(const char* id, const char* userId, const char* itemId, float amount) {
-        if (_payments.size() >= MAX_PAYMENT_RECORDS) return false;
-        PaymentRecord payment;
-        payment.id = id;
-        payment.userId = userId;
-        payment.itemId = itemId;
-        payment.amount = amount;
-        payment.timestamp = String(millis());
-        _payments.push_back(payment);
-        saveData();
-        return true;
-    }
-    
-    void removePaymentsByUser(const char* userId) {
-        String idStr = userId;
-        auto it = _payments.begin();
-        while (it != _payments.end()) {
-            if (it->userId == idStr) {
-                it = _payments.erase(it);
-            } else {
-                ++it;
-            }
-        }
-    }
-    
-    void removePaymentsByItem(const char* itemId) {
-        String idStr = itemId;
-        auto it = _payments.begin();
-        while (it != _payments.end()) {
-            if (it->itemId == idStr) {
-                it = _payments.erase(it);
-            } else {
-                ++it;
-            }
-        }
-    }
-    
-    void reset() {
-        _users.clear();
-        _items.clear();
-        _consumption.clear();
-        _payments.clear();
-        saveData();
-    }
-
-private:
-    Preferences _prefs;
-    std::vector<User> _users;
-    std::vector<Item> _items;
-    std::vector<ConsumptionRecord> _consumption;
-    std::vector<PaymentRecord> _payments;
-    
-    void loadData() {
-        String stateJson = _prefs.getString("state", "{}");
-        if (stateJson == "{}") return;
-        
-        DynamicJsonDocument doc(16384);
-        DeserializationError error = deserializeJson(doc, stateJson);
-        if (error) return;
-        
-        JsonArray usersArray = doc["users"].as<JsonArray>();
-        for (JsonObject userObj : usersArray) {
-            User user;
-            user.id = userObj["id"].as<String>();
-            user.name = userObj["name"].as<String>();
-            _users.push_back(user);
-        }
-        
-        JsonArray itemsArray = doc["items"].as<JsonArray>();
-        for (JsonObject itemObj : itemsArray) {
-            Item item;
-            item.id = itemObj["id"].as<String>();
-            item.name = itemObj["name"].as<String>();
-            item.price = itemObj["price"].as<float>();
-            item.initialStock = itemObj["initialStock"].as<int>();
-            _items.push_back(item);
-        }
-        
-        JsonArray consumptionArray = doc["consumption"].as<JsonArray>();
-        for (JsonObject recObj : consumptionArray) {
-            ConsumptionRecord record;
-            record.id = recObj["id"].as<String>();
-            record.userId = recObj["userId"].as<String>();
-            record.itemId = recObj["itemId"].as<String>();
-            record.quantity = recObj["quantity"].as<int>();
-            record.timestamp = recObj["timestamp"].as<String>();
-            _consumption.push_back(record);
-        }
-        
-        JsonArray paymentsArray = doc["payments"].as<JsonArray>();
-        for (JsonObject payObj : paymentsArray) {
-            PaymentRecord payment;
-            payment.id = payObj["id"].as<String>();
-            payment.userId = payObj["userId"].as<String>();
-            payment.itemId = payObj["itemId"].as<String>();
-            payment.amount = payObj["amount"].as<float>();
-            payment.timestamp = payObj["timestamp"].as<String>();
-            _payments.push_back(payment);
-        }
-    }
-    
-    void saveData() {
-        String stateJson = getStateJson();
-        _prefs.putString("state", stateJson);
-    }
-};
+#include "data_storage.h"
 
 // Test instance
 DataStorage* storage = nullptr;
@@ -553,6 +208,23 @@ void test_remove_consumption_success(void) {
     TEST_ASSERT_EQUAL(100, storage->getAvailableStock("item1"));
 }
 
+void test_remove_consumption_keeps_order(void) {
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 100);
+    storage->addConsumption("cons1", "user1", "item1", 1);
+    storage->addConsumption("cons2", "user1", "item1", 1);
+    storage->addConsumption("cons3", "user1", "item1", 1);
+    
+    TEST_ASSERT_TRUE(storage->removeConsumption("cons1"));
+    
+    DynamicJsonDocument doc(4096);
+    TEST_ASSERT_FALSE(deserializeJson(doc, storage->getStateJson()));
+    JsonArray consumption = doc["consumption"];
+    TEST_ASSERT_EQUAL(2, consumption.size());
+    TEST_ASSERT_EQUAL_STRING("cons2", consumption[0]["id"]);
+    TEST_ASSERT_EQUAL_STRING("cons3", consumption[1]["id"]);
+}
+
 void test_remove_nonexistent_consumption(void) {
     bool result = storage->removeConsumption("nonexistent");
     TEST_ASSERT_FALSE(result);
@@ -728,6 +400,7 @@ void setup() {
     RUN_TEST(test_add_consumption_success);
     RUN_TEST(test_add_multiple_consumptions);
     RUN_TEST(test_remove_consumption_success);
+    RUN_TEST(test_remove_consumption_keeps_order);
     RUN_TEST(test_remove_nonexistent_consumption);
     
     // Payment tests
@@ -0,0 +1,248 @@
+/**
+ * Unit Tests for FlashWear
+ * 
+ * Checks the entry layout and the lifetime projection, and compares
+ * the estimates DataStorage keeps under a synthetic workload with what
+ * NvsEmulator, behind the native Preferences, counts for the same
+ * writes. Runs on [env:native] only.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <Preferences.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_wear"
+
+#include "data_storage.h"
+#include "flash_wear.h"
+
+void setUp(void) {
+    Preferences prefs;
+    prefs.begin(NVS_NAMESPACE, false, STORAGE_PARTITION);
+    prefs.clear();
+    prefs.end();
+    NvsEmulator::instance(STORAGE_PARTITION).reset();
+}
+
+void tearDown(void) {
+    setUp();
+}
+
+// Consumption churn over a small state: n changes, each its own log
+// entry, with a snapshot every STORAGE_LOG_MAX_ENTRIES
+void runWorkload(DataStorage& storage, int changes) {
+    char id[16];
+    for (int i = 0; i < 10; i++) {
+        snprintf(id, sizeof(id), "u%d", i);
+        storage.addUser(id, "Colleague");
+    }
+    storage.addItem("item1", "Mate Classic", 1.50, 10000);
+    for (int i = 0; i < changes; i++) {
+        char userId[16];
+        snprintf(id, sizeof(id), "c%d", i);
+        snprintf(userId, sizeof(userId), "u%d", i % 10);
+        storage.addConsumption(id, userId, "item1", 1);
+        if (i >= 40) {
+            snprintf(id, sizeof(id), "c%d", i - 40);
+            storage.removeConsumption(id);
+        }
+    }
+}
+
+// Every collection at its MAX_*, with ids and names of the longest
+// length allowed, so snapshots are as large as they get
+void fillToCapacity(DataStorage& storage) {
+    char id[MAX_ID_LENGTH + 1];
+    char name[MAX_NAME_LENGTH + 1];
+    for (int i = 0; i < MAX_USERS; i++) {
+        snprintf(id, sizeof(id), "u%010d", i);
+        snprintf(name, sizeof(name), "Colleague %-21d", i);
+        TEST_ASSERT_TRUE(storage.addUser(id, name));
+    }
+    for (int i = 0; i < MAX_ITEMS; i++) {
+        snprintf(id, sizeof(id), "i%010d", i);
+        snprintf(name, sizeof(name), "Item %-26d", i);
+        TEST_ASSERT_TRUE(storage.addItem(id, name, 1.5, 100000));
+    }
+    for (int i = 0; i < MAX_CONSUMPTION_RECORDS; i++) {
+        snprintf(id, sizeof(id), "c%010d", i);
+        TEST_ASSERT_TRUE(storage.addConsumption(id, "u0000000001", "i0000000001", 1));
+    }
+    for (int i = 0; i < MAX_PAYMENT_RECORDS; i++) {
+        snprintf(id, sizeof(id), "p%010d", i);
+        TEST_ASSERT_TRUE(storage.addPayment(id, "u0000000001", "i0000000001", 1.5));
+    }
+}
+
+// Within tolerance (percent) of what the emulator counted
+void assertClose(uint64_t expected, uint64_t actual, int tolerance, const char* what) {
+    char message[96];
+    snprintf(message, sizeof(message), "%s: emulator %llu, estimate %llu", what,
+        (unsigned long long)expected, (unsigned long long)actual);
+    TEST_MESSAGE(message);
+    uint64_t difference = expected > actual ? expected - actual : actual - expected;
+    TEST_ASSERT_TRUE_MESSAGE(difference * 100 <= expected * tolerance, message);
+}
+
+// ============================================
+// Layout Tests
+// ============================================
+
+void test_entries_per_value(void) {
+    // A header, and the data with its terminating zero
+    TEST_ASSERT_EQUAL(2, FlashWear::stringEntries(0));
+    TEST_ASSERT_EQUAL(2, FlashWear::stringEntries(31));
+    TEST_ASSERT_EQUAL(3, FlashWear::stringEntries(32));
+    TEST_ASSERT_EQUAL(3, FlashWear::blobEntries(sizeof(uint64_t) * 6));
+    
+    // Longer than a page: chunks of a header and 125 entries, and an index
+    TEST_ASSERT_EQUAL(126, FlashWear::blobEntries(125 * NVS_ENTRY_SIZE));
+    TEST_ASSERT_EQUAL(129, FlashWear::blobEntries(126 * NVS_ENTRY_SIZE));
+    TEST_ASSERT_EQUAL(NvsEmulator::stringEntries(5000), FlashWear::stringEntries(5000));
+}
+
+void test_partition_size(void) {
+    TEST_ASSERT_EQUAL(NvsEmulator::instance(STORAGE_PARTITION).getPageCount(), FlashWear::getPageCount());
+}
+
+void test_erases_start_past_free_pages(void) {
+    FlashWear wear;
+    NvsEmulator emulator;
+    wear.begin(0);
+    
+    // Each value fills a page; the reserved page aside, the partition
+    // takes one per page before the first has to be erased
+    for (size_t i = 0; i < FlashWear::getPageCount() + 3; i++) {
+        wear.record("key", 4000, NVS_PAGE_ENTRIES, 0);
+        emulator.write("ns/key", NVS_PAGE_ENTRIES);
+        TEST_ASSERT_EQUAL(emulator.getPageErases(), wear.getPagesErased());
+    }
+    TEST_ASSERT_EQUAL(4, wear.getPagesErased());
+    TEST_ASSERT_TRUE(wear.getEntriesMoved() == 0);
+}
+
+// ============================================
+// Projection Tests
+// ============================================
+
+void test_projection(void) {
+    FlashWear wear;
+    wear.begin(0);
+    TEST_ASSERT_EQUAL_FLOAT(-1, wear.getLifetimeYears(1000));
+    
+    // A page's worth an hour, once for every page
+    uint32_t pages = FlashWear::getPageCount();
+    for (uint32_t i = 1; i <= pages * NVS_PAGE_ENTRIES; i++) {
+        wear.record("log0", 40, 1, i * (3600000 / NVS_PAGE_ENTRIES));
+    }
+    uint32_t hour = pages * 3600000;
+    TEST_ASSERT_FLOAT_WITHIN(0.5, NVS_PAGE_ENTRIES, wear.getWritesPerHour(hour));
+    
+    // The pages, rated FLASH_ENDURANCE_CYCLES each, one erased an hour
+    float years = (float)FlashWear::getPageCount() * FLASH_ENDURANCE_CYCLES / (24 * 365.0f);
+    TEST_ASSERT_FLOAT_WITHIN(years * 0.01, years, wear.getLifetimeYears(hour));
+    TEST_ASSERT_EQUAL(1, wear.getPagesErased());
+}
+
+void test_uptime_across_wrap(void) {
+    FlashWear wear;
+    wear.begin(0xFFFFF000);
+    wear.advance(0x1000);
+    TEST_ASSERT_TRUE(wear.getUptimeMs(0x2000) == 0x3000);
+}
+
+// ============================================
+// Workload Tests
+// ============================================
+
+void test_workload_matches_emulator(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    runWorkload(storage, 1500);
+    
+    const FlashWear& wear = storage.getFlashWear();
+    NvsEmulator& nvs = NvsEmulator::instance(STORAGE_PARTITION);
+    TEST_ASSERT_EQUAL(0, nvs.getOverflows());
+    TEST_ASSERT_TRUE(nvs.getEntriesWritten() == wear.getEntriesWritten());
+    TEST_ASSERT_GREATER_THAN(10, nvs.getPageErases());
+    assertClose(nvs.getPageErases(), wear.getPagesErased(), 15, "pages erased");
+    assertClose(nvs.getBytesWritten(), wear.getPhysicalBytes(), 15, "physical bytes");
+    TEST_ASSERT_TRUE(wear.getLogicalBytes() == storage.getBytesWritten());
+}
+
+void test_counters_survive_restart(void) {
+    uint32_t writes;
+    uint64_t logicalBytes;
+    {
+        DataStorage storage(true, false);
+        storage.begin();
+        runWorkload(storage, 100);
+        writes = storage.getFlashWear().getWrites();
+        logicalBytes = storage.getFlashWear().getLogicalBytes();
+    }
+    
+    // The counters were saved on the way out, their own write included
+    DataStorage storage(true, false);
+    storage.begin();
+    const FlashWear& wear = storage.getFlashWear();
+    TEST_ASSERT_EQUAL(writes + 1, wear.getWrites());
+    TEST_ASSERT_TRUE(wear.getLogicalBytes() == logicalBytes + sizeof(FlashWear::Record));
+    
+    storage.addUser("late", "Late Colleague");
+    TEST_ASSERT_EQUAL(writes + 2, wear.getWrites());
+}
+
+void test_full_storage_fits(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    fillToCapacity(storage);
+    storage.compact();
+    
+    // Churn at capacity: a log entry per change, and a snapshot of
+    // everything every STORAGE_LOG_MAX_ENTRIES, each written next to
+    // the one before
+    char id[MAX_ID_LENGTH + 1];
+    for (int i = 0; i < 4 * STORAGE_LOG_MAX_ENTRIES; i++) {
+        snprintf(id, sizeof(id), "c%010d", i);
+        TEST_ASSERT_TRUE(storage.removeConsumption(id));
+        snprintf(id, sizeof(id), "n%010d", i);
+        TEST_ASSERT_TRUE(storage.addConsumption(id, "u0000000001", "i0000000001", 1));
+    }
+    String expected = storage.getStateJson();
+    
+    NvsEmulator& nvs = NvsEmulator::instance(STORAGE_PARTITION);
+    TEST_ASSERT_EQUAL(0, nvs.getOverflows());
+    TEST_ASSERT_GREATER_THAN(0, nvs.getPageErases());
+    
+    DataStorage reloaded(true, false);
+    TEST_ASSERT_TRUE(reloaded.begin());
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_entries_per_value);
+    RUN_TEST(test_partition_size);
+    RUN_TEST(test_erases_start_past_free_pages);
+    RUN_TEST(test_projection);
+    RUN_TEST(test_uptime_across_wrap);
+    RUN_TEST(test_workload_matches_emulator);
+    RUN_TEST(test_counters_survive_restart);
+    RUN_TEST(test_full_storage_fits);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
@@ -0,0 +1,184 @@
+/**
+ * Unit Tests for DataStorage group commit
+ * 
+ * Checks that changes made in quick succession are written to NVS
+ * together, after the quiet period, on the byte budget, or on an
+ * explicit flush, and that nothing is lost across a reload.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_commit"
+
+#include "data_storage.h"
+
+void clearStorage() {
+    DataStorage storage;
+    storage.begin();
+    storage.reset();
+}
+
+void setUp(void) {
+    clearStorage();
+}
+
+void tearDown(void) {
+    clearStorage();
+}
+
+// A burst of requests from a group of colleagues
+void recordBurst(DataStorage& storage, int count) {
+    char id[16];
+    for (int i = 0; i < count; i++) {
+        snprintf(id, sizeof(id), "c%d", i);
+        storage.addConsumption(id, "user1", "item1", 1);
+    }
+}
+
+// ============================================
+// Flush Trigger Tests
+// ============================================
+
+void test_changes_grouped_until_quiet_period(void) {
+    DataStorage storage(true, true);
+    storage.begin();
+    size_t bytesBefore = storage.getBytesWritten();
+    uint32_t flushesBefore = storage.getFlushCount();
+    
+    storage.addUser("user1", "Alice");
+    storage.addItem("item1", "Coffee", 2.50, 100);
+    recordBurst(storage, 5);
+    
+    // Nothing written yet
+    storage.tick();
+    TEST_ASSERT_EQUAL(bytesBefore, storage.getBytesWritten());
+    TEST_ASSERT_EQUAL(7, storage.getPendingChanges());
+    
+    delay(STORAGE_COMMIT_QUIET_MS + 10);
+    storage.tick();
+    
+    TEST_ASSERT_EQUAL(0, storage.getPendingChanges());
+    TEST_ASSERT_EQUAL(flushesBefore + 1, storage.getFlushCount());
+    TEST_ASSERT_EQUAL(6, storage.getFlushesAvoided());
+    TEST_ASSERT_EQUAL(1, storage.getLogLength());
+}
+
+void test_byte_budget_forces_write(void) {
+    DataStorage storage(true, true);
+    storage.begin();
+    storage.addUser("user1", "Alice");
+    storage.addItem("item1", "Coffee", 2.50, 1000);
+    recordBurst(storage, 60);
+    
+    // Written without tick(), in entries no larger than the budget allows
+    TEST_ASSERT_GREATER_THAN(1, storage.getLogLength());
+    TEST_ASSERT_LESS_THAN(62, storage.getPendingChanges() + storage.getLogLength());
+}
+
+void test_reset_writes_immediately(void) {
+    {
+        DataStorage storage(true, true);
+        storage.begin();
+        storage.addUser("user1", "Alice");
+        storage.reset();
+        TEST_ASSERT_EQUAL(0, storage.getPendingChanges());
+    }
+    
+    DataStorage reloaded(true, true);
+    reloaded.begin();
+    TEST_ASSERT_FALSE(reloaded.userExists("Alice"));
+}
+
+// ============================================
+// Reload Tests
+// ============================================
+
+void test_flush_then_reload(void) {
+    DataStorage storage(true, true);
+    storage.begin();
+    storage.addUser("user1", "Alice");
+    storage.addItem("item1", "Coffee", 2.50, 100);
+    recordBurst(storage, 10);
+    storage.removeConsumption("c3");
+    storage.addPayment("pay1", "user1", "item1", 5.00);
+    storage.flush();
+    
+    DataStorage reloaded(true, true);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(storage.getStateJson().c_str(), reloaded.getStateJson().c_str());
+    TEST_ASSERT_EQUAL(91, reloaded.getAvailableStock("item1"));
+}
+
+void test_destructor_flushes(void) {
+    String expected;
+    {
+        DataStorage storage(true, true);
+        storage.begin();
+        storage.addUser("user1", "Alice");
+        storage.addItem("item1", "Coffee", 2.50, 100);
+        recordBurst(storage, 3);
+        expected = storage.getStateJson();
+    }
+    
+    DataStorage reloaded(true, true);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+}
+
+// ============================================
+// Bytes Written Tests
+// ============================================
+
+// Bytes written for a burst of 20 consumptions in snapshot mode
+size_t snapshotBurstBytes(bool groupCommit) {
+    DataStorage storage(false, groupCommit);
+    storage.begin();
+    storage.addUser("user1", "Alice");
+    storage.addItem("item1", "Coffee", 2.50, 100);
+    
+    size_t before = storage.getBytesWritten();
+    recordBurst(storage, 20);
+    storage.flush();
+    return storage.getBytesWritten() - before;
+}
+
+void test_group_commit_writes_less_in_snapshot_mode(void) {
+    size_t direct = snapshotBurstBytes(false);
+    clearStorage();
+    size_t grouped = snapshotBurstBytes(true);
+    
+    char message[96];
+    snprintf(message, sizeof(message), "20 consumptions, snapshot mode: direct %u bytes, grouped %u bytes",
+        (unsigned)direct, (unsigned)grouped);
+    TEST_MESSAGE(message);
+    
+    TEST_ASSERT_LESS_THAN(direct / 10, grouped);
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_changes_grouped_until_quiet_period);
+    RUN_TEST(test_byte_budget_forces_write);
+    RUN_TEST(test_reset_writes_immediately);
+    RUN_TEST(test_flush_then_reload);
+    RUN_TEST(test_destructor_flushes);
+    RUN_TEST(test_group_commit_writes_less_in_snapshot_mode);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
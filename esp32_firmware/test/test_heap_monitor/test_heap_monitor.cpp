@@ -0,0 +1,144 @@
+/**
+ * Unit Tests for HeapMonitor and AllocTrace
+ * 
+ * Checks the heap lows and the fragmentation figure, and that
+ * allocations are counted against the subsystem tagged on the task
+ * that makes them. Allocations are fed to AllocTrace::count() by hand;
+ * the firmware gets them from its malloc wraps.
+ */
+
+#define ALLOC_TRACING 1
+
+#include <unity.h>
+#include <Arduino.h>
+#include <thread>
+
+#include "heap_monitor.h"
+
+HeapMonitor* monitor = nullptr;
+
+// Collects what is printed
+class TextPrint : public Print {
+public:
+    String text;
+    size_t write(uint8_t c) override {
+        text += (char)c;
+        return 1;
+    }
+};
+
+void setUp(void) {
+    monitor = new HeapMonitor();
+    AllocTrace::begin();
+    AllocTrace::clear();
+}
+
+void tearDown(void) {
+    delete monitor;
+    monitor = nullptr;
+}
+
+// ============================================
+// Heap Tests
+// ============================================
+
+void test_lows_kept(void) {
+    monitor->update(100000, 60000, 90000);
+    monitor->update(80000, 20000, 70000);
+    monitor->update(120000, 50000, 70000);
+    
+    TEST_ASSERT_EQUAL_UINT32(120000, monitor->getFreeHeap());
+    TEST_ASSERT_EQUAL_UINT32(50000, monitor->getLargestBlock());
+    TEST_ASSERT_EQUAL_UINT32(70000, monitor->getMinFreeHeap());
+    TEST_ASSERT_EQUAL_UINT32(20000, monitor->getMinLargestBlock());
+}
+
+void test_fragmentation(void) {
+    monitor->update(100000, 100000, 100000);
+    TEST_ASSERT_EQUAL(0, monitor->getFragmentation());
+    
+    // Plenty free, but in pieces too small for a 16 KB document
+    monitor->update(100000, 12000, 100000);
+    TEST_ASSERT_EQUAL(88, monitor->getFragmentation());
+    
+    monitor->update(0, 0, 0);
+    TEST_ASSERT_EQUAL(0, monitor->getFragmentation());
+}
+
+// ============================================
+// Allocation Tests
+// ============================================
+
+void test_scopes_tag_allocations(void) {
+    AllocTrace::count(10);
+    {
+        AllocScope http(ALLOC_HTTP);
+        AllocTrace::count(100);
+        {
+            AllocScope storage(ALLOC_STORAGE);
+            AllocTrace::count(5);
+        }
+        AllocTrace::count(1);   // Back to HTTP
+    }
+    AllocTrace::count(2);
+    
+    TEST_ASSERT_EQUAL(2, AllocTrace::get(ALLOC_OTHER).count);
+    TEST_ASSERT_TRUE(AllocTrace::get(ALLOC_OTHER).bytes == 12);
+    TEST_ASSERT_EQUAL(2, AllocTrace::get(ALLOC_HTTP).count);
+    TEST_ASSERT_TRUE(AllocTrace::get(ALLOC_HTTP).bytes == 101);
+    TEST_ASSERT_EQUAL(1, AllocTrace::get(ALLOC_STORAGE).count);
+    TEST_ASSERT_EQUAL(0, AllocTrace::get(ALLOC_JSON).count);
+}
+
+void test_tags_per_task(void) {
+    AllocScope json(ALLOC_JSON);
+    
+    // Another task's allocations are not this task's subsystem's
+    std::thread other([]() {
+        AllocTrace::count(7);
+        AllocScope storage(ALLOC_STORAGE);
+        AllocTrace::count(3);
+    });
+    other.join();
+    AllocTrace::count(4);
+    
+    TEST_ASSERT_EQUAL(1, AllocTrace::get(ALLOC_OTHER).count);
+    TEST_ASSERT_EQUAL(1, AllocTrace::get(ALLOC_STORAGE).count);
+    TEST_ASSERT_EQUAL(1, AllocTrace::get(ALLOC_JSON).count);
+}
+
+void test_dump(void) {
+    monitor->update(100000, 50000, 90000);
+    {
+        AllocScope json(ALLOC_JSON);
+        AllocTrace::count(2048);
+    }
+    
+    TextPrint out;
+    monitor->dump(out);
+    TEST_ASSERT_TRUE(out.text.indexOf("largest block 50000") >= 0);
+    TEST_ASSERT_TRUE(out.text.indexOf("fragmentation 50%") >= 0);
+    TEST_ASSERT_TRUE(out.text.indexOf("json 1 (2 KB)") >= 0);
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_lows_kept);
+    RUN_TEST(test_fragmentation);
+    RUN_TEST(test_scopes_tag_allocations);
+    RUN_TEST(test_tags_per_task);
+    RUN_TEST(test_dump);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
@@ -0,0 +1,291 @@
+/**
+ * Unit Tests for IdIndex
+ * 
+ * Checks the index against a linear scan through random insert/erase
+ * sequences, checks case-folded name and composite key lookups, and times lookups at growing collection sizes to show
+ * that indexed lookup cost stays flat while a scan grows linearly.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <vector>
+
+#include "config.h"
+#include "id_index.h"
+
+#define BENCH_CAPACITY 1024
+#define BENCH_LOOKUPS 20000
+
+struct TestRecord {
+    char id[MAX_ID_LENGTH + 1];
+};
+
+struct NamedRecord {
+    char id[MAX_ID_LENGTH + 1];
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+// Keyed by two fields together, as the balance ledger is
+struct PairRecord {
+    char first[MAX_ID_LENGTH + 1];
+    char second[MAX_ID_LENGTH + 1];
+};
+
+struct Pair {
+    const char* first;
+    const char* second;
+};
+
+struct PairKey {
+    static Pair of(const PairRecord& record) { return {record.first, record.second}; }
+    static uint32_t hash(const Pair& key) { return IdKey::hash(key.first) ^ IdKey::hash(key.second); }
+    static bool equal(const Pair& a, const Pair& b) {
+        return strcmp(a.first, b.first) == 0 && strcmp(a.second, b.second) == 0;
+    }
+};
+
+std::vector<TestRecord> records;
+
+// Small deterministic generator so failures are reproducible
+uint32_t rngState = 1;
+uint32_t nextRandom(uint32_t range) {
+    rngState = rngState * 1103515245UL + 12345UL;
+    return (rngState >> 16) % range;
+}
+
+TestRecord makeRecord(uint32_t n) {
+    TestRecord record;
+    // Same shape as the millis() ids the web handlers generate
+    snprintf(record.id, sizeof(record.id), "%lu", 1700000000UL + n);
+    return record;
+}
+
+int linearFind(const char* id) {
+    for (size_t slot = 0; slot < records.size(); slot++) {
+        if (strcmp(records[slot].id, id) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void setUp(void) {
+    records.clear();
+    records.reserve(BENCH_CAPACITY);
+}
+
+void tearDown(void) {
+    records.clear();
+}
+
+// ============================================
+// Consistency Tests
+// ============================================
+
+void test_find_after_add(void) {
+    IdIndex<TestRecord, 50> index(records);
+    for (uint32_t i = 0; i < 50; i++) {
+        index.add(makeRecord(i));
+    }
+    
+    for (uint32_t i = 0; i < 50; i++) {
+        TEST_ASSERT_EQUAL(i, index.find(makeRecord(i).id));
+    }
+    TEST_ASSERT_EQUAL(-1, index.find("missing"));
+}
+
+void test_remove_at_keeps_order(void) {
+    IdIndex<TestRecord, 20> index(records);
+    for (uint32_t i = 0; i < 20; i++) {
+        index.add(makeRecord(i));
+    }
+    
+    index.removeAt(index.find(makeRecord(5).id));
+    index.removeAt(index.find(makeRecord(0).id));
+    
+    TEST_ASSERT_EQUAL(18, records.size());
+    TEST_ASSERT_EQUAL_STRING(makeRecord(1).id, records[0].id);
+    TEST_ASSERT_EQUAL(-1, index.find(makeRecord(5).id));
+    for (size_t slot = 0; slot < records.size(); slot++) {
+        TEST_ASSERT_EQUAL(slot, index.find(records[slot].id));
+    }
+}
+
+void test_random_operations_match_linear_scan(void) {
+    IdIndex<TestRecord, 200> index(records);
+    rngState = 7;
+    
+    for (int i = 0; i < 5000; i++) {
+        TestRecord record = makeRecord(nextRandom(400));
+        int slot = index.find(record.id);
+        TEST_ASSERT_EQUAL(linearFind(record.id), slot);
+        
+        if (slot < 0 && records.size() < 200) {
+            index.add(record);
+        } else if (slot >= 0) {
+            if (nextRandom(2)) {
+                index.swapRemoveAt(slot);
+            } else {
+                index.removeAt(slot);
+            }
+        }
+    }
+    
+    for (uint32_t n = 0; n < 400; n++) {
+        TestRecord record = makeRecord(n);
+        TEST_ASSERT_EQUAL(linearFind(record.id), index.find(record.id));
+    }
+}
+
+void test_duplicate_ids(void) {
+    IdIndex<TestRecord, 20> index(records);
+    index.add(makeRecord(1));
+    index.add(makeRecord(1));
+    index.add(makeRecord(2));
+    
+    index.swapRemoveAt(index.find(makeRecord(1).id));
+    TEST_ASSERT_EQUAL(2, records.size());
+    TEST_ASSERT_NOT_EQUAL(-1, index.find(makeRecord(1).id));
+    
+    index.swapRemoveAt(index.find(makeRecord(1).id));
+    TEST_ASSERT_EQUAL(-1, index.find(makeRecord(1).id));
+    TEST_ASSERT_EQUAL(0, index.find(makeRecord(2).id));
+}
+
+void test_overflow_falls_back_to_scan(void) {
+    IdIndex<TestRecord, 4> index(records);
+    // More records than the table was sized for, as after lowering a MAX_*
+    for (uint32_t i = 0; i < 12; i++) {
+        index.add(makeRecord(i));
+    }
+    for (uint32_t i = 0; i < 12; i++) {
+        TEST_ASSERT_EQUAL(i, index.find(makeRecord(i).id));
+    }
+    
+    index.removeAt(0);
+    TEST_ASSERT_EQUAL(0, index.find(makeRecord(1).id));
+}
+
+void test_folded_name_lookup(void) {
+    std::vector<NamedRecord> named;
+    IdIndex<NamedRecord, 20, FoldedNameKey> index(named);
+    const char* names[] = {"Alice", "Bob", "Club-Mate", "Tea"};
+    for (int i = 0; i < 4; i++) {
+        NamedRecord record;
+        snprintf(record.id, sizeof(record.id), "n%d", i);
+        snprintf(record.name, sizeof(record.name), "%s", names[i]);
+        index.add(record);
+    }
+    
+    // Same answers as strcasecmp over every stored name
+    TEST_ASSERT_EQUAL(0, index.findName("ALICE"));
+    TEST_ASSERT_EQUAL(2, index.findName("club-mate"));
+    TEST_ASSERT_EQUAL(-1, index.findName("Alic"));
+    TEST_ASSERT_EQUAL(-1, index.findName("Club Mate"));
+    
+    index.removeAt(index.find("n1"));
+    TEST_ASSERT_EQUAL(-1, index.findName("bob"));
+    TEST_ASSERT_EQUAL(2, index.findName("tea"));
+    
+    index.swapRemoveAt(index.findName("alice"));
+    TEST_ASSERT_EQUAL(-1, index.findName("Alice"));
+    TEST_ASSERT_EQUAL(0, index.findName("TEA"));
+    TEST_ASSERT_EQUAL(0, index.find("n3"));
+}
+
+void test_composite_key_lookup(void) {
+    std::vector<PairRecord> pairs;
+    IdIndex<PairRecord, 20, NoKey, PairKey> index(pairs);
+    const char* halves[] = {"u1", "i1", "u1", "i2", "u2", "i1"};
+    for (int i = 0; i < 3; i++) {
+        PairRecord record;
+        snprintf(record.first, sizeof(record.first), "%s", halves[2 * i]);
+        snprintf(record.second, sizeof(record.second), "%s", halves[2 * i + 1]);
+        index.add(record);
+    }
+    
+    Pair u1i2 = {"u1", "i2"};
+    Pair u2i2 = {"u2", "i2"};
+    Pair u2i1 = {"u2", "i1"};
+    TEST_ASSERT_EQUAL(1, index.find(u1i2));
+    TEST_ASSERT_EQUAL(-1, index.find(u2i2));
+    
+    index.removeAt(0);
+    TEST_ASSERT_EQUAL(0, index.find(u1i2));
+    TEST_ASSERT_EQUAL(1, index.find(u2i1));
+}
+
+// ============================================
+// Benchmark
+// ============================================
+
+// Average nanoseconds per lookup of ids that are present
+float timeLookups(IdIndex<TestRecord, BENCH_CAPACITY>& index, bool indexed) {
+    volatile int sink = 0;
+    uint32_t start = micros();
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+        const char* id = records[nextRandom(records.size())].id;
+        sink += indexed ? index.find(id) : linearFind(id);
+    }
+    uint32_t elapsed = micros() - start;
+    (void)sink;
+    return elapsed * 1000.0f / BENCH_LOOKUPS;
+}
+
+void test_lookup_cost_is_flat(void) {
+    IdIndex<TestRecord, BENCH_CAPACITY> index(records);
+    float firstIndexed = 0;
+    float lastIndexed = 0;
+    float lastLinear = 0;
+    
+    for (uint32_t size = 16; size <= BENCH_CAPACITY; size *= 4) {
+        while (records.size() < size) {
+            index.add(makeRecord(records.size()));
+        }
+        
+        rngState = size;
+        float indexed = timeLookups(index, true);
+        rngState = size;
+        float linear = timeLookups(index, false);
+        
+        char message[96];
+        snprintf(message, sizeof(message), "%4u records: index %.1f ns/lookup, scan %.1f ns/lookup",
+            (unsigned)size, indexed, linear);
+        TEST_MESSAGE(message);
+        
+        if (firstIndexed == 0) {
+            firstIndexed = indexed;
+        }
+        lastIndexed = indexed;
+        lastLinear = linear;
+    }
+    
+    TEST_ASSERT_LESS_THAN_FLOAT(lastLinear, lastIndexed);
+    // 64x more records, roughly the same cost per lookup
+    TEST_ASSERT_LESS_THAN_FLOAT(firstIndexed * 4, lastIndexed);
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_find_after_add);
+    RUN_TEST(test_remove_at_keeps_order);
+    RUN_TEST(test_random_operations_match_linear_scan);
+    RUN_TEST(test_duplicate_ids);
+    RUN_TEST(test_overflow_falls_back_to_scan);
+    RUN_TEST(test_folded_name_lookup);
+    RUN_TEST(test_composite_key_lookup);
+    RUN_TEST(test_lookup_cost_is_flat);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
@@ -0,0 +1,178 @@
+/**
+ * Unit Tests for JsonPool and constant error bodies
+ * 
+ * Counts every malloc, calloc and realloc while requests are parsed,
+ * validated and answered with errors, to check that the pooled path
+ * takes nothing from the heap once warmed up. Needs the linker flags of
+ * env:esp32c3_alloc_test (-Wl,--wrap=malloc and so on).
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_json_pool"
+
+#include "data_storage.h"
+#include "api_operations.h"
+#include "json_pool.h"
+
+#define STEADY_STATE_REQUESTS 100
+
+// ============================================
+// Allocation Counting
+// ============================================
+
+volatile uint32_t allocations = 0;
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+}
+
+DataStorage* storage = nullptr;
+JsonPool* pool = nullptr;
+
+void setUp(void) {
+    storage = new DataStorage(true, false);
+    storage->begin();
+    storage->reset();
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 1);
+    pool = new JsonPool();
+}
+
+void tearDown(void) {
+    delete pool;
+    pool = nullptr;
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+// What a POST /api/consumption handler does up to its response
+const char* handleConsumption(char* body, size_t length) {
+    JsonPool::Document doc(*pool);
+    if (deserializeJson(*doc, body, length)) {
+        return API_ERROR("Invalid JSON").body;
+    }
+    OperationResult result = addConsumptionOperation(*storage, doc->as<JsonObject>());
+    return result.error.body;
+}
+
+// ============================================
+// Pool Tests
+// ============================================
+
+void test_error_path_allocates_nothing(void) {
+    const char* request = "{\"userId\":\"user1\",\"itemId\":\"item1\",\"quantity\":5}";
+    char body[64];
+    
+    // Warm up, then count
+    strcpy(body, request);
+    handleConsumption(body, strlen(body));
+    
+    uint32_t before = allocations;
+    const char* response = nullptr;
+    for (int i = 0; i < STEADY_STATE_REQUESTS; i++) {
+        strcpy(body, request);      // Parsed in place
+        response = handleConsumption(body, strlen(body));
+    }
+    uint32_t counted = allocations - before;
+    
+    TEST_ASSERT_EQUAL_STRING("{\"error\":\"Not enough stock\"}", response);
+    TEST_ASSERT_EQUAL(0, counted);
+    TEST_ASSERT_EQUAL(0, pool->getFallbacks());
+}
+
+void test_invalid_json_allocates_nothing(void) {
+    char body[32];
+    strcpy(body, "{\"userId\":");
+    handleConsumption(body, strlen(body));
+    
+    uint32_t before = allocations;
+    strcpy(body, "{\"userId\":");
+    const char* response = handleConsumption(body, strlen(body));
+    
+    TEST_ASSERT_EQUAL_STRING("{\"error\":\"Invalid JSON\"}", response);
+    TEST_ASSERT_EQUAL(0, allocations - before);
+}
+
+void test_heap_document_when_pool_exhausted(void) {
+    JsonPool::Document first(*pool);
+    {
+        JsonPool::Document second(*pool);
+        (*second)["ok"] = true;
+        TEST_ASSERT_EQUAL(0, pool->getFallbacks());
+        
+        JsonPool::Document third(*pool);
+        (*third)["ok"] = true;
+        TEST_ASSERT_EQUAL(1, pool->getFallbacks());
+    }
+    
+    // Back in the pool when released, and cleared
+    JsonPool::Document fourth(*pool);
+    TEST_ASSERT_EQUAL(1, pool->getFallbacks());
+    TEST_ASSERT_TRUE(fourth->isNull());
+}
+
+void test_response_buffers_returned(void) {
+    AsyncWebServerRequest request;
+    StaticJsonDocument<128> doc;
+    doc["ok"] = true;
+    
+    // The server deletes each response once sent, returning its buffer
+    for (int i = 0; i < JSON_POOL_BUFFERS * 3; i++) {
+        TEST_ASSERT_TRUE(pool->send(&request, doc, 200, [](AsyncWebServerResponse*) {}));
+    }
+    TEST_ASSERT_EQUAL(0, pool->getFallbacks());
+    
+    // Too large for a buffer: the caller sends it another way
+    DynamicJsonDocument large(JSON_POOL_BUFFER_SIZE * 2);
+    large["text"] = std::string(JSON_POOL_BUFFER_SIZE, 'x').c_str();
+    TEST_ASSERT_FALSE(pool->send(&request, large, 200, [](AsyncWebServerResponse*) {}));
+    TEST_ASSERT_EQUAL(1, pool->getFallbacks());
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_error_path_allocates_nothing);
+    RUN_TEST(test_invalid_json_allocates_nothing);
+    RUN_TEST(test_heap_document_when_pool_exhausted);
+    RUN_TEST(test_response_buffers_returned);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
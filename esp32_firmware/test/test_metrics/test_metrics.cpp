@@ -0,0 +1,182 @@
+/**
+ * Unit Tests for Metrics
+ * 
+ * Checks the latency buckets, the per-route status counts, and that
+ * the Prometheus exposition comes out the same however small the
+ * buffers it is written into.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <string>
+
+#include "metrics.h"
+
+Metrics* metrics = nullptr;
+
+void setUp(void) {
+    metrics = new Metrics();
+    Metrics::takeStatus();
+}
+
+void tearDown(void) {
+    delete metrics;
+    metrics = nullptr;
+}
+
+// The whole exposition, written into buffers of size bytes
+std::string exposition(size_t size) {
+    std::string text;
+    char buffer[4096];
+    size_t line = 0;
+    while (!metrics->finished(line)) {
+        size_t written = metrics->fill(buffer, size, line);
+        TEST_ASSERT_TRUE(written > 0);
+        text.append(buffer, written);
+    }
+    return text;
+}
+
+bool contains(const std::string& text, const char* line) {
+    return text.find(line) != std::string::npos;
+}
+
+// ============================================
+// Histogram Tests
+// ============================================
+
+void test_histogram_buckets(void) {
+    LatencyHistogram histogram;
+    histogram.record(0);
+    histogram.record(64);           // Bounds are inclusive
+    histogram.record(65);
+    histogram.record(256);
+    histogram.record(257);
+    histogram.record(UINT32_MAX);   // Past the last bound
+    
+    TEST_ASSERT_EQUAL(2, histogram.getBucket(0));
+    TEST_ASSERT_EQUAL(2, histogram.getBucket(1));
+    TEST_ASSERT_EQUAL(1, histogram.getBucket(2));
+    TEST_ASSERT_EQUAL(1, histogram.getBucket(LATENCY_BUCKETS));
+    TEST_ASSERT_EQUAL(6, histogram.getCount());
+    TEST_ASSERT_TRUE(histogram.getSumUs() == 0 + 64 + 65 + 256 + 257 + (uint64_t)UINT32_MAX);
+    TEST_ASSERT_EQUAL_UINT32(16777216, LatencyHistogram::bound(LATENCY_BUCKETS - 1));
+}
+
+// ============================================
+// Request Tests
+// ============================================
+
+void test_requests_counted_by_status(void) {
+    int state = metrics->addRoute("GET", "/api/state");
+    int users = metrics->addRoute("POST", "/api/users");
+    
+    metrics->record(state, 200, 100);
+    metrics->record(state, 304, 50);
+    metrics->record(users, 404, 80);
+    metrics->record(users, 418, 80);  // Not one of ours: "other"
+    metrics->record(-1, 200, 80);     // Route without a slot
+    
+    TEST_ASSERT_EQUAL(2, metrics->getRequests(state));
+    TEST_ASSERT_EQUAL(1, metrics->getRequests(state, 304));
+    TEST_ASSERT_EQUAL(2, metrics->getRequests(users));
+    TEST_ASSERT_EQUAL(1, metrics->getRequests(users, 404));
+    TEST_ASSERT_EQUAL(1, metrics->getRequests(users, 999));
+}
+
+void test_timer_records_noted_status(void) {
+    int route = metrics->addRoute("GET", "/api/state");
+    {
+        RequestTimer timer(metrics, route);
+        Metrics::noteStatus(429);
+    }
+    {
+        RequestTimer timer(metrics, route);     // Nothing sent
+    }
+    
+    TEST_ASSERT_EQUAL(2, metrics->getRequests(route));
+    TEST_ASSERT_EQUAL(1, metrics->getRequests(route, 429));
+    TEST_ASSERT_EQUAL(0, Metrics::takeStatus());
+}
+
+void test_routes_capped(void) {
+    for (int i = 0; i < METRICS_MAX_ROUTES; i++) {
+        TEST_ASSERT_EQUAL(i, metrics->addRoute("GET", "/api/state"));
+    }
+    TEST_ASSERT_EQUAL(-1, metrics->addRoute("GET", "/api/state"));
+}
+
+// ============================================
+// Exposition Tests
+// ============================================
+
+void test_prometheus_exposition(void) {
+    int state = metrics->addRoute("GET", "/api/state");
+    metrics->addRoute("DELETE", "/api/users/{id}");
+    metrics->record(state, 200, 30);
+    metrics->record(state, 200, 70);
+    
+    LatencyHistogram writes;
+    writes.record(1500000);
+    metrics->addStage("nvs_write", writes);
+    
+    std::string text = exposition(4096);
+    TEST_ASSERT_TRUE(contains(text, "# TYPE mate_http_requests_total counter\n"));
+    TEST_ASSERT_TRUE(contains(text,
+        "mate_http_requests_total{method=\"GET\",route=\"/api/state\",code=\"200\"} 2\n"));
+    TEST_ASSERT_TRUE(contains(text, "# TYPE mate_http_request_duration_seconds histogram\n"));
+    TEST_ASSERT_TRUE(contains(text,
+        "mate_http_request_duration_seconds_bucket{method=\"GET\",route=\"/api/state\",le=\"0.000064\"} 1\n"));
+    TEST_ASSERT_TRUE(contains(text,
+        "mate_http_request_duration_seconds_bucket{method=\"GET\",route=\"/api/state\",le=\"0.000256\"} 2\n"));
+    TEST_ASSERT_TRUE(contains(text,
+        "mate_http_request_duration_seconds_bucket{method=\"GET\",route=\"/api/state\",le=\"+Inf\"} 2\n"));
+    TEST_ASSERT_TRUE(contains(text,
+        "mate_http_request_duration_seconds_sum{method=\"GET\",route=\"/api/state\"} 0.000100\n"));
+    TEST_ASSERT_TRUE(contains(text,
+        "mate_http_request_duration_seconds_count{method=\"GET\",route=\"/api/state\"} 2\n"));
+    TEST_ASSERT_TRUE(contains(text, "mate_stage_duration_seconds_sum{stage=\"nvs_write\"} 1.500000\n"));
+    TEST_ASSERT_TRUE(contains(text, "mate_stage_duration_seconds_count{stage=\"json_parse\"} 0\n"));
+    
+    // Routes never requested are left out
+    TEST_ASSERT_FALSE(contains(text, "/api/users/{id}"));
+}
+
+void test_exposition_in_small_buffers(void) {
+    int route = metrics->addRoute("GET", "/api/state");
+    metrics->record(route, 200, 1000);
+    metrics->record(route, 503, 20);
+    
+    std::string whole = exposition(4096);
+    TEST_ASSERT_EQUAL_STRING(whole.c_str(), exposition(128).c_str());
+    
+    // A buffer too small for the next line gets nothing
+    char buffer[8];
+    size_t line = 0;
+    TEST_ASSERT_EQUAL(0, metrics->fill(buffer, sizeof(buffer), line));
+    TEST_ASSERT_EQUAL(0, line);
+    TEST_ASSERT_FALSE(metrics->finished(line));
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_histogram_buckets);
+    RUN_TEST(test_requests_counted_by_status);
+    RUN_TEST(test_timer_records_noted_status);
+    RUN_TEST(test_routes_capped);
+    RUN_TEST(test_prometheus_exposition);
+    RUN_TEST(test_exposition_in_small_buffers);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
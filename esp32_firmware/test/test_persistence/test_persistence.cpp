@@ -0,0 +1,169 @@
+/**
+ * Unit Tests for the persistence task
+ * 
+ * Checks that with a write request handler set, mutations leave the
+ * NVS write to persist(), and that the task serves a burst of requests
+ * with one write without losing anything across a reload.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <mutex>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_persist"
+
+#include "data_storage.h"
+#include "persistence_task.h"
+
+void clearStorage() {
+    DataStorage storage;
+    storage.begin();
+    storage.reset();
+}
+
+void setUp(void) {
+    clearStorage();
+}
+
+void tearDown(void) {
+    clearStorage();
+}
+
+bool storedUser(const char* name) {
+    DataStorage reloaded;
+    reloaded.begin();
+    return reloaded.userExists(name);
+}
+
+// ============================================
+// Deferred Write Tests
+// ============================================
+
+void test_mutation_requests_write_instead_of_writing(void) {
+    // Without group commit every change would be written right away
+    DataStorage storage(true, false);
+    storage.begin();
+    int requests = 0;
+    storage.setWriteRequestHandler([&requests]() { requests++; });
+    uint32_t flushesBefore = storage.getFlushCount();
+    
+    storage.addUser("user1", "Alice");
+    
+    TEST_ASSERT_EQUAL(1, requests);
+    TEST_ASSERT_EQUAL(flushesBefore, storage.getFlushCount());
+    TEST_ASSERT_EQUAL(1, storage.getPendingChanges());
+    TEST_ASSERT_FALSE(storedUser("Alice"));
+    
+    TEST_ASSERT_TRUE(storage.persist(true));
+    TEST_ASSERT_EQUAL(flushesBefore + 1, storage.getFlushCount());
+    TEST_ASSERT_EQUAL(0, storage.getPendingChanges());
+    TEST_ASSERT_TRUE(storedUser("Alice"));
+    
+    // Nothing left to write
+    TEST_ASSERT_FALSE(storage.persist(true));
+}
+
+void test_persist_keeps_group_commit_timing(void) {
+    DataStorage storage(true, true);
+    storage.begin();
+    storage.setWriteRequestHandler([]() {});
+    storage.addUser("user1", "Alice");
+    storage.addUser("user2", "Bob");
+    
+    TEST_ASSERT_FALSE(storage.persist(false));
+    TEST_ASSERT_EQUAL(2, storage.getPendingChanges());
+    
+    delay(STORAGE_COMMIT_QUIET_MS + 10);
+    TEST_ASSERT_TRUE(storage.persist(false));
+    TEST_ASSERT_EQUAL(1, storage.getLogLength());
+    TEST_ASSERT_EQUAL(1, storage.getFlushesAvoided());
+}
+
+void test_reset_is_written_by_persist(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    storage.addUser("user1", "Alice");
+    storage.setWriteRequestHandler([]() {});
+    
+    storage.reset();
+    TEST_ASSERT_TRUE(storedUser("Alice"));
+    
+    TEST_ASSERT_TRUE(storage.persist(true));
+    TEST_ASSERT_FALSE(storedUser("Alice"));
+    TEST_ASSERT_EQUAL(0, storage.getLogLength());
+}
+
+// ============================================
+// Task Tests
+// ============================================
+
+void test_task_writes_burst_once(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    PersistenceTask task(storage);
+    TEST_ASSERT_TRUE(task.begin());
+    
+    // The task cannot take the changes until the burst is over
+    {
+        std::lock_guard<DataStorage> lock(storage);
+        storage.addUser("user1", "Alice");
+        storage.addItem("item1", "Coffee", 2.50, 100);
+        char id[16];
+        for (int i = 0; i < 20; i++) {
+            snprintf(id, sizeof(id), "c%d", i);
+            storage.addConsumption(id, "user1", "item1", 1);
+        }
+    }
+    
+    // end() waits for the task to write what is pending
+    task.end();
+    TEST_ASSERT_FALSE(task.isRunning());
+    
+    TEST_ASSERT_EQUAL(22, task.getRequests());
+    TEST_ASSERT_EQUAL(1, task.getWrites());
+    TEST_ASSERT_GREATER_THAN(0, task.getMaxQueueDepth());
+    TEST_ASSERT_EQUAL(0, storage.getPendingChanges());
+    
+    DataStorage reloaded;
+    reloaded.begin();
+    TEST_ASSERT_EQUAL(80, reloaded.getAvailableStock("item1"));
+}
+
+void test_storage_writes_inline_after_end(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    PersistenceTask task(storage);
+    TEST_ASSERT_TRUE(task.begin());
+    task.end();
+    
+    uint32_t flushesBefore = storage.getFlushCount();
+    storage.addUser("user1", "Alice");
+    TEST_ASSERT_EQUAL(flushesBefore + 1, storage.getFlushCount());
+    TEST_ASSERT_EQUAL(0, task.getRequests());
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_mutation_requests_write_instead_of_writing);
+    RUN_TEST(test_persist_keeps_group_commit_timing);
+    RUN_TEST(test_reset_is_written_by_persist);
+    RUN_TEST(test_task_writes_burst_once);
+    RUN_TEST(test_storage_writes_inline_after_end);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
@@ -0,0 +1,146 @@
+/**
+ * Unit Tests for DataStorage record layout
+ * 
+ * Compares the heap used by the fixed-size records at full capacity
+ * with the previous String-based records.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <vector>
+#include <type_traits>
+
+#include "data_storage.h"
+
+// Previous String-based layout, kept here for comparison only
+struct LegacyConsumptionRecord {
+    String id;
+    String userId;
+    String itemId;
+    int quantity;
+    String timestamp;
+};
+
+struct LegacyPaymentRecord {
+    String id;
+    String userId;
+    String itemId;
+    float amount;
+    String timestamp;
+};
+
+void setUp(void) {
+    // Nothing to set up
+}
+
+void tearDown(void) {
+    // Nothing to tear down
+}
+
+// Ids the way the web handlers generate them: String(millis())
+String makeId(uint32_t n) {
+    return String(1700000000UL + n);
+}
+
+// ============================================
+// Layout Tests
+// ============================================
+
+void test_records_are_fixed_size(void) {
+    TEST_ASSERT_TRUE(std::is_trivially_copyable<User>::value);
+    TEST_ASSERT_TRUE(std::is_trivially_copyable<Item>::value);
+    TEST_ASSERT_TRUE(std::is_trivially_copyable<ConsumptionRecord>::value);
+    TEST_ASSERT_TRUE(std::is_trivially_copyable<PaymentRecord>::value);
+}
+
+void test_generated_ids_fit(void) {
+    // millis() ids are at most 10 digits
+    TEST_ASSERT_LESS_OR_EQUAL(MAX_ID_LENGTH, String(0xFFFFFFFFUL).length());
+}
+
+// ============================================
+// Heap Usage Tests
+// ============================================
+
+void test_full_capacity_heap_usage(void) {
+    uint32_t heapStart = ESP.getFreeHeap();
+    size_t legacyBytes;
+    {
+        std::vector<LegacyConsumptionRecord> consumption;
+        std::vector<LegacyPaymentRecord> payments;
+        for (uint32_t i = 0; i < MAX_CONSUMPTION_RECORDS; i++) {
+            LegacyConsumptionRecord record;
+            record.id = makeId(i);
+            record.userId = makeId(i % MAX_USERS);
+            record.itemId = makeId(i % MAX_ITEMS);
+            record.quantity = 1;
+            record.timestamp = String(millis());
+            consumption.push_back(record);
+        }
+        for (uint32_t i = 0; i < MAX_PAYMENT_RECORDS; i++) {
+            LegacyPaymentRecord payment;
+            payment.id = makeId(i);
+            payment.userId = makeId(i % MAX_USERS);
+            payment.itemId = makeId(i % MAX_ITEMS);
+            payment.amount = 1.5f;
+            payment.timestamp = String(millis());
+            payments.push_back(payment);
+        }
+        legacyBytes = heapStart - ESP.getFreeHeap();
+    }
+    
+    heapStart = ESP.getFreeHeap();
+    size_t compactBytes;
+    {
+        std::vector<ConsumptionRecord> consumption;
+        std::vector<PaymentRecord> payments;
+        consumption.reserve(MAX_CONSUMPTION_RECORDS);
+        payments.reserve(MAX_PAYMENT_RECORDS);
+        for (uint32_t i = 0; i < MAX_CONSUMPTION_RECORDS; i++) {
+            ConsumptionRecord record;
+            strcpy(record.id, makeId(i).c_str());
+            strcpy(record.userId, makeId(i % MAX_USERS).c_str());
+            strcpy(record.itemId, makeId(i % MAX_ITEMS).c_str());
+            record.quantity = 1;
+            record.timestamp = millis();
+            consumption.push_back(record);
+        }
+        for (uint32_t i = 0; i < MAX_PAYMENT_RECORDS; i++) {
+            PaymentRecord payment;
+            strcpy(payment.id, makeId(i).c_str());
+            strcpy(payment.userId, makeId(i % MAX_USERS).c_str());
+            strcpy(payment.itemId, makeId(i % MAX_ITEMS).c_str());
+            payment.amount = 1.5f;
+            payment.timestamp = millis();
+            payments.push_back(payment);
+        }
+        compactBytes = heapStart - ESP.getFreeHeap();
+    }
+    
+    char message[96];
+    snprintf(message, sizeof(message), "Heap at full capacity: String layout %u bytes, fixed layout %u bytes",
+        (unsigned)legacyBytes, (unsigned)compactBytes);
+    TEST_MESSAGE(message);
+    
+    TEST_ASSERT_LESS_THAN(legacyBytes, compactBytes);
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_records_are_fixed_size);
+    RUN_TEST(test_generated_ids_fit);
+    RUN_TEST(test_full_capacity_heap_usage);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
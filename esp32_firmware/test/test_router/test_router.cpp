@@ -0,0 +1,318 @@
+/**
+ * Unit Tests for ApiRouter
+ * 
+ * Checks route matching and id extraction, and compares the cost of a
+ * dispatch with the regex matching ESPAsyncWebServer did before. Also
+ * checks that bodies arriving in several parts are put back together.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "api_router.h"
+
+#define BENCH_DISPATCHES 2000
+
+ApiRouter* router = nullptr;
+int lastRoute = 0;
+String lastId;
+
+void addRoute(const char* pattern, WebRequestMethodComposite method, int tag) {
+    router->on(pattern, method, [tag](AsyncWebServerRequest* request, const RouteParams& params) {
+        lastRoute = tag;
+        lastId = params.size() > 0 ? params[0] : String();
+    });
+}
+
+// The routes of web_handlers.h
+void addApiRoutes() {
+    addRoute("/api/status", HTTP_GET, 1);
+    addRoute("/api/state", HTTP_GET, 2);
+    addRoute("/api/changes", HTTP_GET, 3);
+    addRoute("/api/balances", HTTP_GET, 4);
+    addRoute("/api/users", HTTP_POST, 5);
+    addRoute("/api/users/{id}", HTTP_DELETE, 6);
+    addRoute("/api/items", HTTP_POST, 7);
+    addRoute("/api/items/{id}", HTTP_DELETE, 8);
+    addRoute("/api/items/{id}/stock", HTTP_PUT, 9);
+    addRoute("/api/consumption", HTTP_POST, 10);
+    addRoute("/api/consumption/{id}", HTTP_DELETE, 11);
+    addRoute("/api/payments", HTTP_POST, 12);
+    addRoute("/api/batch", HTTP_POST, 13);
+    addRoute("/api/reset", HTTP_POST, 14);
+}
+
+// Tag of the route matched, 0 if none
+int dispatch(WebRequestMethodComposite method, const char* path) {
+    RouteParams params;
+    const ApiRouter::Route* route = router->match(method, path, params);
+    lastRoute = 0;
+    lastId = "";
+    if (route) {
+        route->onRequest(nullptr, params);
+    }
+    return lastRoute;
+}
+
+void setUp(void) {
+    router = new ApiRouter();
+    addApiRoutes();
+}
+
+void tearDown(void) {
+    delete router;
+    router = nullptr;
+}
+
+// ============================================
+// Matching Tests
+// ============================================
+
+void test_literal_routes_match_by_method(void) {
+    TEST_ASSERT_EQUAL(2, dispatch(HTTP_GET, "/api/state"));
+    TEST_ASSERT_EQUAL(5, dispatch(HTTP_POST, "/api/users"));
+    TEST_ASSERT_EQUAL(14, dispatch(HTTP_POST, "/api/reset"));
+    
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_POST, "/api/state"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_GET, "/api/reset"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_GET, "/api/unknown"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_GET, "/index.html"));
+}
+
+void test_ids_extracted(void) {
+    TEST_ASSERT_EQUAL(6, dispatch(HTTP_DELETE, "/api/users/1712345"));
+    TEST_ASSERT_EQUAL_STRING("1712345", lastId.c_str());
+    
+    TEST_ASSERT_EQUAL(9, dispatch(HTTP_PUT, "/api/items/item1/stock"));
+    TEST_ASSERT_EQUAL_STRING("item1", lastId.c_str());
+    
+    TEST_ASSERT_EQUAL(11, dispatch(HTTP_DELETE, "/api/consumption/c42"));
+    TEST_ASSERT_EQUAL_STRING("c42", lastId.c_str());
+}
+
+void test_same_paths_rejected_as_with_regex(void) {
+    // ^\/api\/users\/([a-zA-Z0-9]+)$
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_DELETE, "/api/users/"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_DELETE, "/api/users/a-b"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_DELETE, "/api/users/abc/extra"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_DELETE, "/api/users//abc"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_PUT, "/api/items/item1/stocks"));
+    TEST_ASSERT_EQUAL(0, dispatch(HTTP_GET, "/api/statusx"));
+}
+
+void test_literal_segment_falls_back_to_parameter(void) {
+    addRoute("/api/items/special/price", HTTP_PUT, 20);
+    
+    TEST_ASSERT_EQUAL(20, dispatch(HTTP_PUT, "/api/items/special/price"));
+    
+    // "special" leads nowhere for /stock, so it is an id there
+    TEST_ASSERT_EQUAL(9, dispatch(HTTP_PUT, "/api/items/special/stock"));
+    TEST_ASSERT_EQUAL_STRING("special", lastId.c_str());
+}
+
+// ============================================
+// Request Body Tests
+// ============================================
+
+// Feed body to collect in parts of at most partSize bytes
+RequestBody* collectInParts(void*& slot, const char* body, size_t partSize, size_t limit) {
+    size_t total = strlen(body);
+    RequestBody* collected = nullptr;
+    for (size_t index = 0; index < total; index += partSize) {
+        size_t len = total - index < partSize ? total - index : partSize;
+        collected = RequestBody::collect(slot, (const uint8_t*)body + index, len, index, total, limit);
+    }
+    return collected;
+}
+
+void test_body_in_parts_reassembled(void) {
+    const char* json = "{\"userId\":\"user1\",\"itemId\":\"item1\",\"quantity\":2,\"note\":\"split over segments\"}";
+    
+    // Sizes of the parts a slow link or a small MSS would deliver
+    const size_t partSizes[] = {1, 3, 7, 16, strlen(json)};
+    for (size_t partSize : partSizes) {
+        void* slot = nullptr;
+        RequestBody* body = collectInParts(slot, json, partSize, 1024);
+        
+        TEST_ASSERT_NOT_NULL(body);
+        TEST_ASSERT_EQUAL(RequestBody::COMPLETE, body->status);
+        TEST_ASSERT_EQUAL_STRING(json, body->data());
+        
+        StaticJsonDocument<256> doc;
+        TEST_ASSERT_FALSE(deserializeJson(doc, body->data(), body->length));
+        TEST_ASSERT_EQUAL(2, doc["quantity"].as<int>());
+        free(slot);
+    }
+}
+
+void test_body_over_limit_not_buffered(void) {
+    void* slot = nullptr;
+    const char* json = "{\"name\":\"0123456789\"}";
+    
+    // Known to be too large from the first part on
+    RequestBody* body = RequestBody::collect(slot, (const uint8_t*)json, 4, 0, strlen(json), strlen(json) - 1);
+    TEST_ASSERT_NOT_NULL(body);
+    TEST_ASSERT_EQUAL(RequestBody::TOO_LARGE, body->status);
+    
+    body = collectInParts(slot, json, 4, strlen(json) - 1);
+    TEST_ASSERT_EQUAL(RequestBody::TOO_LARGE, body->status);
+    TEST_ASSERT_EQUAL(0, body->length);
+    free(slot);
+    
+    // Exactly at the limit is fine
+    slot = nullptr;
+    body = collectInParts(slot, json, 4, strlen(json));
+    TEST_ASSERT_EQUAL(RequestBody::COMPLETE, body->status);
+    free(slot);
+}
+
+void test_body_parts_out_of_order_ignored(void) {
+    void* slot = nullptr;
+    const uint8_t* json = (const uint8_t*)"{\"a\":1}";
+    
+    RequestBody::collect(slot, json, 2, 0, 7, 1024);
+    RequestBody* body = RequestBody::collect(slot, json + 4, 3, 4, 7, 1024);    // Skips 2..3
+    TEST_ASSERT_EQUAL(RequestBody::COLLECTING, body->status);
+    TEST_ASSERT_EQUAL(2, body->length);
+    
+    body = RequestBody::collect(slot, json + 2, 5, 2, 7, 1024);
+    TEST_ASSERT_EQUAL(RequestBody::COMPLETE, body->status);
+    TEST_ASSERT_EQUAL_STRING("{\"a\":1}", body->data());
+    free(slot);
+}
+
+// ============================================
+// Benchmark
+// ============================================
+
+// ESPAsyncWebServer with ASYNCWEBSERVER_REGEX: handlers are tried in
+// order, and each regex handler compiles its pattern per request
+struct RegexRoute {
+    WebRequestMethodComposite method;
+    const char* uri;
+};
+
+const RegexRoute REGEX_ROUTES[] = {
+    {HTTP_GET, "/api/status"},
+    {HTTP_GET, "/api/state"},
+    {HTTP_GET, "/api/changes"},
+    {HTTP_GET, "/api/balances"},
+    {HTTP_POST, "/api/users"},
+    {HTTP_DELETE, "^\\/api\\/users\\/([a-zA-Z0-9]+)$"},
+    {HTTP_POST, "/api/items"},
+    {HTTP_DELETE, "^\\/api\\/items\\/([a-zA-Z0-9]+)$"},
+    {HTTP_PUT, "^\\/api\\/items\\/([a-zA-Z0-9]+)\\/stock$"},
+    {HTTP_POST, "/api/consumption"},
+    {HTTP_DELETE, "^\\/api\\/consumption\\/([a-zA-Z0-9]+)$"},
+    {HTTP_POST, "/api/payments"},
+    {HTTP_POST, "/api/batch"},
+    {HTTP_POST, "/api/reset"},
+};
+
+int regexDispatch(WebRequestMethodComposite method, const char* path, std::vector<std::string>& args) {
+    int tag = 0;
+    for (const RegexRoute& route : REGEX_ROUTES) {
+        tag++;
+        if (!(route.method & method)) {
+            continue;
+        }
+        if (route.uri[0] == '^') {
+            std::regex pattern(route.uri);
+            std::smatch matches;
+            std::string s(path);
+            if (std::regex_search(s, matches, pattern)) {
+                args.clear();
+                for (size_t i = 1; i < matches.size(); ++i) {
+                    args.push_back(matches[i].str());
+                }
+                return tag;
+            }
+        } else {
+            String uri(route.uri);
+            String url(path);
+            if (uri == url || url.startsWith(uri + "/")) {
+                return tag;
+            }
+        }
+    }
+    return 0;
+}
+
+struct BenchRequest {
+    WebRequestMethodComposite method;
+    const char* path;
+};
+
+// Page load, polling and a round of bookings
+const BenchRequest BENCH_REQUESTS[] = {
+    {HTTP_GET, "/api/changes"},
+    {HTTP_GET, "/api/status"},
+    {HTTP_POST, "/api/consumption"},
+    {HTTP_DELETE, "/api/consumption/1712345"},
+    {HTTP_PUT, "/api/items/1712001/stock"},
+    {HTTP_POST, "/api/payments"},
+    {HTTP_GET, "/api/state"},
+    {HTTP_POST, "/api/reset"},
+};
+const size_t BENCH_REQUEST_COUNT = sizeof(BENCH_REQUESTS) / sizeof(BENCH_REQUESTS[0]);
+
+void test_dispatch_cost(void) {
+    // Both dispatchers agree on every request first
+    std::vector<std::string> args;
+    for (const BenchRequest& request : BENCH_REQUESTS) {
+        TEST_ASSERT_EQUAL(regexDispatch(request.method, request.path, args), dispatch(request.method, request.path));
+    }
+    
+    volatile int sink = 0;
+    uint32_t start = micros();
+    for (int i = 0; i < BENCH_DISPATCHES; i++) {
+        const BenchRequest& request = BENCH_REQUESTS[i % BENCH_REQUEST_COUNT];
+        sink += regexDispatch(request.method, request.path, args);
+    }
+    uint32_t regexTime = micros() - start;
+    
+    RouteParams params;
+    start = micros();
+    for (int i = 0; i < BENCH_DISPATCHES; i++) {
+        const BenchRequest& request = BENCH_REQUESTS[i % BENCH_REQUEST_COUNT];
+        sink += router->match(request.method, request.path, params) != nullptr;
+    }
+    uint32_t routerTime = micros() - start;
+    (void)sink;
+    
+    char message[96];
+    snprintf(message, sizeof(message), "Dispatch: regex %.0f ns, router %.0f ns per request",
+        regexTime * 1000.0f / BENCH_DISPATCHES, routerTime * 1000.0f / BENCH_DISPATCHES);
+    TEST_MESSAGE(message);
+    
+    TEST_ASSERT_LESS_THAN(regexTime, routerTime);
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_literal_routes_match_by_method);
+    RUN_TEST(test_ids_extracted);
+    RUN_TEST(test_same_paths_rejected_as_with_regex);
+    RUN_TEST(test_literal_segment_falls_back_to_parameter);
+    RUN_TEST(test_body_in_parts_reassembled);
+    RUN_TEST(test_body_over_limit_not_buffered);
+    RUN_TEST(test_body_parts_out_of_order_ignored);
+    RUN_TEST(test_dispatch_cost);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
@@ -0,0 +1,141 @@
+/**
+ * Unit Tests for the state version and serialized state cache
+ * 
+ * Checks that every change bumps the version and the ETag, that failed
+ * operations do not, and that the state is serialized once per version.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_cache"
+
+#include "data_storage.h"
+
+DataStorage* storage = nullptr;
+
+void setUp(void) {
+    storage = new DataStorage(true, false);
+    storage->begin();
+    storage->reset();
+}
+
+void tearDown(void) {
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+// ============================================
+// Version Tests
+// ============================================
+
+void test_changes_bump_version(void) {
+    uint32_t version = storage->getVersion();
+    String etag = storage->getETag();
+    
+    storage->addUser("user1", "Alice");
+    TEST_ASSERT_EQUAL(version + 1, storage->getVersion());
+    TEST_ASSERT_TRUE(etag != storage->getETag());
+    
+    storage->addItem("item1", "Coffee", 2.50, 100);
+    storage->addConsumption("cons1", "user1", "item1", 1);
+    storage->removeConsumption("cons1");
+    TEST_ASSERT_EQUAL(version + 4, storage->getVersion());
+}
+
+void test_failed_operations_keep_version(void) {
+    storage->addUser("user1", "Alice");
+    uint32_t version = storage->getVersion();
+    String etag = storage->getETag();
+    
+    TEST_ASSERT_FALSE(storage->removeUser("missing"));
+    TEST_ASSERT_FALSE(storage->removeItem("missing"));
+    TEST_ASSERT_FALSE(storage->updateItemStock("missing", 5));
+    TEST_ASSERT_FALSE(storage->removeConsumption("missing"));
+    
+    TEST_ASSERT_EQUAL(version, storage->getVersion());
+    TEST_ASSERT_EQUAL_STRING(etag.c_str(), storage->getETag().c_str());
+}
+
+void test_batch_version_counts_from_commit(void) {
+    uint32_t version = storage->getVersion();
+    String etag = storage->getETag();
+    {
+        StorageBatch batch(*storage);
+        storage->addUser("user1", "Alice");
+        TEST_ASSERT_EQUAL(version, storage->getVersion());
+        TEST_ASSERT_EQUAL_STRING(etag.c_str(), storage->getETag().c_str());
+    }
+    TEST_ASSERT_EQUAL(version, storage->getVersion());
+    
+    {
+        StorageBatch batch(*storage);
+        storage->addUser("user1", "Alice");
+        storage->addItem("item1", "Coffee", 2.50, 100);
+        batch.commit();
+    }
+    TEST_ASSERT_EQUAL(version + 2, storage->getVersion());
+    TEST_ASSERT_EQUAL_STRING(storage->getSnapshot()->etag, storage->getETag().c_str());
+}
+
+// ============================================
+// Cache Tests
+// ============================================
+
+void test_state_serialized_once_per_version(void) {
+    storage->addUser("user1", "Alice");
+    
+    std::shared_ptr<const String> first = storage->getSerializedState();
+    std::shared_ptr<const String> second = storage->getSerializedState();
+    TEST_ASSERT_TRUE(first == second);
+    
+    storage->addItem("item1", "Coffee", 2.50, 100);
+    std::shared_ptr<const String> third = storage->getSerializedState();
+    TEST_ASSERT_TRUE(first != third);
+    
+    // An earlier snapshot stays intact after the change
+    TEST_ASSERT_EQUAL(-1, first->indexOf("Coffee"));
+    TEST_ASSERT_NOT_EQUAL(-1, third->indexOf("Coffee"));
+}
+
+void test_cached_state_matches_fresh_serialization(void) {
+    storage->addUser("user1", "Alice");
+    storage->addItem("item1", "Coffee", 2.50, 100);
+    storage->addConsumption("cons1", "user1", "item1", 2);
+    storage->getSerializedState();
+    storage->removeConsumption("cons1");
+    
+    String fresh;
+    StringPrint sink(fresh);
+    storage->writeStateJson(sink);
+    TEST_ASSERT_EQUAL_STRING(fresh.c_str(), storage->getSerializedState()->c_str());
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_changes_bump_version);
+    RUN_TEST(test_failed_operations_keep_version);
+    RUN_TEST(test_batch_version_counts_from_commit);
+    RUN_TEST(test_state_serialized_once_per_version);
+    RUN_TEST(test_cached_state_matches_fresh_serialization);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
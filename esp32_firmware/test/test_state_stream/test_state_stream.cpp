@@ -0,0 +1,171 @@
+/**
+ * Unit Tests for streamed state serialization
+ * 
+ * Checks that writeStateJson produces valid, complete JSON and compares
+ * the peak heap of the old /api/state path (16 KB document, String,
+ * copy into the response) with streaming into an AsyncResponseStream.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_stream"
+
+#include "data_storage.h"
+
+DataStorage* storage = nullptr;
+
+void setUp(void) {
+    storage = new DataStorage(true, false);
+    storage->begin();
+    storage->reset();
+}
+
+void tearDown(void) {
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+// Realistic office: a few weeks of history
+void fillStorage(int consumption, int payments) {
+    char id[16];
+    char userId[16];
+    char itemId[16];
+    for (int i = 0; i < 10; i++) {
+        snprintf(id, sizeof(id), "u%d", i);
+        storage->addUser(id, "Colleague");
+    }
+    for (int i = 0; i < 5; i++) {
+        snprintf(id, sizeof(id), "i%d", i);
+        storage->addItem(id, "Mate Classic", 1.50, 1000);
+    }
+    for (int i = 0; i < consumption; i++) {
+        snprintf(id, sizeof(id), "%lu", 1700000000UL + i);
+        snprintf(userId, sizeof(userId), "u%d", i % 10);
+        snprintf(itemId, sizeof(itemId), "i%d", i % 5);
+        storage->addConsumption(id, userId, itemId, 1);
+    }
+    for (int i = 0; i < payments; i++) {
+        snprintf(id, sizeof(id), "%lu", 1800000000UL + i);
+        snprintf(userId, sizeof(userId), "u%d", i % 10);
+        storage->addPayment(id, userId, "i0", 3.00);
+    }
+}
+
+int countOccurrences(const String& text, const char* needle) {
+    int count = 0;
+    int pos = text.indexOf(needle);
+    while (pos >= 0) {
+        count++;
+        pos = text.indexOf(needle, pos + 1);
+    }
+    return count;
+}
+
+// ============================================
+// Output Tests
+// ============================================
+
+void test_stream_is_valid_json(void) {
+    fillStorage(20, 5);
+    storage->addUser("quote", "Ann \"The Mate\" Lee");
+    
+    String json = storage->getStateJson();
+    DynamicJsonDocument doc(16384);
+    TEST_ASSERT_FALSE(deserializeJson(doc, json));
+    
+    TEST_ASSERT_EQUAL(11, doc["users"].size());
+    TEST_ASSERT_EQUAL(5, doc["items"].size());
+    TEST_ASSERT_EQUAL(20, doc["consumption"].size());
+    TEST_ASSERT_EQUAL(5, doc["payments"].size());
+    TEST_ASSERT_EQUAL_STRING("Ann \"The Mate\" Lee", doc["users"][10]["name"].as<const char*>());
+    
+    // Same bytes as serializing a full document
+    String reserialized;
+    serializeJson(doc, reserialized);
+    TEST_ASSERT_EQUAL_STRING(reserialized.c_str(), json.c_str());
+}
+
+void test_measure_matches_output(void) {
+    fillStorage(30, 10);
+    TEST_ASSERT_EQUAL(storage->getStateJson().length(), storage->measureStateJson());
+}
+
+void test_state_beyond_old_document_size(void) {
+    // The old 16 KB document silently dropped records past this point
+    fillStorage(MAX_CONSUMPTION_RECORDS, MAX_PAYMENT_RECORDS);
+    String json = storage->getStateJson();
+    
+    TEST_ASSERT_TRUE(json.endsWith("]}"));
+    TEST_ASSERT_EQUAL(MAX_CONSUMPTION_RECORDS, countOccurrences(json, "\"quantity\":"));
+    TEST_ASSERT_EQUAL(MAX_PAYMENT_RECORDS, countOccurrences(json, "\"amount\":"));
+}
+
+// ============================================
+// Peak Heap Tests
+// ============================================
+
+void test_stream_peak_heap(void) {
+    // Small enough that the old 16 KB document still holds everything
+    fillStorage(50, 20);
+    String state = storage->getStateJson();
+    
+    // Old path: document with copied strings, serialized String, and
+    // the copy beginResponse keeps as the response body
+    uint32_t heapStart = ESP.getFreeHeap();
+    size_t legacyPeak;
+    {
+        DynamicJsonDocument doc(16384);
+        deserializeJson(doc, state.c_str());
+        String output;
+        serializeJson(doc, output);
+        String body = output;
+        legacyPeak = heapStart - ESP.getFreeHeap();
+    }
+    
+    // New path: the response buffer, sized once, and nothing else
+    heapStart = ESP.getFreeHeap();
+    size_t streamPeak;
+    {
+        AsyncResponseStream response("application/json", storage->measureStateJson());
+        storage->writeStateJson(response);
+        streamPeak = heapStart - ESP.getFreeHeap();
+        TEST_ASSERT_EQUAL(state.length(), response.available());
+    }
+    
+    char message[112];
+    snprintf(message, sizeof(message), "/api/state with %u bytes of JSON: legacy peak %u bytes, streamed peak %u bytes",
+        (unsigned)state.length(), (unsigned)legacyPeak, (unsigned)streamPeak);
+    TEST_MESSAGE(message);
+    
+    TEST_ASSERT_LESS_THAN(legacyPeak / 2, streamPeak);
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_stream_is_valid_json);
+    RUN_TEST(test_measure_matches_output);
+    RUN_TEST(test_state_beyond_old_document_size);
+    RUN_TEST(test_stream_peak_heap);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
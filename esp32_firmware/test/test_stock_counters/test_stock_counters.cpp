@@ -0,0 +1,161 @@
+/**
+ * Unit Tests for per-item stock counters
+ * 
+ * Runs random operation sequences against DataStorage and checks
+ * getAvailableStock against a full rescan of the consumption records.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_stock"
+
+#include "data_storage.h"
+
+DataStorage* storage = nullptr;
+
+// Small deterministic generator so failures are reproducible
+uint32_t rngState = 1;
+uint32_t nextRandom(uint32_t range) {
+    rngState = rngState * 1103515245UL + 12345UL;
+    return (rngState >> 16) % range;
+}
+
+void setUp(void) {
+    storage = new DataStorage();
+    storage->begin();
+    storage->reset();
+}
+
+void tearDown(void) {
+    if (storage) {
+        storage->reset();
+        delete storage;
+        storage = nullptr;
+    }
+}
+
+// Compare every item's counter with a rescan of the state JSON
+void assertCountersMatchRescan() {
+    String json = storage->getStateJson();
+    DynamicJsonDocument doc(32768);
+    TEST_ASSERT_FALSE(deserializeJson(doc, json));
+    
+    for (JsonObject item : doc["items"].as<JsonArray>()) {
+        const char* itemId = item["id"];
+        int consumed = 0;
+        for (JsonObject record : doc["consumption"].as<JsonArray>()) {
+            if (strcmp(record["itemId"].as<const char*>(), itemId) == 0) {
+                consumed += record["quantity"].as<int>();
+            }
+        }
+        TEST_ASSERT_EQUAL(item["initialStock"].as<int>() - consumed, storage->getAvailableStock(itemId));
+    }
+}
+
+void runRandomSequence(uint32_t seed, int operations) {
+    rngState = seed;
+    char id[16];
+    char userId[16];
+    char itemId[16];
+    int nextId = 0;
+    
+    for (int i = 0; i < operations; i++) {
+        snprintf(userId, sizeof(userId), "u%u", (unsigned)nextRandom(6));
+        snprintf(itemId, sizeof(itemId), "i%u", (unsigned)nextRandom(4));
+        
+        switch (nextRandom(10)) {
+            case 0:
+                if (!storage->userExists(userId)) {
+                    storage->addUser(userId, userId);
+                }
+                break;
+            case 1:
+                if (!storage->itemExists(itemId)) {
+                    storage->addItem(itemId, itemId, 1.5, 1000);
+                }
+                break;
+            case 2:
+                storage->removeUser(userId);
+                break;
+            case 3:
+                if (nextRandom(4) == 0) {
+                    storage->removeItem(itemId);
+                }
+                break;
+            case 4:
+                storage->updateItemStock(itemId, 500 + nextRandom(500));
+                break;
+            case 5:
+                snprintf(id, sizeof(id), "c%u", (unsigned)nextRandom(nextId + 1));
+                storage->removeConsumption(id);
+                break;
+            default:
+                snprintf(id, sizeof(id), "c%d", nextId++);
+                storage->addConsumption(id, userId, itemId, 1 + nextRandom(3));
+                break;
+        }
+    }
+}
+
+// ============================================
+// Consistency Tests
+// ============================================
+
+void test_counters_match_rescan_after_random_operations(void) {
+    for (uint32_t seed = 1; seed <= 5; seed++) {
+        storage->reset();
+        runRandomSequence(seed, 150);
+        assertCountersMatchRescan();
+    }
+}
+
+void test_counters_rebuilt_on_load(void) {
+    runRandomSequence(42, 150);
+    String expected = storage->getStateJson();
+    
+    delete storage;
+    storage = new DataStorage();
+    storage->begin();
+    
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), storage->getStateJson().c_str());
+    assertCountersMatchRescan();
+}
+
+void test_counters_after_cascade_delete(void) {
+    storage->addUser("user1", "Alice");
+    storage->addUser("user2", "Bob");
+    storage->addItem("item1", "Coffee", 2.50, 100);
+    storage->addConsumption("cons1", "user1", "item1", 5);
+    storage->addConsumption("cons2", "user2", "item1", 7);
+    
+    storage->removeUser("user1");
+    TEST_ASSERT_EQUAL(93, storage->getAvailableStock("item1"));
+    
+    storage->removeConsumptionByItem("item1");
+    TEST_ASSERT_EQUAL(100, storage->getAvailableStock("item1"));
+}
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_counters_match_rescan_after_random_operations);
+    RUN_TEST(test_counters_rebuilt_on_load);
+    RUN_TEST(test_counters_after_cascade_delete);
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}
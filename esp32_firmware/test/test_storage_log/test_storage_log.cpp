@@ -0,0 +1,384 @@
+/**
+ * Unit Tests for DataStorage log persistence
+ * 
+ * Compares the bytes written to NVS per operation in snapshot mode
+ * (full state rewrite) and log mode (one record per change), and
+ * checks that snapshot + log replay restores the same state.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <Preferences.h>
+
+// Use a separate NVS namespace so device data is not touched
+#include "config.h"
+#undef NVS_NAMESPACE
+#define NVS_NAMESPACE "test_log"
+
+#include "data_storage.h"
+
+void clearStorage() {
+    DataStorage storage;
+    storage.begin();
+    storage.reset();
+}
+
+void setUp(void) {
+    clearStorage();
+}
+
+void tearDown(void) {
+    clearStorage();
+}
+
+// Fill storage with a realistic amount of history
+void fillStorage(DataStorage& storage, int records) {
+    char id[16];
+    for (int i = 0; i < 10; i++) {
+        snprintf(id, sizeof(id), "u%d", i);
+        storage.addUser(id, "Colleague");
+    }
+    storage.addItem("item1", "Mate Classic", 1.50, 10000);
+    for (int i = 0; i < records; i++) {
+        snprintf(id, sizeof(id), "c%d", i);
+        char userId[16];
+        snprintf(userId, sizeof(userId), "u%d", i % 10);
+        storage.addConsumption(id, userId, "item1", 1);
+    }
+}
+
+// Bytes written by a single addConsumption after filling
+size_t bytesPerConsumption(bool useLog) {
+    DataStorage storage(useLog, false);
+    storage.begin();
+    fillStorage(storage, 100);
+    
+    size_t before = storage.getBytesWritten();
+    storage.addConsumption("extra", "u1", "item1", 1);
+    return storage.getBytesWritten() - before;
+}
+
+// ============================================
+// Bytes Written Tests
+// ============================================
+
+void test_log_mode_writes_less_per_consumption(void) {
+    size_t snapshotBytes = bytesPerConsumption(false);
+    clearStorage();
+    size_t logBytes = bytesPerConsumption(true);
+    
+    char message[96];
+    snprintf(message, sizeof(message), "addConsumption at 100 records: snapshot %u bytes, log %u bytes",
+        (unsigned)snapshotBytes, (unsigned)logBytes);
+    TEST_MESSAGE(message);
+    
+    TEST_ASSERT_GREATER_THAN(5000, snapshotBytes);
+    TEST_ASSERT_LESS_THAN(LOG_RECORD_SIZE, logBytes);
+}
+
+void test_log_record_is_small(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    storage.addUser("user1", "Alice");
+    
+    size_t before = storage.getBytesWritten();
+    storage.addPayment("pay1", "user1", "item1", 12.50);
+    TEST_ASSERT_LESS_THAN(LOG_RECORD_SIZE, storage.getBytesWritten() - before);
+    TEST_ASSERT_EQUAL(2, storage.getLogLength());
+}
+
+// ============================================
+// Replay Tests
+// ============================================
+
+void test_replay_restores_state(void) {
+    String expected;
+    {
+        DataStorage storage(true);
+        storage.begin();
+        storage.addUser("user1", "Alice");
+        storage.addUser("user2", "Bob");
+        storage.addItem("item1", "Coffee", 2.50, 100);
+        storage.addItem("item2", "Tea", 1.50, 50);
+        storage.addConsumption("cons1", "user1", "item1", 5);
+        storage.addConsumption("cons2", "user2", "item2", 3);
+        storage.addPayment("pay1", "user1", "item1", 12.50);
+        storage.updateItemStock("item2", 60);
+        storage.removeConsumption("cons1");
+        storage.removeUser("user2");
+        expected = storage.getStateJson();
+    }
+    
+    DataStorage reloaded(true);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+    TEST_ASSERT_EQUAL(100, reloaded.getAvailableStock("item1"));
+}
+
+void test_compaction_after_max_entries(void) {
+    String expected;
+    {
+        DataStorage storage(true, false);
+        storage.begin();
+        storage.addItem("item1", "Coffee", 2.50, 1000);
+        for (int i = 0; i < STORAGE_LOG_MAX_ENTRIES + 5; i++) {
+            char id[16];
+            snprintf(id, sizeof(id), "cons%d", i);
+            storage.addConsumption(id, "user1", "item1", 1);
+        }
+        // Compaction happened once the log was full
+        TEST_ASSERT_LESS_THAN(STORAGE_LOG_MAX_ENTRIES, storage.getLogLength());
+        expected = storage.getStateJson();
+    }
+    
+    DataStorage reloaded(true);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+    TEST_ASSERT_EQUAL(1000 - (STORAGE_LOG_MAX_ENTRIES + 5), reloaded.getAvailableStock("item1"));
+}
+
+void test_stale_log_ignored_after_reset(void) {
+    {
+        DataStorage storage(true);
+        storage.begin();
+        storage.addUser("user1", "Alice");
+        storage.addUser("user2", "Bob");
+        storage.reset();
+        TEST_ASSERT_EQUAL(0, storage.getLogLength());
+    }
+    
+    DataStorage reloaded(true);
+    reloaded.begin();
+    TEST_ASSERT_FALSE(reloaded.userExists("Alice"));
+    TEST_ASSERT_FALSE(reloaded.userExists("Bob"));
+}
+
+void test_snapshot_mode_reload(void) {
+    String expected;
+    {
+        DataStorage storage(false);
+        storage.begin();
+        storage.addUser("user1", "Alice");
+        storage.addItem("item1", "Coffee", 2.50, 100);
+        storage.addConsumption("cons1", "user1", "item1", 2);
+        TEST_ASSERT_EQUAL(0, storage.getLogLength());
+        expected = storage.getStateJson();
+    }
+    
+    DataStorage reloaded(true);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+}
+
+void test_snapshot_in_chunks(void) {
+    String expected;
+    {
+        DataStorage storage(true, false);
+        storage.begin();
+        fillStorage(storage, 100);
+        storage.compact();
+        expected = storage.getStateJson();
+        TEST_ASSERT_GREATER_THAN(SNAPSHOT_CHUNK_SIZE, expected.length());
+    }
+    
+    DataStorage reloaded(true);
+    reloaded.begin();
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+}
+
+void test_large_snapshot_round_trip(void) {
+    String expected;
+    {
+        DataStorage storage(true, false);
+        storage.begin();
+        fillStorage(storage, 250);
+        for (int i = 0; i < 50; i++) {
+            char id[16];
+            snprintf(id, sizeof(id), "p%d", i);
+            storage.addPayment(id, "u1", "item1", 1.50);
+        }
+        storage.compact();
+        expected = storage.getStateJson();
+        TEST_ASSERT_GREATER_THAN(16384, expected.length());
+    }
+    
+    DataStorage reloaded(true);
+    TEST_ASSERT_TRUE(reloaded.begin());
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+    TEST_ASSERT_EQUAL(10000 - 250, reloaded.getAvailableStock("item1"));
+}
+
+// Replace everything stored with a "state" snapshot as written before chunks
+void storeLegacySnapshot(const char* json, const char* partition = STORAGE_PARTITION) {
+    Preferences prefs;
+    prefs.begin(NVS_NAMESPACE, false, partition);
+    prefs.clear();
+    prefs.putString("state", json);
+    prefs.end();
+}
+
+void test_legacy_snapshot_loaded(void) {
+    storeLegacySnapshot("{\"users\":[{\"id\":\"user1\",\"name\":\"Alice\"}],"
+                        "\"items\":[{\"id\":\"item1\",\"name\":\"Coffee\",\"price\":2.5,\"initialStock\":10}],"
+                        "\"consumption\":[{\"id\":\"c1\",\"userId\":\"user1\",\"itemId\":\"item1\","
+                        "\"quantity\":2,\"timestamp\":\"100\"}],\"payments\":[],\"gen\":3}");
+    
+    DataStorage storage(true, false);
+    TEST_ASSERT_TRUE(storage.begin());
+    TEST_ASSERT_TRUE(storage.userExists("Alice"));
+    TEST_ASSERT_EQUAL(8, storage.getAvailableStock("item1"));
+}
+
+void test_legacy_long_name_truncated(void) {
+    storeLegacySnapshot("{\"users\":[{\"id\":\"user1\",\"name\":\"Alice Abernathy-Featherstonehaugh\"}],"
+                        "\"items\":[],\"consumption\":[],\"payments\":[]}");
+    
+    DataStorage storage(true, false);
+    TEST_ASSERT_TRUE(storage.begin());
+    TEST_ASSERT_TRUE(storage.userExists("Alice Abernathy-Featherstonehau"));
+}
+
+void test_moved_from_default_partition(void) {
+    // Saved before the storage partition existed, which is still empty
+    Preferences prefs;
+    prefs.begin(NVS_NAMESPACE, false, STORAGE_PARTITION);
+    prefs.clear();
+    prefs.end();
+    storeLegacySnapshot("{\"users\":[{\"id\":\"user1\",\"name\":\"Alice\"}],"
+                        "\"items\":[],\"consumption\":[],\"payments\":[]}", "nvs");
+    {
+        DataStorage storage(true, false);
+        TEST_ASSERT_TRUE(storage.begin());
+        TEST_ASSERT_TRUE(storage.userExists("Alice"));
+        storage.addUser("user2", "Bob");
+    }
+    
+    prefs.begin(NVS_NAMESPACE, true);
+    TEST_ASSERT_FALSE(prefs.isKey("state"));
+    prefs.end();
+    
+    DataStorage reloaded(true);
+    TEST_ASSERT_TRUE(reloaded.begin());
+    TEST_ASSERT_TRUE(reloaded.userExists("Alice"));
+    TEST_ASSERT_TRUE(reloaded.userExists("Bob"));
+}
+
+void test_unreadable_snapshot_kept(void) {
+    const char* broken = "{\"users\":[{\"id\":\"user1\",";
+    storeLegacySnapshot(broken);
+    
+    {
+        DataStorage storage(true, false);
+        TEST_ASSERT_FALSE(storage.begin());
+        storage.addUser("user2", "Bob");
+        storage.compact();
+    }
+    
+    Preferences prefs;
+    prefs.begin(NVS_NAMESPACE, true, STORAGE_PARTITION);
+    TEST_ASSERT_EQUAL_STRING(broken, prefs.getString("state").c_str());
+    TEST_ASSERT_FALSE(prefs.isKey("snap"));
+    TEST_ASSERT_FALSE(prefs.isKey("log0"));
+    prefs.end();
+}
+
+#ifdef NATIVE_PREFERENCES_H
+void test_refused_write_keeps_stored_data(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    storage.addUser("user1", "Alice");
+    storage.compact();
+    storage.addUser("user2", "Bob");
+    
+    // The snapshot is refused, and so is the one retried for Carol;
+    // no log entry of the new generation may land on the old snapshot
+    Preferences::refuseWrites() = true;
+    storage.compact();
+    storage.addUser("user3", "Carol");
+    Preferences::refuseWrites() = false;
+    storage.addUser("user4", "Dave");
+    TEST_ASSERT_EQUAL(0, storage.getLogLength());
+    
+    DataStorage reloaded(true);
+    reloaded.begin();
+    TEST_ASSERT_TRUE(reloaded.userExists("Alice"));
+    TEST_ASSERT_TRUE(reloaded.userExists("Bob"));
+    TEST_ASSERT_TRUE(reloaded.userExists("Carol"));
+    TEST_ASSERT_TRUE(reloaded.userExists("Dave"));
+}
+
+void test_stored_data_intact_while_refused(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    storage.addUser("user1", "Alice");
+    storage.compact();
+    storage.addUser("user2", "Bob");
+    
+    Preferences::refuseWrites() = true;
+    storage.compact();
+    Preferences::refuseWrites() = false;
+    
+    // What was stored before the refused snapshot is loaded as it was
+    DataStorage reloaded(true);
+    reloaded.begin();
+    TEST_ASSERT_TRUE(reloaded.userExists("Alice"));
+    TEST_ASSERT_TRUE(reloaded.userExists("Bob"));
+}
+
+void test_partly_written_snapshot_not_loaded(void) {
+    DataStorage storage(true, false);
+    storage.begin();
+    fillStorage(storage, 100);
+    storage.compact();
+    storage.addUser("user1", "Alice");
+    String expected = storage.getStateJson();
+    
+    // Two snapshots in a row fail after their first chunk; the
+    // second, retried for Bob, must not land on the stored one
+    Preferences::writesBeforeRefusing() = 1;
+    storage.compact();
+    Preferences::writesBeforeRefusing() = 1;
+    storage.addUser("user2", "Bob");
+    
+    DataStorage reloaded(true);
+    bool loaded = reloaded.begin();
+    Preferences::writesBeforeRefusing() = -1;
+    TEST_ASSERT_TRUE(loaded);
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), reloaded.getStateJson().c_str());
+}
+#endif
+
+// ============================================
+// Test Runner
+// ============================================
+
+void setup() {
+    delay(2000);  // Wait for serial
+    
+    UNITY_BEGIN();
+    
+    RUN_TEST(test_log_mode_writes_less_per_consumption);
+    RUN_TEST(test_log_record_is_small);
+    RUN_TEST(test_replay_restores_state);
+    RUN_TEST(test_compaction_after_max_entries);
+    RUN_TEST(test_stale_log_ignored_after_reset);
+    RUN_TEST(test_snapshot_mode_reload);
+    RUN_TEST(test_snapshot_in_chunks);
+    RUN_TEST(test_large_snapshot_round_trip);
+    RUN_TEST(test_legacy_snapshot_loaded);
+    RUN_TEST(test_legacy_long_name_truncated);
+    RUN_TEST(test_moved_from_default_partition);
+    RUN_TEST(test_unreadable_snapshot_kept);
+#ifdef NATIVE_PREFERENCES_H
+    RUN_TEST(test_refused_write_keeps_stored_data);
+    RUN_TEST(test_stored_data_intact_while_refused);
+    RUN_TEST(test_partly_written_snapshot_not_loaded);
+#endif
+    
+    UNITY_END();
+}
+
+void loop() {
+    // Nothing to do here
+}